@@ -0,0 +1,20 @@
+#!/usr/bin/env bash
+
+# Builds the mission server with the epoll and the io_uring event loops and
+# runs scripts/bench-server.sh on both, to compare their throughput, system
+# calls per second and command round trip latency:
+#
+#   scripts/bench-event-loops.sh 32 10
+
+CLIENTS=${1:-16}
+DURATION=${2:-10}
+
+cd "$(dirname "$0")/.."
+
+make -s OUT=build || exit 1
+make -s IO_URING=1 OUT=build-uring || exit 1
+
+for SERVER in build/mission-server build-uring/mission-server; do
+    echo "== $SERVER"
+    scripts/bench-server.sh $SERVER $CLIENTS $DURATION
+done
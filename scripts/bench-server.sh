@@ -0,0 +1,167 @@
+#!/usr/bin/env bash
+
+# Measures how fast the mission server fans the simulated flight controller
+# out to TCP clients, how many system calls it makes doing so, and how long
+# a command takes to go through it to the flight controller and back. Raise
+# the rates in configs/fcu_sim.yaml to saturate it, and build with
+# `make IO_URING=1 OUT=build-uring` to compare event loops (see
+# scripts/bench-event-loops.sh):
+#
+#   scripts/bench-server.sh build/mission-server 32 10
+#   scripts/bench-server.sh build-uring/mission-server 32 10
+#
+# System calls are counted with `perf stat`, or `strace -c` if perf cannot
+# trace the server. strace slows the server down, so only compare counts
+# taken the same way.
+
+SERVER=${1:-build/mission-server}
+CLIENTS=${2:-16}
+DURATION=${3:-10}
+PORT=${PORT:-18278}
+PROBE_HZ=${PROBE_HZ:-50}
+
+if [ ! -x "$SERVER" ]; then
+    echo "$SERVER not found, build it first"
+    exit 1
+fi
+
+SYSCALLS=$(mktemp)
+
+$SERVER --fcu-sim -p $PORT &
+SERVER_PID=$!
+trap "kill $SERVER_PID 2>/dev/null; rm -f $SYSCALLS" EXIT
+
+# Wait for the handshake with the simulator to complete
+sleep 2
+
+# Count the system calls of every thread of the server while it is measured
+if perf stat -e raw_syscalls:sys_enter -x, -o $SYSCALLS -p $SERVER_PID \
+        true 2>/dev/null; then
+    perf stat -e raw_syscalls:sys_enter -x, -o $SYSCALLS -p $SERVER_PID \
+        sleep $DURATION &
+    COUNTER="perf"
+elif command -v strace >/dev/null; then
+    strace -c -f -o $SYSCALLS -p $SERVER_PID &
+    COUNTER="strace"
+else
+    COUNTER=""
+fi
+COUNTER_PID=$!
+
+python3 - "$PORT" "$CLIENTS" "$DURATION" "$PROBE_HZ" <<'PYTHON'
+import selectors, socket, struct, sys, time
+
+port, clients, duration, probe_hz = (int(sys.argv[1]), int(sys.argv[2]),
+                                     float(sys.argv[3]), float(sys.argv[4]))
+
+def x25(data, crc=0xffff):
+    for b in data:
+        t = b ^ (crc & 0xff)
+        t = (t ^ (t << 4)) & 0xff
+        crc = (crc >> 8) ^ (t << 8) ^ (t << 3) ^ (t >> 4)
+    return crc
+
+def command_long(seq, command):
+    """A MAVLink 1 COMMAND_LONG from a GCS to the simulated autopilot"""
+    payload = struct.pack("<7fHBBB", 0, 0, 0, 0, 0, 0, 0, command, 1, 1, 0)
+    header = struct.pack("<BBBBB", len(payload), seq & 0xff, 255, 190, 76)
+    crc = x25(bytes([152]), x25(header + payload))  # CRC_EXTRA of #76
+    return b"\xfe" + header + payload + struct.pack("<H", crc)
+
+def frames(buf):
+    """Split whole frames off a client's stream, the server never cuts one"""
+    msgids = []
+    while len(buf) >= 8:
+        if buf[0] == 0xfe:
+            length, msgid = buf[1] + 8, buf[5]
+        elif buf[0] == 0xfd and len(buf) >= 10:
+            length = buf[1] + 12 + (13 if buf[2] & 1 else 0)
+            msgid = buf[7] | buf[8] << 8 | buf[9] << 16
+        elif buf[0] == 0xfd:
+            break
+        else:
+            del buf[0]
+            continue
+        if len(buf) < length:
+            break
+        msgids.append(msgid)
+        del buf[:length]
+    return msgids
+
+sel = selectors.DefaultSelector()
+received = {}
+
+# The probe connects first so it is the commanding client
+probe = socket.create_connection(("127.0.0.1", port))
+probe.setblocking(False)
+sel.register(probe, selectors.EVENT_READ)
+probe_buf = bytearray()
+
+for _ in range(clients):
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setblocking(False)
+    sel.register(sock, selectors.EVENT_READ)
+    received[sock] = 0
+
+rtts = []
+seq = 0
+sent_at = None
+next_probe = time.monotonic()
+
+start = time.monotonic()
+while time.monotonic() - start < duration:
+    now = time.monotonic()
+
+    # One request in flight at a time, a lost one times out after a second
+    if now >= next_probe and (sent_at is None or now - sent_at > 1):
+        probe.send(command_long(seq, 520))  # REQUEST_AUTOPILOT_CAPABILITIES
+        seq += 1
+        sent_at = now
+        next_probe = now + 1 / probe_hz
+
+    for key, _ in sel.select(timeout=0.01):
+        data = key.fileobj.recv(65536)
+        if key.fileobj is probe:
+            probe_buf += data
+            # AUTOPILOT_VERSION
+            if 148 in frames(probe_buf) and sent_at is not None:
+                rtts.append(time.monotonic() - sent_at)
+                sent_at = None
+        else:
+            received[key.fileobj] += len(data)
+elapsed = time.monotonic() - start
+
+total = sum(received.values())
+print("%d clients, %.1f s: %.2f MB/s in total, %.1f kB/s per client "
+      "(min %.1f, max %.1f)" %
+      (clients, elapsed, total / elapsed / 1e6,
+       total / elapsed / clients / 1e3,
+       min(received.values()) / elapsed / 1e3,
+       max(received.values()) / elapsed / 1e3))
+
+if rtts:
+    rtts.sort()
+    pick = lambda q: rtts[min(len(rtts) - 1, int(q * len(rtts)))] * 1e6
+    print("Command round trip over %d probes: p50 %.0f us, p99 %.0f us, "
+          "max %.0f us" % (len(rtts), pick(0.5), pick(0.99), rtts[-1] * 1e6))
+else:
+    print("No command round trip completed")
+PYTHON
+
+case $COUNTER in
+perf)
+    wait $COUNTER_PID
+    CALLS=$(awk -F, '/raw_syscalls:sys_enter/ { print $1 }' $SYSCALLS)
+    ;;
+strace)
+    kill -INT $COUNTER_PID
+    wait $COUNTER_PID
+    CALLS=$(awk '$NF == "total" { print $4 }' $SYSCALLS)
+    ;;
+esac
+
+if [ -n "$CALLS" ]; then
+    echo "System calls ($COUNTER): $((CALLS / DURATION))/s"
+else
+    echo "System calls not counted, perf or strace is needed"
+fi
@@ -0,0 +1,639 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bcast_ring.h"
+
+bool bcast_ring_init(struct bcast_ring *ring, size_t size)
+{
+    size_t capacity = 1;
+
+    /* Always room for a few of the largest frames */
+    if (size < 4 * BCAST_FRAME_MAX)
+        size = 4 * BCAST_FRAME_MAX;
+
+    /* Round up to a power of two so indexing is a simple mask */
+    while (capacity < size)
+        capacity <<= 1;
+
+    ring->buf = malloc(capacity);
+    ring->frame_slots = capacity / BCAST_FRAME_MIN;
+    ring->frames = malloc(ring->frame_slots * sizeof(struct bcast_frame));
+    ring->latest = calloc(BCAST_LATEST_SLOTS, sizeof(struct bcast_latest));
+    if (!ring->buf || !ring->frames || !ring->latest) {
+        bcast_ring_free(ring);
+        return false;
+    }
+
+    ring->size = capacity;
+    ring->head = 0;
+    ring->frame_head = 0;
+    ring->frame_tail = 0;
+    ring->readers = 0;
+
+    return true;
+}
+
+void bcast_ring_free(struct bcast_ring *ring)
+{
+    free(ring->buf);
+    free(ring->frames);
+    free(ring->latest);
+    ring->buf = NULL;
+    ring->frames = NULL;
+    ring->latest = NULL;
+    ring->size = 0;
+    ring->frame_slots = 0;
+}
+
+static inline struct bcast_frame *frame_at(const struct bcast_ring *ring,
+                                           uint64_t index)
+{
+    return &ring->frames[index & (ring->frame_slots - 1)];
+}
+
+static inline uint64_t frame_key(const struct bcast_frame *frame)
+{
+    return (uint64_t) frame->msgid << 16 | (uint64_t) frame->sysid << 8 |
+           frame->compid;
+}
+
+static inline size_t key_hash(uint64_t key, size_t slots)
+{
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & (slots - 1);
+}
+
+/* Append a frame, overwriting the oldest ones if needed */
+void bcast_ring_write(struct bcast_ring *ring,
+                      const uint8_t *data,
+                      size_t len,
+                      uint32_t msgid,
+                      uint8_t sysid,
+                      uint8_t compid,
+                      int src,
+                      int dest)
+{
+    if ((len < BCAST_FRAME_MIN) || (len > BCAST_FRAME_MAX))
+        return;
+
+    /* Retire the frames whose bytes are about to be overwritten first, this
+     * also frees the descriptor slot of the new frame */
+    uint64_t tail = ring->head + len > ring->size ? ring->head + len - ring->size
+                                                  : 0;
+    while ((ring->frame_tail != ring->frame_head) &&
+           (frame_at(ring, ring->frame_tail)->offset < tail))
+        ring->frame_tail++;
+
+    size_t off = (size_t) (ring->head & (ring->size - 1));
+    size_t first = ring->size - off;
+    if (first > len)
+        first = len;
+
+    memcpy(ring->buf + off, data, first);
+    memcpy(ring->buf, data + first, len - first);
+
+    struct bcast_frame *frame = frame_at(ring, ring->frame_head);
+    frame->offset = ring->head;
+    frame->msgid = msgid;
+    frame->len = (uint16_t) len;
+    frame->sysid = sysid;
+    frame->compid = compid;
+    frame->src = src;
+    frame->dest = dest;
+
+    /* Senders sharing a slot take turns, an older frame of theirs is then
+     * taken for the latest. A frame for a single endpoint would hide the
+     * earlier ones from the readers it is not for. */
+    if (dest == BCAST_DEST_ALL) {
+        uint64_t key = frame_key(frame);
+        struct bcast_latest *latest =
+            &ring->latest[key_hash(key, BCAST_LATEST_SLOTS)];
+        latest->key = key;
+        latest->index = ring->frame_head;
+    }
+
+    ring->head += len;
+    ring->frame_head++;
+}
+
+/* Copy bytes out of the ring, the caller makes sure they are still held */
+void bcast_ring_copy(const struct bcast_ring *ring,
+                     uint64_t offset,
+                     uint8_t *dst,
+                     size_t len)
+{
+    size_t off = (size_t) (offset & (ring->size - 1));
+    size_t first = ring->size - off;
+    if (first > len)
+        first = len;
+
+    memcpy(dst, ring->buf + off, first);
+    memcpy(dst + first, ring->buf, len - first);
+}
+
+/* Describe bytes held by the ring, returning the number of iovecs used */
+int bcast_ring_iov(const struct bcast_ring *ring,
+                   uint64_t offset,
+                   size_t len,
+                   struct iovec iov[2])
+{
+    size_t off = (size_t) (offset & (ring->size - 1));
+    size_t first = ring->size - off;
+
+    iov[0].iov_base = ring->buf + off;
+    if (first >= len) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->buf;
+    iov[1].iov_len = len - first;
+
+    return 2;
+}
+
+bool bcast_filter_match(const struct bcast_filter *filter,
+                        const struct bcast_frame *frame)
+{
+    if (!filter)
+        return true;
+
+    if ((filter->sysid && (filter->sysid != frame->sysid)) ||
+        (filter->compid && (filter->compid != frame->compid)))
+        return false;
+
+    if (filter->msgid_count == 0)
+        return true;
+
+    for (int i = 0; i < filter->msgid_count; i++) {
+        if (filter->msgids[i] == frame->msgid)
+            return true;
+    }
+
+    return false;
+}
+
+static inline bool routed_to(const struct bcast_reader *reader,
+                             const struct bcast_frame *frame)
+{
+    if (frame->dest == BCAST_DEST_ALL)
+        return frame->src != reader->endpoint;
+
+    return frame->dest == reader->endpoint;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Only the frames for every endpoint are tracked, and coalesced, see
+ * `bcast_ring_write()` */
+static bool is_latest(const struct bcast_ring *ring,
+                      uint64_t key,
+                      uint64_t index)
+{
+    const struct bcast_latest *latest =
+        &ring->latest[key_hash(key, BCAST_LATEST_SLOTS)];
+
+    return (latest->key != key) || (latest->index == index);
+}
+
+/* Find the slot of a sender's capped message, NULL if every slot is taken
+ * by other senders, whose frames are then not capped */
+static struct bcast_rate_slot *rate_slot(struct bcast_reader *reader,
+                                         uint64_t key,
+                                         uint64_t interval_ns)
+{
+    size_t idx = key_hash(key, BCAST_RATE_SLOTS);
+
+    for (size_t i = 0; i < BCAST_RATE_SLOTS; i++) {
+        struct bcast_rate_slot *slot =
+            &reader->rate_slots[(idx + i) & (BCAST_RATE_SLOTS - 1)];
+
+        if (slot->key == key)
+            return slot;
+
+        if (!slot->key) {
+            slot->key = key;
+            slot->next_ns = 0;
+            slot->interval_ns = interval_ns;
+            slot->index = UINT64_MAX;
+            slot->held = UINT64_MAX;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/* Let a frame of a capped message through and start its next interval */
+static void pass_rate(struct bcast_rate_slot *slot,
+                      uint64_t index,
+                      uint64_t now_ns)
+{
+    /* Keep the cadence unless the sender went quiet for a while */
+    slot->next_ns = now_ns - slot->next_ns < slot->interval_ns
+                        ? slot->next_ns + slot->interval_ns
+                        : now_ns + slot->interval_ns;
+    slot->index = index;
+    slot->held = UINT64_MAX;
+}
+
+/* Tell if a frame is within the rates of a reader. Older frames of a capped
+ * message are skipped in favor of the latest, which is held back until its
+ * interval is over. A frame let through is let through again if the send it
+ * was picked for did not go out. */
+static bool rate_allows(const struct bcast_ring *ring,
+                        struct bcast_reader *reader,
+                        const struct bcast_frame *frame,
+                        uint64_t index,
+                        uint64_t *now_ns)
+{
+    const struct bcast_rates *rates = reader->rates;
+    int i = 0;
+
+    while ((i < rates->count) && (rates->msgids[i] != frame->msgid))
+        i++;
+
+    if ((i == rates->count) || (frame->dest != BCAST_DEST_ALL))
+        return true;
+
+    /* Keys are tagged so the frames of sender 0 of msgid 0 get a slot */
+    uint64_t key = frame_key(frame);
+    struct bcast_rate_slot *slot =
+        rate_slot(reader, key | 1ull << 40, rates->interval_ns[i]);
+
+    if (!slot || (slot->index == index))
+        return true;
+
+    if (!is_latest(ring, key, index))
+        return false;
+
+    if (!*now_ns)
+        *now_ns = monotonic_ns();
+
+    if (*now_ns < slot->next_ns) {
+        slot->held = index;
+        if (!reader->held_due_ns || (slot->next_ns < reader->held_due_ns))
+            reader->held_due_ns = slot->next_ns;
+        return false;
+    }
+
+    pass_rate(slot, index, *now_ns);
+
+    return true;
+}
+
+static bool msgid_listed(const uint32_t *msgids, int count, uint32_t msgid)
+{
+    for (int i = 0; i < count; i++) {
+        if (msgids[i] == msgid)
+            return true;
+    }
+
+    return false;
+}
+
+static bool is_bulk(const struct bcast_reader *reader,
+                    const struct bcast_frame *frame)
+{
+    return msgid_listed(reader->shed->bulk, reader->shed->bulk_count,
+                        frame->msgid);
+}
+
+/* Tell if a frame is to be sent to a reader with a shed policy. Once a bulk
+ * frame has been deferred, the later ones are deferred as well so they are
+ * all sent in order. */
+static bool shed_allows(const struct bcast_ring *ring,
+                        struct bcast_reader *reader,
+                        const struct bcast_frame *frame,
+                        uint64_t index,
+                        bool congested)
+{
+    const struct bcast_shed *shed = reader->shed;
+
+    if (msgid_listed(shed->critical, shed->critical_count, frame->msgid))
+        return true;
+
+    if (is_bulk(reader, frame)) {
+        if (!congested && (reader->deferred == UINT64_MAX))
+            return true;
+
+        /* The send of an earlier batch may have been cut short */
+        if (index < reader->deferred)
+            reader->deferred = index;
+        return false;
+    }
+
+    return !congested || (frame->dest != BCAST_DEST_ALL) ||
+           is_latest(ring, frame_key(frame), index);
+}
+
+/* Tell if a reader's backlog takes up more than half of the ring */
+static bool is_congested(const struct bcast_ring *ring,
+                         const struct bcast_reader *reader)
+{
+    if (reader->cursor == ring->frame_head)
+        return false;
+
+    return ring->head - frame_at(ring, reader->cursor)->offset >
+           ring->size / 2;
+}
+
+static bool wants_frame(const struct bcast_reader *reader,
+                        const struct bcast_frame *frame)
+{
+    return routed_to(reader, frame) &&
+           bcast_filter_match(reader->filter, frame);
+}
+
+/* New readers only see frames written after they attached */
+void bcast_reader_attach(struct bcast_ring *ring,
+                         struct bcast_reader *reader,
+                         const struct bcast_filter *filter,
+                         const struct bcast_rates *rates,
+                         const struct bcast_shed *shed,
+                         int endpoint)
+{
+    reader->cursor = ring->frame_head;
+    reader->filter = filter;
+    reader->endpoint = endpoint;
+    reader->rates = rates && rates->count ? rates : NULL;
+    memset(reader->rate_slots, 0, sizeof(reader->rate_slots));
+    reader->held_due_ns = 0;
+    reader->shed = shed;
+    reader->deferred = UINT64_MAX;
+    ring->readers++;
+}
+
+void bcast_reader_detach(struct bcast_ring *ring, struct bcast_reader *reader)
+{
+    if (ring->readers)
+        ring->readers--;
+
+    reader->cursor = ring->frame_head;
+    reader->held_due_ns = 0;
+    reader->deferred = UINT64_MAX;
+}
+
+/* Move an overrun reader up to the oldest frame still held, returning the
+ * number of frames it lost, whether it wanted them or not */
+size_t bcast_reader_skip_to_tail(const struct bcast_ring *ring,
+                                 struct bcast_reader *reader)
+{
+    if (reader->cursor >= ring->frame_tail)
+        return 0;
+
+    size_t lost = (size_t) (ring->frame_tail - reader->cursor);
+    reader->cursor = ring->frame_tail;
+
+    return lost;
+}
+
+/* Add a frame to a batch, `end` being the offset right after the last frame
+ * added */
+static void add_frame(const struct bcast_ring *ring,
+                      struct bcast_batch *batch,
+                      const struct bcast_frame *frame,
+                      uint64_t index,
+                      uint64_t *end)
+{
+    batch->frame[batch->count].index = index;
+    batch->frame[batch->count].offset = frame->offset;
+    batch->frame[batch->count].len = frame->len;
+    batch->count++;
+    batch->bytes += frame->len;
+
+    size_t off = (size_t) (frame->offset & (ring->size - 1));
+    size_t first = ring->size - off;
+    if (first > frame->len)
+        first = frame->len;
+
+    /* Extend the previous iovec when the frames are adjacent */
+    if (batch->iovcnt && (*end == frame->offset) && (off != 0)) {
+        batch->iov[batch->iovcnt - 1].iov_len += first;
+    } else {
+        batch->iov[batch->iovcnt].iov_base = ring->buf + off;
+        batch->iov[batch->iovcnt].iov_len = first;
+        batch->iovcnt++;
+    }
+
+    /* The frame wraps around the end of the ring */
+    if (first < frame->len) {
+        batch->iov[batch->iovcnt].iov_base = ring->buf;
+        batch->iov[batch->iovcnt].iov_len = frame->len - first;
+        batch->iovcnt++;
+    }
+
+    *end = frame->offset + frame->len;
+}
+
+/* Pick the deferred bulk frames of a reader that has caught up, dropping the
+ * ones the ring no longer holds */
+static void peek_deferred(const struct bcast_ring *ring,
+                          struct bcast_reader *reader,
+                          struct bcast_batch *batch)
+{
+    uint64_t index = reader->deferred;
+    uint64_t now_ns = 0;
+    uint64_t end = 0;
+
+    if (index < ring->frame_tail)
+        index = ring->frame_tail;
+
+    while ((index < reader->cursor) && (batch->count < BCAST_BATCH_FRAMES) &&
+           (batch->iovcnt < BCAST_BATCH_FRAMES)) {
+        const struct bcast_frame *frame = frame_at(ring, index);
+
+        if (is_bulk(reader, frame) && wants_frame(reader, frame) &&
+            (!reader->rates ||
+             rate_allows(ring, reader, frame, index, &now_ns)))
+            add_frame(ring, batch, frame, index, &end);
+
+        index++;
+    }
+
+    batch->next = index;
+    batch->deferred = batch->count != 0;
+
+    if (!batch->count)
+        reader->deferred = UINT64_MAX;
+}
+
+/* Pick the frames held back by the rates of a reader whose interval is over,
+ * dropping the ones the ring no longer holds or has a newer frame for */
+static void peek_held(const struct bcast_ring *ring,
+                      struct bcast_reader *reader,
+                      struct bcast_batch *batch,
+                      uint64_t now_ns)
+{
+    uint64_t due_ns = 0;
+    uint64_t end = 0;
+
+    /* At most BCAST_RATE_SLOTS frames, a batch always has room for them */
+    for (int i = 0; i < BCAST_RATE_SLOTS; i++) {
+        struct bcast_rate_slot *slot = &reader->rate_slots[i];
+        uint64_t index = slot->held;
+
+        /* Still ahead of the cursor when a send was cut short, the frame is
+         * then looked at again in order */
+        if ((index == UINT64_MAX) || (index >= reader->cursor))
+            continue;
+
+        if ((index < ring->frame_tail) ||
+            !is_latest(ring, frame_key(frame_at(ring, index)), index)) {
+            slot->held = UINT64_MAX;
+            continue;
+        }
+
+        if (now_ns < slot->next_ns) {
+            if (!due_ns || (slot->next_ns < due_ns))
+                due_ns = slot->next_ns;
+            continue;
+        }
+
+        add_frame(ring, batch, frame_at(ring, index), index, &end);
+        pass_rate(slot, index, now_ns);
+    }
+
+    reader->held_due_ns = due_ns;
+    batch->next = reader->cursor;
+    batch->held = batch->count != 0;
+}
+
+/* Hold a frame picked by `peek_held()` again, its send did not go out */
+static void hold_again(struct bcast_reader *reader, uint64_t index)
+{
+    for (int i = 0; i < BCAST_RATE_SLOTS; i++) {
+        struct bcast_rate_slot *slot = &reader->rate_slots[i];
+
+        if (slot->key && (slot->index == index)) {
+            slot->held = index;
+            slot->next_ns = 0;
+            reader->held_due_ns = 1;
+            return;
+        }
+    }
+}
+
+/* Pick the next frames for a reader that it wants, skipping the others. The
+ * reader must not be overrun. The frames held back by the rates are sent
+ * first once they are due. A reader with a shed policy is sent the bulk
+ * frames it deferred once it has caught up. */
+void bcast_reader_peek(const struct bcast_ring *ring,
+                       struct bcast_reader *reader,
+                       struct bcast_batch *batch)
+{
+    uint64_t index = reader->cursor;
+    uint64_t now_ns = 0; /* Read once needed */
+    uint64_t end = 0;
+    bool congested = false;
+
+    batch->iovcnt = 0;
+    batch->count = 0;
+    batch->bytes = 0;
+    batch->deferred = false;
+    batch->held = false;
+
+    if (reader->held_due_ns) {
+        now_ns = monotonic_ns();
+        if (now_ns >= reader->held_due_ns) {
+            peek_held(ring, reader, batch, now_ns);
+            if (batch->count)
+                return;
+        }
+    }
+
+    if (reader->shed) {
+        if ((reader->deferred != UINT64_MAX) &&
+            (reader->cursor == ring->frame_head)) {
+            peek_deferred(ring, reader, batch);
+            if (batch->count)
+                return;
+        }
+
+        congested = is_congested(ring, reader);
+    }
+
+    /* A frame takes at most two iovecs, stop while there is room for it */
+    while ((index != ring->frame_head) &&
+           (batch->count < BCAST_BATCH_FRAMES) &&
+           (batch->iovcnt < BCAST_BATCH_FRAMES)) {
+        const struct bcast_frame *frame = frame_at(ring, index);
+
+        if (!wants_frame(reader, frame) ||
+            (reader->shed &&
+             !shed_allows(ring, reader, frame, index, congested)) ||
+            (reader->rates &&
+             !rate_allows(ring, reader, frame, index, &now_ns))) {
+            index++;
+            continue;
+        }
+
+        add_frame(ring, batch, frame, index++, &end);
+    }
+
+    batch->next = index;
+}
+
+/* Advance a reader past the part of a batch that was sent. If the send ended
+ * in the middle of a frame, the length of the rest of it is returned and its
+ * position is stored in `partial_offset`, so the caller can finish it before
+ * anything else. */
+size_t bcast_reader_consume(struct bcast_reader *reader,
+                            const struct bcast_batch *batch,
+                            size_t sent,
+                            uint64_t *partial_offset)
+{
+    uint64_t *cursor = batch->deferred ? &reader->deferred : &reader->cursor;
+    size_t rest = 0;
+
+    if (batch->held) {
+        for (int i = 0; i < batch->count; i++) {
+            if (sent >= batch->frame[i].len) {
+                sent -= batch->frame[i].len;
+            } else if (sent) {
+                *partial_offset = batch->frame[i].offset + sent;
+                rest = batch->frame[i].len - sent;
+                sent = 0;
+            } else {
+                hold_again(reader, batch->frame[i].index);
+            }
+        }
+
+        return rest;
+    }
+
+    if (sent >= batch->bytes) {
+        *cursor = batch->next;
+    } else {
+        for (int i = 0; i < batch->count; i++) {
+            *cursor = batch->frame[i].index + 1;
+
+            if (sent < batch->frame[i].len) {
+                if (sent == 0) {
+                    /* Nothing of this frame went out, send it again later */
+                    *cursor = batch->frame[i].index;
+                    break;
+                }
+
+                *partial_offset = batch->frame[i].offset + sent;
+                rest = batch->frame[i].len - sent;
+                break;
+            }
+
+            sent -= batch->frame[i].len;
+        }
+    }
+
+    /* Every deferred frame has been sent */
+    if (batch->deferred && (reader->deferred >= reader->cursor))
+        reader->deferred = UINT64_MAX;
+
+    return rest;
+}
@@ -0,0 +1,217 @@
+#ifndef __BCAST_RING_H__
+#define __BCAST_RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define BCAST_FRAME_MIN 8   /* Smallest MAVLink frame (v1, empty payload) */
+#define BCAST_FRAME_MAX 280 /* Largest MAVLink frame (v2, signed) */
+
+/* Most frames handed to a single send */
+#define BCAST_BATCH_FRAMES 64
+
+/* Most msgids a client can subscribe to */
+#define BCAST_FILTER_MSGIDS_MAX 32
+
+/* Destination of a frame for every reader but the one it came from */
+#define BCAST_DEST_ALL (-1)
+
+/* Most msgids a client can cap the rate of, and senders of them tracked */
+#define BCAST_RATE_MSGIDS_MAX 32
+#define BCAST_RATE_SLOTS 32
+
+/* Senders whose latest frame of each message the ring remembers */
+#define BCAST_LATEST_SLOTS 256
+
+/* Most msgids in each priority class of `struct bcast_shed` */
+#define BCAST_SHED_MSGIDS_MAX 32
+
+/* A frame held by the ring */
+struct bcast_frame {
+    uint64_t offset; /* Position of the first byte, see `head` */
+    uint32_t msgid;
+    uint16_t len;
+    uint8_t sysid;
+    uint8_t compid;
+    int32_t src;  /* Endpoint it came from */
+    int32_t dest; /* Endpoint it is for, or BCAST_DEST_ALL */
+};
+
+/* The latest frame of a sender's message for every endpoint */
+struct bcast_latest {
+    uint64_t key; /* msgid, sysid and compid */
+    uint64_t index;
+};
+
+/* Single-writer broadcast ring of whole MAVLink frames. Frame bytes are
+ * written once into a byte ring and indexed by a second ring of frame
+ * descriptors. Every reader keeps its own free-running frame cursor, so the
+ * memory used does not grow with the number of readers. The writer never
+ * waits: a reader whose next frame has been overwritten has been overrun and
+ * must be handled by its owner.
+ *
+ * There is a descriptor slot for every `BCAST_FRAME_MIN` bytes, so the
+ * descriptors of the frames still held by the byte ring are never
+ * overwritten. */
+struct bcast_ring {
+    uint8_t *buf;
+    size_t size;          /* Power of two */
+    uint64_t head;        /* Total bytes ever written */
+    struct bcast_frame *frames;
+    size_t frame_slots;   /* size / BCAST_FRAME_MIN */
+    uint64_t frame_head;  /* Total frames ever written */
+    uint64_t frame_tail;  /* Oldest frame whose bytes are still held */
+    unsigned readers;     /* Number of attached readers */
+    struct bcast_latest *latest; /* BCAST_LATEST_SLOTS, by key hash */
+};
+
+/* Frames a reader is interested in. An empty msgid list matches every
+ * message, a zero sysid or compid matches every system or component. */
+struct bcast_filter {
+    int msgid_count;
+    uint32_t msgids[BCAST_FILTER_MSGIDS_MAX];
+    uint8_t sysid;
+    uint8_t compid;
+};
+
+/* Caps on the rate of messages sent to a reader, for each sender on its
+ * own. Within an interval only one frame of a capped message is sent, the
+ * newest the ring holds when the interval is over. A frame that came too
+ * early is held back and sent then if no newer one has come by. Frames for
+ * a single endpoint are not capped. */
+struct bcast_rates {
+    int count;
+    uint32_t msgids[BCAST_RATE_MSGIDS_MAX];
+    uint64_t interval_ns[BCAST_RATE_MSGIDS_MAX];
+};
+
+/* When a reader may be sent the next frame of a sender's capped message */
+struct bcast_rate_slot {
+    uint64_t key; /* msgid, sysid and compid, 0 if free */
+    uint64_t next_ns;
+    uint64_t interval_ns;
+    uint64_t index; /* Frame let through last */
+    uint64_t held;  /* Frame held back until next_ns, UINT64_MAX if none */
+};
+
+/* Priority classes of the messages sent to a reader whose backlog takes up
+ * more than half of the ring. Critical messages are always sent. Bulk ones
+ * are deferred until the reader has caught up, and are then sent in order
+ * as long as the ring still holds them. Of every other message, only the
+ * latest instance of each sender is sent, unless the frame is for this
+ * reader alone. */
+struct bcast_shed {
+    int critical_count;
+    uint32_t critical[BCAST_SHED_MSGIDS_MAX];
+    int bulk_count;
+    uint32_t bulk[BCAST_SHED_MSGIDS_MAX];
+};
+
+/* A reader only gets the frames for its endpoint and the frames for every
+ * endpoint but those that came from it, see `struct bcast_frame`. */
+struct bcast_reader {
+    uint64_t cursor;                   /* Next frame to look at */
+    const struct bcast_filter *filter; /* NULL for every frame */
+    int endpoint;
+    const struct bcast_rates *rates; /* NULL for no caps */
+    struct bcast_rate_slot rate_slots[BCAST_RATE_SLOTS];
+    uint64_t held_due_ns; /* When the first held frame is due, 0 if none */
+    const struct bcast_shed *shed; /* NULL to never shed */
+    uint64_t deferred; /* Oldest bulk frame held back, UINT64_MAX if none */
+};
+
+/* Frames picked for a single send by `bcast_reader_peek()`. Adjacent frames
+ * share an iovec. */
+struct bcast_batch {
+    struct iovec iov[BCAST_BATCH_FRAMES + 1]; /* One more for the wrap */
+    int iovcnt;
+    int count;    /* Frames in the batch */
+    size_t bytes; /* Total length of the frames */
+    uint64_t next; /* Reader cursor once the whole batch has been sent */
+    bool deferred; /* Of deferred frames, `next` is then for `deferred` */
+    bool held;     /* Of held frames, the cursor is then left alone */
+    struct {
+        uint64_t index;
+        uint64_t offset;
+        uint16_t len;
+    } frame[BCAST_BATCH_FRAMES];
+};
+
+bool bcast_ring_init(struct bcast_ring *ring, size_t size);
+void bcast_ring_free(struct bcast_ring *ring);
+void bcast_ring_write(struct bcast_ring *ring,
+                      const uint8_t *data,
+                      size_t len,
+                      uint32_t msgid,
+                      uint8_t sysid,
+                      uint8_t compid,
+                      int src,
+                      int dest);
+void bcast_ring_copy(const struct bcast_ring *ring,
+                     uint64_t offset,
+                     uint8_t *dst,
+                     size_t len);
+int bcast_ring_iov(const struct bcast_ring *ring,
+                   uint64_t offset,
+                   size_t len,
+                   struct iovec iov[2]);
+
+/* Oldest byte position still held by the ring */
+static inline uint64_t bcast_ring_tail(const struct bcast_ring *ring)
+{
+    return ring->head > ring->size ? ring->head - ring->size : 0;
+}
+
+bool bcast_filter_match(const struct bcast_filter *filter,
+                        const struct bcast_frame *frame);
+
+void bcast_reader_attach(struct bcast_ring *ring,
+                         struct bcast_reader *reader,
+                         const struct bcast_filter *filter,
+                         const struct bcast_rates *rates,
+                         const struct bcast_shed *shed,
+                         int endpoint);
+void bcast_reader_detach(struct bcast_ring *ring, struct bcast_reader *reader);
+
+/* Held frames are not pending, they only are once `held_due_ns` is over */
+static inline bool bcast_reader_pending(const struct bcast_ring *ring,
+                                        const struct bcast_reader *reader)
+{
+    return (reader->cursor != ring->frame_head) ||
+           (reader->deferred != UINT64_MAX);
+}
+
+/* Bytes that can be written before the writer would overrun this reader */
+static inline size_t bcast_reader_space(const struct bcast_ring *ring,
+                                        const struct bcast_reader *reader)
+{
+    if (reader->cursor < ring->frame_tail)
+        return 0;
+
+    uint64_t offset =
+        reader->cursor == ring->frame_head
+            ? ring->head
+            : ring->frames[reader->cursor & (ring->frame_slots - 1)].offset;
+
+    return ring->size - (size_t) (ring->head - offset);
+}
+
+static inline bool bcast_reader_overrun(const struct bcast_ring *ring,
+                                        const struct bcast_reader *reader)
+{
+    return reader->cursor < ring->frame_tail;
+}
+
+size_t bcast_reader_skip_to_tail(const struct bcast_ring *ring,
+                                 struct bcast_reader *reader);
+void bcast_reader_peek(const struct bcast_ring *ring,
+                       struct bcast_reader *reader,
+                       struct bcast_batch *batch);
+size_t bcast_reader_consume(struct bcast_reader *reader,
+                            const struct bcast_batch *batch,
+                            size_t sent,
+                            uint64_t *partial_offset);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc16.h"
+
+/* Lengths checked from every CRC value and at every alignment */
+#define CHECK_SHORT_LEN 64
+#define CHECK_LONG_LEN 1024
+
+#define BENCH_BYTES (256 << 20)
+
+static uint8_t g_buf[CHECK_LONG_LEN + 16];
+
+static double monotonic_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Checks a kernel against the byte-wise table: every byte from every CRC
+ * value, short buffers from every CRC value, and long buffers at every
+ * alignment.
+ *
+ * @return The number of mismatches.
+ */
+static unsigned long check_kernel(const struct crc16_kernel *ref,
+                                  const struct crc16_kernel *kernel)
+{
+    unsigned long errors = 0;
+
+    for (uint32_t crc = 0; crc <= 0xffff; crc++) {
+        for (int b = 0; b < 256; b++) {
+            uint8_t byte = b;
+
+            errors +=
+                kernel->xmodem(crc, &byte, 1) != ref->xmodem(crc, &byte, 1);
+            errors += kernel->x25(crc, &byte, 1) != ref->x25(crc, &byte, 1);
+        }
+
+        for (size_t len = 0; len <= CHECK_SHORT_LEN; len++) {
+            errors += kernel->xmodem(crc, g_buf, len) !=
+                      ref->xmodem(crc, g_buf, len);
+            errors += kernel->x25(crc, g_buf, len) != ref->x25(crc, g_buf, len);
+        }
+    }
+
+    for (size_t off = 0; off < 16; off++) {
+        for (size_t len = 0; len <= CHECK_LONG_LEN; len++) {
+            const uint8_t *p = g_buf + off;
+
+            errors += kernel->xmodem(0, p, len) != ref->xmodem(0, p, len);
+            errors += kernel->x25(CRC16_X25_INIT, p, len) !=
+                      ref->x25(CRC16_X25_INIT, p, len);
+        }
+    }
+
+    return errors;
+}
+
+static void bench_kernel(const struct crc16_kernel *kernel, size_t len)
+{
+    size_t rounds = BENCH_BYTES / len;
+    uint16_t sum = 0;
+    double start = monotonic_sec();
+
+    for (size_t i = 0; i < rounds; i++)
+        sum ^= kernel->xmodem(0, g_buf, len);
+
+    double xmodem = monotonic_sec() - start;
+    start = monotonic_sec();
+
+    for (size_t i = 0; i < rounds; i++)
+        sum ^= kernel->x25(CRC16_X25_INIT, g_buf, len);
+
+    double x25 = monotonic_sec() - start;
+
+    printf("%-8s %5zu bytes  xmodem %8.1f MB/s  x25 %8.1f MB/s  (%04x)\n",
+           kernel->name, len, (double) (rounds * len) / xmodem / 1e6,
+           (double) (rounds * len) / x25 / 1e6, sum);
+}
+
+/**
+ * Checks the CRC kernels against the byte-wise table, then measures them on
+ * buffers of `len` bytes: a SIYI command is about 10, a MAVLink frame up to
+ * 280.
+ */
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoul(argv[1], NULL, 10) : 280;
+
+    if ((len == 0) || (len > CHECK_LONG_LEN)) {
+        fprintf(stderr, "usage: %s [bytes per buffer, up to %d]\n", argv[0],
+                CHECK_LONG_LEN);
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(g_buf); i++)
+        g_buf[i] = rand();
+
+    crc16_init();
+
+    const struct crc16_kernel *kernels;
+    size_t count = crc16_get_kernels(&kernels);
+    int ret = 0;
+
+    for (size_t i = 1; i < count; i++) {
+        unsigned long errors = check_kernel(&kernels[0], &kernels[i]);
+
+        printf("%-8s %s (%lu mismatches)\n", kernels[i].name,
+               errors ? "FAILED" : "matches the table", errors);
+        if (errors)
+            ret = 1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        bench_kernel(&kernels[i], len);
+
+    printf("selected: %s\n", crc16_kernel_name());
+
+    return ret;
+}
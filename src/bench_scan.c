@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc16.h"
+#include "mavlink.h"
+#include "mavlink_scan.h"
+
+/* Stream parsed by both parsers, a mix like the one of the FCU simulator */
+#define BENCH_STREAM_LEN (1 << 20)
+#define BENCH_ROUNDS 20
+
+static uint8_t g_stream[BENCH_STREAM_LEN + MAVLINK_MAX_PACKET_LEN];
+
+static double monotonic_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static size_t build_stream(void)
+{
+    size_t len = 0;
+
+    for (unsigned i = 0; len < BENCH_STREAM_LEN; i++) {
+        mavlink_message_t msg;
+
+        if (i % 10 == 0) {
+            mavlink_gps_raw_int_t gps = {.lat = 250330000 + i,
+                                         .lon = 1215650000,
+                                         .fix_type = GPS_FIX_TYPE_3D_FIX};
+            mavlink_msg_gps_raw_int_encode_chan(1, MAV_COMP_ID_AUTOPILOT1,
+                                                MAVLINK_COMM_0, &msg, &gps);
+        } else if (i % 5 == 0) {
+            mavlink_rc_channels_t rc = {.chancount = 8, .chan1_raw = 1500};
+            mavlink_msg_rc_channels_encode_chan(1, MAV_COMP_ID_AUTOPILOT1,
+                                                MAVLINK_COMM_0, &msg, &rc);
+        } else {
+            mavlink_attitude_t attitude = {.time_boot_ms = i, .roll = 0.1f};
+            mavlink_msg_attitude_encode_chan(1, MAV_COMP_ID_AUTOPILOT1,
+                                             MAVLINK_COMM_0, &msg, &attitude);
+        }
+
+        len += mavlink_msg_to_send_buffer(g_stream + len, &msg);
+    }
+
+    return len;
+}
+
+static void count_frame(const struct mavlink_frame_view *frame, void *ctx)
+{
+    if (frame->status == MAVLINK_FRAME_OK)
+        (*(unsigned long *) ctx)++;
+}
+
+static void report(const char *name,
+                   unsigned long frames,
+                   size_t len,
+                   double secs)
+{
+    printf("%-12s %10lu frames %10.1f MB/s\n", name, frames,
+           (double) len * BENCH_ROUNDS / secs / 1e6);
+}
+
+/**
+ * Compares the bulk frame scanner with the byte at a time parser it
+ * replaced, fed `chunk` bytes at a time like serial reads.
+ */
+int main(int argc, char **argv)
+{
+    size_t chunk = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    size_t len = build_stream();
+
+    if (chunk == 0) {
+        fprintf(stderr, "usage: %s [bytes per read]\n", argv[0]);
+        return 1;
+    }
+
+    crc16_init();
+
+    printf("%zu bytes, %zu bytes per read, %d rounds\n", len, chunk,
+           BENCH_ROUNDS);
+
+    unsigned long frames = 0;
+    mavlink_message_t msg;
+    mavlink_status_t status;
+    double start = monotonic_sec();
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < len; i++) {
+            if (mavlink_frame_char(MAVLINK_COMM_1, g_stream[i], &msg,
+                                   &status) == MAVLINK_FRAMING_OK)
+                frames++;
+        }
+    }
+
+    report("byte-at-time", frames, len, monotonic_sec() - start);
+
+    struct mavlink_scanner scanner;
+    memset(&scanner, 0, sizeof(scanner));
+    frames = 0;
+    start = monotonic_sec();
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < len; i += chunk) {
+            size_t n = len - i < chunk ? len - i : chunk;
+            mavlink_scan(&scanner, g_stream + i, n, count_frame, &frames);
+        }
+    }
+
+    report("scanner", frames, len, monotonic_sec() - start);
+
+    return 0;
+}
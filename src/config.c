@@ -8,6 +8,7 @@
 #include "rtsp_stream.h"
 #include "serial.h"
 #include "siyi_camera.h"
+#include "uart_server.h"
 
 #define READ_PARAM_START(verbose) \
     do {                          \
@@ -68,12 +69,26 @@ static char *camera_model_list[] = {
 static int camera_vendor_idx = 0;
 static int camera_model_idx = 0;
 
+struct serial_link_config {
+    char *port;
+    int baudrate; /* 0 for the baudrate of link 0 */
+    int net_port;
+    char *redundant_port; /* Second port to the same FCU, empty for none */
+};
+
 struct serial_config {
     char *port;
     int baudrate;
     int parity;
     int data_bits;
     int stop_bits;
+    bool rtscts;
+    bool low_latency;
+    int latency_timer;
+    int vmin;
+    int vtime;
+    int latency_probes;
+    struct serial_link_config links[SERIAL_LINK_MAX]; /* Link 0 is `port` */
 };
 
 struct device_config {
@@ -82,7 +97,33 @@ struct device_config {
     bool enabled;
 };
 
-static struct serial_config serial_cfg;
+static struct serial_config serial_cfg = {
+    .vmin = 1,
+    .vtime = -1,
+    .latency_probes = 5,
+    .links = {{"", 0, 0, ""}, {"", 0, 0, ""}, {"", 0, 0, ""}, {"", 0, 0, ""}},
+};
+static struct server_config server_cfg = {
+    .client_queue_size = 65536,
+    .slow_client_policy = SLOW_CLIENT_DROP_OLDEST,
+    .max_clients = 64,
+    .listen_backlog = 128,
+    .endpoints = {{.uplink_weight = 1},
+                  {.uplink_weight = 1},
+                  {.uplink_weight = 1},
+                  {.uplink_weight = 1}},
+    .udp = {{0, "", 1}, {0, "", 1}, {0, "", 1}, {0, "", 1}},
+    .uplink_policy = UPLINK_COMMANDER,
+    .uplink_weight = 1,
+};
+static struct fcu_sim_config fcu_sim_cfg = {
+    .sysid = 1,
+    .baudrate = 0,
+    .heartbeat_rate = 1,
+    .attitude_rate = 250,
+    .rc_channels_rate = 50,
+    .gps_raw_int_rate = 10,
+};
 static struct device_config devs[CAMERA_NUM_MAX];
 static config_rc_t rc_channels[18];
 
@@ -179,6 +220,16 @@ static void siyi_camera_init(int id)
     gimbal_centering(id);
 }
 
+#define READ_LINK_CONFIG(link_num)                                   \
+    READ_PARAM(key, "link" #link_num "-port", TYPE_STRING,           \
+               &serial_cfg.links[link_num].port)                     \
+    READ_PARAM(key, "link" #link_num "-baudrate", TYPE_INT,          \
+               &serial_cfg.links[link_num].baudrate)                 \
+    READ_PARAM(key, "link" #link_num "-net-port", TYPE_INT,          \
+               &serial_cfg.links[link_num].net_port)                 \
+    READ_PARAM(key, "link" #link_num "-redundant-port", TYPE_STRING, \
+               &serial_cfg.links[link_num].redundant_port)
+
 void load_serial_configs(char *yaml_path)
 {
     char *stop_bits = "";
@@ -214,6 +265,20 @@ void load_serial_configs(char *yaml_path)
             READ_PARAM(key, "parity", TYPE_STRING, &parity);
             READ_PARAM(key, "data-bits", TYPE_INT, &serial_cfg.data_bits);
             READ_PARAM(key, "stop-bits", TYPE_STRING, &stop_bits);
+            READ_PARAM(key, "rtscts", TYPE_BOOL, &serial_cfg.rtscts);
+            READ_PARAM(key, "low-latency", TYPE_BOOL,
+                       &serial_cfg.low_latency);
+            READ_PARAM(key, "latency-timer", TYPE_INT,
+                       &serial_cfg.latency_timer);
+            READ_PARAM(key, "vmin", TYPE_INT, &serial_cfg.vmin);
+            READ_PARAM(key, "vtime", TYPE_INT, &serial_cfg.vtime);
+            READ_PARAM(key, "latency-probes", TYPE_INT,
+                       &serial_cfg.latency_probes);
+            READ_PARAM(key, "redundant-port", TYPE_STRING,
+                       &serial_cfg.links[0].redundant_port);
+            READ_LINK_CONFIG(1);
+            READ_LINK_CONFIG(2);
+            READ_LINK_CONFIG(3);
             READ_PARAM_END();
         }
 
@@ -257,6 +322,412 @@ void load_serial_configs(char *yaml_path)
                 "Stop bits must be either empty or one of 1, 1.5, "
                 "or 2");
     }
+
+    if (serial_cfg.latency_timer < 0 || serial_cfg.latency_timer > 255) {
+        fprintf(stderr, "Latency timer must be between 0 and 255 ms\n");
+        exit(1);
+    }
+
+    /* A VMIN of 0 would leave the port always readable and spin the event
+     * loop */
+    if (serial_cfg.vmin < 1 || serial_cfg.vmin > 255) {
+        fprintf(stderr, "VMIN must be between 1 and 255\n");
+        exit(1);
+    }
+
+    if (serial_cfg.vtime < -1 || serial_cfg.vtime > 255) {
+        fprintf(stderr, "VTIME must be between -1 and 255\n");
+        exit(1);
+    }
+
+    if (serial_cfg.latency_probes < 0) {
+        fprintf(stderr, "Latency probes must not be negative\n");
+        exit(1);
+    }
+
+    for (int i = 1; i < SERIAL_LINK_MAX; i++) {
+        struct serial_link_config *link = &serial_cfg.links[i];
+
+        if (!link->port[0])
+            continue;
+
+        if (link->baudrate < 0) {
+            fprintf(stderr, "Link %d baudrate must not be negative\n", i);
+            exit(1);
+        }
+
+        if (link->net_port < 1 || link->net_port > 0xffff) {
+            fprintf(stderr, "Link %d net port must be in the range 1-65535\n",
+                    i);
+            exit(1);
+        }
+
+        for (int j = 1; j < i; j++) {
+            if (serial_cfg.links[j].port[0] &&
+                (serial_cfg.links[j].net_port == link->net_port)) {
+                fprintf(stderr, "Links %d and %d share net port %d\n", j, i,
+                        link->net_port);
+                exit(1);
+            }
+        }
+    }
+}
+
+#define READ_ENDPOINT_CONFIG(ep_num)                                 \
+    READ_PARAM(key, "endpoint" #ep_num "-port", TYPE_INT,            \
+               &server_cfg.endpoints[ep_num].port)                   \
+    READ_PARAM(key, "endpoint" #ep_num "-msgids", TYPE_STRING,       \
+               &endpoint_msgids[ep_num])                             \
+    READ_PARAM(key, "endpoint" #ep_num "-sysid", TYPE_INT,           \
+               &endpoint_sysid[ep_num])                              \
+    READ_PARAM(key, "endpoint" #ep_num "-compid", TYPE_INT,          \
+               &endpoint_compid[ep_num])                             \
+    READ_PARAM(key, "endpoint" #ep_num "-uplink-weight", TYPE_INT,   \
+               &server_cfg.endpoints[ep_num].uplink_weight)          \
+    READ_PARAM(key, "endpoint" #ep_num "-rates", TYPE_STRING,        \
+               &endpoint_rates[ep_num])
+
+#define READ_UDP_CONFIG(udp_num)                                \
+    READ_PARAM(key, "udp" #udp_num "-port", TYPE_INT,           \
+               &server_cfg.udp[udp_num].port)                   \
+    READ_PARAM(key, "udp" #udp_num "-peer", TYPE_STRING,        \
+               &server_cfg.udp[udp_num].peer)                   \
+    READ_PARAM(key, "udp" #udp_num "-uplink-weight", TYPE_INT,  \
+               &server_cfg.udp[udp_num].uplink_weight)          \
+    READ_PARAM(key, "udp" #udp_num "-rates", TYPE_STRING,       \
+               &udp_rates[udp_num])
+
+/**
+ * Parses up to `max` comma separated msgids, e.g. "30, 24".
+ */
+static void parse_msgids(const char *name,
+                         const char *list,
+                         uint32_t *msgids,
+                         int *count,
+                         int max)
+{
+    const char *s = list;
+
+    *count = 0;
+
+    while (*s) {
+        char *end;
+        unsigned long msgid = strtoul(s, &end, 10);
+
+        if ((end == s) || (msgid > 0xffffff) || (*count == max)) {
+            fprintf(stderr,
+                    "%s must be a list of up to %d message IDs separated by "
+                    "commas\n",
+                    name, max);
+            exit(1);
+        }
+
+        msgids[(*count)++] = (uint32_t) msgid;
+
+        s = end;
+        while (*s == ' ' || *s == ',')
+            s++;
+    }
+}
+
+static void parse_endpoint_filter(int ep_num,
+                                  const char *msgids,
+                                  int sysid,
+                                  int compid)
+{
+    struct bcast_filter *filter = &server_cfg.endpoints[ep_num].filter;
+
+    if (server_cfg.endpoints[ep_num].port < 0 ||
+        server_cfg.endpoints[ep_num].port > 0xffff) {
+        fprintf(stderr, "Endpoint %d port must be in the range 1-65535\n",
+                ep_num);
+        exit(1);
+    }
+
+    if (sysid < 0 || sysid > 255 || compid < 0 || compid > 255) {
+        fprintf(stderr, "Endpoint %d sysid and compid must be 0-255\n",
+                ep_num);
+        exit(1);
+    }
+
+    filter->sysid = sysid;
+    filter->compid = compid;
+
+    char name[sizeof("endpoint0-msgids")];
+    snprintf(name, sizeof(name), "endpoint%d-msgids", ep_num);
+    parse_msgids(name, msgids, filter->msgids, &filter->msgid_count,
+                 BCAST_FILTER_MSGIDS_MAX);
+}
+
+/**
+ * Parses rate caps given as comma separated "msgid:Hz" pairs, e.g.
+ * "30:10, 65:2" caps ATTITUDE at 10 Hz and RC_CHANNELS at 2 Hz per sender.
+ */
+static void parse_rates(const char *name,
+                        const char *list,
+                        struct bcast_rates *rates)
+{
+    const char *s = list;
+
+    rates->count = 0;
+
+    while (*s) {
+        char *end;
+        unsigned long msgid = strtoul(s, &end, 10);
+        double hz = 0;
+
+        if ((end != s) && (*end == ':')) {
+            s = end + 1;
+            hz = strtod(s, &end);
+        }
+
+        if ((end == s) || (msgid > 0xffffff) || !(hz > 0) || (hz > 1e6) ||
+            (rates->count == BCAST_RATE_MSGIDS_MAX)) {
+            fprintf(stderr,
+                    "%s must be a list of up to %d msgid:Hz pairs separated "
+                    "by commas\n",
+                    name, BCAST_RATE_MSGIDS_MAX);
+            exit(1);
+        }
+
+        rates->msgids[rates->count] = (uint32_t) msgid;
+        rates->interval_ns[rates->count] = (uint64_t) (1e9 / hz);
+        rates->count++;
+
+        s = end;
+        while (*s == ' ' || *s == ',')
+            s++;
+    }
+}
+
+static bool valid_uplink_weight(int weight)
+{
+    return weight >= 1 && weight <= UPLINK_WEIGHT_MAX;
+}
+
+void load_server_configs(char *yaml_path)
+{
+    char *slow_client_policy = "drop-oldest";
+    char *uplink_policy = "commander";
+    char *endpoint_msgids[SERVER_ENDPOINT_MAX] = {"", "", "", ""};
+    int endpoint_sysid[SERVER_ENDPOINT_MAX] = {0};
+    int endpoint_compid[SERVER_ENDPOINT_MAX] = {0};
+    char *endpoint_rates[SERVER_ENDPOINT_MAX] = {"", "", "", ""};
+    char *udp_rates[SERVER_UDP_MAX] = {"", "", "", ""};
+    char *client_rates = "";
+    char *shed_critical = "0, 77, 253";
+    char *shed_bulk = "22, 120";
+
+    /* Open the yaml file */
+    FILE *file = fopen(yaml_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open the YAML file.\n");
+        exit(1);
+    }
+
+    yaml_parser_t parser;
+    yaml_event_t event;
+    yaml_event_type_t event_type;
+
+    yaml_parser_initialize(&parser);
+    yaml_parser_set_input_file(&parser, file);
+
+    do {
+        if (!yaml_parser_parse(&parser, &event)) {
+            fprintf(stderr, "Failed to load configuration\n");
+            exit(1);
+        }
+
+        event_type = event.type;
+        yaml_char_t *key = event.data.scalar.value;
+
+        if (event_type == YAML_SCALAR_EVENT) {
+            READ_PARAM_START(true);
+            READ_PARAM(key, "client-queue-size", TYPE_INT,
+                       &server_cfg.client_queue_size);
+            READ_PARAM(key, "slow-client-policy", TYPE_STRING,
+                       &slow_client_policy);
+            READ_PARAM(key, "shed-critical-msgids", TYPE_STRING,
+                       &shed_critical);
+            READ_PARAM(key, "shed-bulk-msgids", TYPE_STRING, &shed_bulk);
+            READ_PARAM(key, "raw-port", TYPE_INT, &server_cfg.raw_port);
+            READ_PARAM(key, "max-clients", TYPE_INT, &server_cfg.max_clients);
+            READ_PARAM(key, "listen-backlog", TYPE_INT,
+                       &server_cfg.listen_backlog);
+            READ_PARAM(key, "uplink-policy", TYPE_STRING, &uplink_policy);
+            READ_PARAM(key, "uplink-weight", TYPE_INT,
+                       &server_cfg.uplink_weight);
+            READ_PARAM(key, "client-rates", TYPE_STRING, &client_rates);
+            READ_PARAM(key, "stats-interval", TYPE_INT,
+                       &server_cfg.stats_interval);
+            READ_ENDPOINT_CONFIG(0);
+            READ_ENDPOINT_CONFIG(1);
+            READ_ENDPOINT_CONFIG(2);
+            READ_ENDPOINT_CONFIG(3);
+            READ_UDP_CONFIG(0);
+            READ_UDP_CONFIG(1);
+            READ_UDP_CONFIG(2);
+            READ_UDP_CONFIG(3);
+            READ_PARAM_END();
+        }
+
+        yaml_event_delete(&event);
+    } while (event_type != YAML_STREAM_END_EVENT);
+
+    fclose(file);
+    yaml_parser_delete(&parser);
+
+    if (server_cfg.client_queue_size <= 0) {
+        fprintf(stderr, "Client queue size must be a positive number\n");
+        exit(1);
+    }
+
+    if (server_cfg.raw_port < 0 || server_cfg.raw_port > 0xffff) {
+        fprintf(stderr, "Raw port must be in the range 1-65535, or 0\n");
+        exit(1);
+    }
+
+    if (server_cfg.max_clients <= 0 || server_cfg.max_clients > 0xffff) {
+        fprintf(stderr, "Max clients must be in the range 1-65535\n");
+        exit(1);
+    }
+
+    if (server_cfg.listen_backlog <= 0) {
+        fprintf(stderr, "Listen backlog must be a positive number\n");
+        exit(1);
+    }
+
+    if (server_cfg.stats_interval < 0 || server_cfg.stats_interval > 86400) {
+        fprintf(stderr, "Stats interval must be in the range 0-86400\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        parse_endpoint_filter(i, endpoint_msgids[i], endpoint_sysid[i],
+                              endpoint_compid[i]);
+    }
+
+    struct bcast_shed *shed = &server_cfg.shed;
+    parse_msgids("shed-critical-msgids", shed_critical, shed->critical,
+                 &shed->critical_count, BCAST_SHED_MSGIDS_MAX);
+    parse_msgids("shed-bulk-msgids", shed_bulk, shed->bulk, &shed->bulk_count,
+                 BCAST_SHED_MSGIDS_MAX);
+
+    char name[sizeof("endpoint0-rates")];
+
+    parse_rates("client-rates", client_rates, &server_cfg.client_rates);
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        snprintf(name, sizeof(name), "endpoint%d-rates", i);
+        parse_rates(name, endpoint_rates[i], &server_cfg.endpoints[i].rates);
+    }
+    for (int i = 0; i < SERVER_UDP_MAX; i++) {
+        snprintf(name, sizeof(name), "udp%d-rates", i);
+        parse_rates(name, udp_rates[i], &server_cfg.udp[i].rates);
+    }
+
+    bool weights_valid = valid_uplink_weight(server_cfg.uplink_weight);
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++)
+        weights_valid &=
+            valid_uplink_weight(server_cfg.endpoints[i].uplink_weight);
+    for (int i = 0; i < SERVER_UDP_MAX; i++)
+        weights_valid &= valid_uplink_weight(server_cfg.udp[i].uplink_weight);
+
+    if (!weights_valid) {
+        fprintf(stderr, "Uplink weights must be in the range 1-%d\n",
+                UPLINK_WEIGHT_MAX);
+        exit(1);
+    }
+
+    for (int i = 0; i < SERVER_UDP_MAX; i++) {
+        if (server_cfg.udp[i].port < 0 || server_cfg.udp[i].port > 0xffff) {
+            fprintf(stderr,
+                    "UDP endpoint %d port must be in the range 0-65535\n", i);
+            exit(1);
+        }
+    }
+
+    if (strcmp("drop-oldest", slow_client_policy) == 0) {
+        server_cfg.slow_client_policy = SLOW_CLIENT_DROP_OLDEST;
+    } else if (strcmp("drop-client", slow_client_policy) == 0) {
+        server_cfg.slow_client_policy = SLOW_CLIENT_DROP_CLIENT;
+    } else if (strcmp("stall", slow_client_policy) == 0) {
+        server_cfg.slow_client_policy = SLOW_CLIENT_STALL;
+    } else if (strcmp("shed", slow_client_policy) == 0) {
+        server_cfg.slow_client_policy = SLOW_CLIENT_SHED;
+    } else {
+        fprintf(stderr,
+                "Slow client policy must be one of drop-oldest, "
+                "drop-client, stall, or shed\n");
+        exit(1);
+    }
+
+    if (strcmp("commander", uplink_policy) == 0) {
+        server_cfg.uplink_policy = UPLINK_COMMANDER;
+    } else if (strcmp("merge", uplink_policy) == 0) {
+        server_cfg.uplink_policy = UPLINK_MERGE;
+    } else {
+        fprintf(stderr, "Uplink policy must be either commander or merge\n");
+        exit(1);
+    }
+}
+
+void load_fcu_sim_configs(char *yaml_path)
+{
+    /* Open the yaml file */
+    FILE *file = fopen(yaml_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open the YAML file.\n");
+        exit(1);
+    }
+
+    yaml_parser_t parser;
+    yaml_event_t event;
+    yaml_event_type_t event_type;
+
+    yaml_parser_initialize(&parser);
+    yaml_parser_set_input_file(&parser, file);
+
+    do {
+        if (!yaml_parser_parse(&parser, &event)) {
+            fprintf(stderr, "Failed to load configuration\n");
+            exit(1);
+        }
+
+        event_type = event.type;
+        yaml_char_t *key = event.data.scalar.value;
+
+        if (event_type == YAML_SCALAR_EVENT) {
+            READ_PARAM_START(true);
+            READ_PARAM(key, "sysid", TYPE_INT, &fcu_sim_cfg.sysid);
+            READ_PARAM(key, "baudrate", TYPE_INT, &fcu_sim_cfg.baudrate);
+            READ_PARAM(key, "heartbeat-rate", TYPE_INT,
+                       &fcu_sim_cfg.heartbeat_rate);
+            READ_PARAM(key, "attitude-rate", TYPE_INT,
+                       &fcu_sim_cfg.attitude_rate);
+            READ_PARAM(key, "rc-channels-rate", TYPE_INT,
+                       &fcu_sim_cfg.rc_channels_rate);
+            READ_PARAM(key, "gps-raw-int-rate", TYPE_INT,
+                       &fcu_sim_cfg.gps_raw_int_rate);
+            READ_PARAM_END();
+        }
+
+        yaml_event_delete(&event);
+    } while (event_type != YAML_STREAM_END_EVENT);
+
+    fclose(file);
+    yaml_parser_delete(&parser);
+
+    if (fcu_sim_cfg.sysid < 1 || fcu_sim_cfg.sysid > 255) {
+        fprintf(stderr, "Simulated FCU sysid must be in the range 1-255\n");
+        exit(1);
+    }
+
+    if (fcu_sim_cfg.baudrate < 0 || fcu_sim_cfg.heartbeat_rate < 0 ||
+        fcu_sim_cfg.attitude_rate < 0 || fcu_sim_cfg.rc_channels_rate < 0 ||
+        fcu_sim_cfg.gps_raw_int_rate < 0) {
+        fprintf(stderr, "Simulated FCU rates must not be negative\n");
+        exit(1);
+    }
 }
 
 #define READ_DEVICE_CONFIG(dev_num)                           \
@@ -405,6 +876,63 @@ void get_serial_port_config(char **port_name, struct SerialConfig *config)
     config->parity = serial_cfg.parity;
     config->data_bits = serial_cfg.data_bits;
     config->stop_bits = serial_cfg.stop_bits;
+    config->rtscts = serial_cfg.rtscts;
+    config->low_latency = serial_cfg.low_latency;
+    config->latency_timer = serial_cfg.latency_timer;
+    config->vmin = serial_cfg.vmin;
+    config->vtime = serial_cfg.vtime;
+}
+
+int get_serial_latency_probes(void)
+{
+    return serial_cfg.latency_probes;
+}
+
+/**
+ * Gets the serial port of an additional link (from 1), which shares the
+ * settings of link 0 except for its port and baudrate.
+ *
+ * @return false if the link is not configured.
+ */
+bool get_serial_link_config(int link,
+                            char **port_name,
+                            struct SerialConfig *config,
+                            unsigned *net_port)
+{
+    if ((link < 1) || (link >= SERIAL_LINK_MAX) ||
+        !serial_cfg.links[link].port[0])
+        return false;
+
+    struct serial_link_config *link_cfg = &serial_cfg.links[link];
+
+    get_serial_port_config(port_name, config);
+    *port_name = link_cfg->port;
+    if (link_cfg->baudrate)
+        config->baudrate = link_cfg->baudrate;
+    *net_port = link_cfg->net_port;
+
+    return true;
+}
+
+/**
+ * Gets the redundant port of a link, read along with its port. It shares
+ * every setting of the link's port.
+ *
+ * @return The name of the port, or an empty string if there is none.
+ */
+char *get_serial_redundant_port(int link)
+{
+    return serial_cfg.links[link].redundant_port;
+}
+
+void get_server_config(struct server_config *config)
+{
+    *config = server_cfg;
+}
+
+void get_fcu_sim_config(struct fcu_sim_config *config)
+{
+    *config = fcu_sim_cfg;
 }
 
 void get_rc_config(int rc_channel, config_rc_t *config)
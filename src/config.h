@@ -3,7 +3,10 @@
 
 #include <stdbool.h>
 
+#include "fcu_sim.h"
 #include "serial.h"
+#include "serial_link.h"
+#include "uart_server.h"
 
 typedef struct {
     int min;
@@ -13,6 +16,8 @@ typedef struct {
 } config_rc_t;
 
 void load_serial_configs(char *yaml_path);
+void load_server_configs(char *yaml_path);
+void load_fcu_sim_configs(char *yaml_path);
 void load_devices_configs(char *yaml_path);
 void load_rc_configs(char *yaml_path);
 
@@ -20,6 +25,14 @@ char *get_camera_vendor_name(void);
 char *get_camera_model_name(void);
 
 void get_serial_port_config(char **port_name, struct SerialConfig *config);
+int get_serial_latency_probes(void);
+bool get_serial_link_config(int link,
+                            char **port_name,
+                            struct SerialConfig *config,
+                            unsigned *net_port);
+char *get_serial_redundant_port(int link);
+void get_server_config(struct server_config *config);
+void get_fcu_sim_config(struct fcu_sim_config *config);
 
 void get_rc_config(int rc_channel, config_rc_t *config);
 int get_rc_config_min(int rc_channel);
@@ -1,5 +1,38 @@
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC16_HAVE_CLMUL
+#define CRC16_CLMUL_NAME "pclmul"
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3,sse4.1")))
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define CRC16_HAVE_CLMUL
+#define CRC16_CLMUL_NAME "pmull"
+#if defined(__clang__)
+#define CLMUL_TARGET __attribute__((target("aes")))
+#else
+#define CLMUL_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+#include "crc16.h"
+
+/* Both CRCs divide by x^16 + x^12 + x^5 + 1, MAVLink with the bits of every
+ * byte the other way round */
+#define CRC16_POLY 0x1021
+#define CRC16_POLY_REFLECTED 0x8408
+
+/* Shorter buffers are not worth folding with carry-less multiplies */
+#define CRC16_CLMUL_MIN 32
+
+/* Buffers the kernels are checked on before being picked */
+#define CRC16_CHECK_LEN 300
+
 static const uint16_t crc16_tab[256] = {
     0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7, 0x8108,
     0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF, 0x1231, 0x0210,
@@ -32,15 +65,404 @@ static const uint16_t crc16_tab[256] = {
     0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
 };
 
-uint16_t crc16_calculate(uint8_t *ptr, uint32_t len)
+/* Slicing-by-8 tables: the CRC of a byte followed by 0 to 7 zero bytes */
+static uint16_t crc16_slice[8][256];
+static uint16_t crc16_x25_slice[8][256];
+
+static uint16_t xmodem_table(uint16_t crc, const uint8_t *ptr, size_t len)
 {
-    uint16_t crc = 0x0;
-    uint8_t *byte = ptr;
+    for (size_t i = 0; i < len; i++)
+        crc = ((crc << 8) & 0xff00) ^ crc16_tab[((crc >> 8) & 0xff) ^ ptr[i]];
+
+    return crc;
+}
 
-    for (int i = 0; i < len; i++) {
-        crc = ((crc << 8) & 0xff00) ^ crc16_tab[((crc >> 8) & 0xff) ^ *byte];
-        byte++;
+/**
+ * The CRC of MAVLink the way crc_accumulate() computes it.
+ */
+static uint16_t x25_bitwise(uint16_t crc, const uint8_t *ptr, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        uint8_t tmp = ptr[i] ^ (uint8_t) (crc & 0xff);
+        tmp ^= (tmp << 4);
+        crc = (crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4);
     }
 
     return crc;
 }
+
+static uint16_t xmodem_slice8(uint16_t crc, const uint8_t *ptr, size_t len)
+{
+    const uint16_t(*t)[256] = crc16_slice;
+
+    for (; len >= 8; ptr += 8, len -= 8) {
+        crc = t[7][ptr[0] ^ (crc >> 8)] ^ t[6][ptr[1] ^ (crc & 0xff)] ^
+              t[5][ptr[2]] ^ t[4][ptr[3]] ^ t[3][ptr[4]] ^ t[2][ptr[5]] ^
+              t[1][ptr[6]] ^ t[0][ptr[7]];
+    }
+
+    return xmodem_table(crc, ptr, len);
+}
+
+static uint16_t x25_slice8(uint16_t crc, const uint8_t *ptr, size_t len)
+{
+    const uint16_t(*t)[256] = crc16_x25_slice;
+
+    for (; len >= 8; ptr += 8, len -= 8) {
+        crc = t[7][ptr[0] ^ (crc & 0xff)] ^ t[6][ptr[1] ^ (crc >> 8)] ^
+              t[5][ptr[2]] ^ t[4][ptr[3]] ^ t[3][ptr[4]] ^ t[2][ptr[5]] ^
+              t[1][ptr[6]] ^ t[0][ptr[7]];
+    }
+
+    for (; len; ptr++, len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *ptr) & 0xff];
+
+    return crc;
+}
+
+static void init_slice_tables(void)
+{
+    for (int b = 0; b < 256; b++) {
+        uint16_t x25 = b;
+
+        for (int bit = 0; bit < 8; bit++)
+            x25 = (x25 & 1) ? (x25 >> 1) ^ CRC16_POLY_REFLECTED : x25 >> 1;
+
+        crc16_slice[0][b] = crc16_tab[b];
+        crc16_x25_slice[0][b] = x25;
+    }
+
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            uint16_t prev = crc16_slice[k - 1][b];
+            uint16_t x25 = crc16_x25_slice[k - 1][b];
+
+            crc16_slice[k][b] = (prev << 8) ^ crc16_tab[prev >> 8];
+            crc16_x25_slice[k][b] = (x25 >> 8) ^ crc16_x25_slice[0][x25 & 0xff];
+        }
+    }
+}
+
+#ifdef CRC16_HAVE_CLMUL
+/* The data is folded 16 bytes at a time into a 128-bit remainder A, with
+ * A * x^128 + B = A_hi * (x^192 mod P) + A_lo * (x^128 mod P) + B, which the
+ * end reduces with a Barrett reduction. MAVLink's CRC is the same with the
+ * bits of the bytes and of the CRC reversed. */
+static struct {
+    uint64_t x64;  /* x^64 mod P */
+    uint64_t x128; /* x^128 mod P */
+    uint64_t x192; /* x^192 mod P */
+    uint64_t mu;   /* x^80 / P, its x^64 term left out */
+} g_fold;
+
+static uint64_t xpow_mod(unsigned n)
+{
+    uint32_t r = 1;
+
+    while (n--) {
+        r <<= 1;
+        if (r & 0x10000)
+            r ^= 0x10000 | CRC16_POLY;
+    }
+
+    return r;
+}
+
+static uint64_t barrett_mu(void)
+{
+    unsigned __int128 rem = (unsigned __int128) 1 << 80;
+    uint64_t mu = 0;
+
+    for (int i = 80; i >= 16; i--) {
+        if (!((rem >> i) & 1))
+            continue;
+        rem ^= (unsigned __int128) (0x10000 | CRC16_POLY) << (i - 16);
+        if (i - 16 < 64)
+            mu |= 1ull << (i - 16);
+    }
+
+    return mu;
+}
+
+static uint16_t reverse16(uint16_t v)
+{
+    v = ((v >> 1) & 0x5555) | ((v & 0x5555) << 1);
+    v = ((v >> 2) & 0x3333) | ((v & 0x3333) << 2);
+    v = ((v >> 4) & 0x0f0f) | ((v & 0x0f0f) << 4);
+
+    return (v >> 8) | (v << 8);
+}
+
+#if defined(__x86_64__)
+CLMUL_TARGET static inline __m128i clmul(uint64_t a, uint64_t b)
+{
+    return _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long) a),
+                                _mm_cvtsi64_si128((long long) b), 0x00);
+}
+
+CLMUL_TARGET static inline uint64_t clmul_lo(uint64_t a, uint64_t b)
+{
+    return _mm_cvtsi128_si64(clmul(a, b));
+}
+
+CLMUL_TARGET static inline uint64_t clmul_hi(uint64_t a, uint64_t b)
+{
+    return _mm_extract_epi64(clmul(a, b), 1);
+}
+
+/**
+ * Loads 16 bytes as a 128-bit polynomial, the first bit the highest term.
+ */
+CLMUL_TARGET static inline __m128i load_block(const uint8_t *p, bool reflect)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+
+    if (reflect) {
+        /* Reverse the bits of every byte, a nibble at a time */
+        const __m128i rev_lo =
+            _mm_set_epi64x(0xf070b030d0509010ll, 0xe060a020c0408000ll);
+        const __m128i rev_hi =
+            _mm_set_epi64x(0x0f070b030d050901ll, 0x0e060a020c040800ll);
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+
+        v = _mm_or_si128(
+            _mm_shuffle_epi8(rev_lo, _mm_and_si128(v, nibble)),
+            _mm_shuffle_epi8(rev_hi,
+                             _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    }
+
+    return _mm_shuffle_epi8(
+        v, _mm_set_epi64x(0x0001020304050607ll, 0x08090a0b0c0d0e0fll));
+}
+
+CLMUL_TARGET static uint64_t fold_blocks(uint16_t crc,
+                                         const uint8_t *p,
+                                         size_t blocks,
+                                         bool reflect,
+                                         uint64_t *lo)
+{
+    const __m128i k = _mm_set_epi64x(g_fold.x192, g_fold.x128);
+    __m128i a = _mm_xor_si128(load_block(p, reflect),
+                              _mm_set_epi64x((long long) crc << 48, 0));
+
+    for (size_t i = 1; i < blocks; i++) {
+        __m128i b = load_block(p + 16 * i, reflect);
+        a = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+                                        _mm_clmulepi64_si128(a, k, 0x00)),
+                          b);
+    }
+
+    *lo = _mm_cvtsi128_si64(a);
+    return _mm_extract_epi64(a, 1);
+}
+
+static bool cpu_has_clmul(void)
+{
+    return __builtin_cpu_supports("pclmul") &&
+           __builtin_cpu_supports("sse4.1");
+}
+#else
+CLMUL_TARGET static inline uint64x2_t clmul(uint64_t a, uint64_t b)
+{
+    return vreinterpretq_u64_p128(vmull_p64((poly64_t) a, (poly64_t) b));
+}
+
+CLMUL_TARGET static inline uint64_t clmul_lo(uint64_t a, uint64_t b)
+{
+    return vgetq_lane_u64(clmul(a, b), 0);
+}
+
+CLMUL_TARGET static inline uint64_t clmul_hi(uint64_t a, uint64_t b)
+{
+    return vgetq_lane_u64(clmul(a, b), 1);
+}
+
+/**
+ * Loads 16 bytes as a 128-bit polynomial, the first bit the highest term.
+ */
+CLMUL_TARGET static inline uint64x2_t load_block(const uint8_t *p,
+                                                 bool reflect)
+{
+    uint8x16_t v = vld1q_u8(p);
+
+    if (reflect)
+        v = vrbitq_u8(v);
+
+    uint64x2_t w = vreinterpretq_u64_u8(vrev64q_u8(v));
+    return vextq_u64(w, w, 1);
+}
+
+CLMUL_TARGET static uint64_t fold_blocks(uint16_t crc,
+                                         const uint8_t *p,
+                                         size_t blocks,
+                                         bool reflect,
+                                         uint64_t *lo)
+{
+    const poly64x2_t k = vreinterpretq_p64_u64(
+        vcombine_u64(vcreate_u64(g_fold.x128), vcreate_u64(g_fold.x192)));
+    uint64x2_t a = veorq_u64(
+        load_block(p, reflect),
+        vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t) crc << 48)));
+
+    for (size_t i = 1; i < blocks; i++) {
+        uint64x2_t b = load_block(p + 16 * i, reflect);
+        uint64x2_t a_lo = clmul(vgetq_lane_u64(a, 0), g_fold.x128);
+        uint64x2_t a_hi = vreinterpretq_u64_p128(
+            vmull_high_p64(vreinterpretq_p64_u64(a), k));
+        a = veorq_u64(veorq_u64(a_lo, a_hi), b);
+    }
+
+    *lo = vgetq_lane_u64(a, 0);
+    return vgetq_lane_u64(a, 1);
+}
+
+static bool cpu_has_clmul(void)
+{
+    return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+#endif
+
+/**
+ * Computes the CRC register after whole 16-byte blocks, the CRC of the data
+ * before being `crc`.
+ */
+CLMUL_TARGET static uint16_t crc16_blocks(uint16_t crc,
+                                          const uint8_t *p,
+                                          size_t blocks,
+                                          bool reflect)
+{
+    uint64_t lo, hi = fold_blocks(crc, p, blocks, reflect, &lo);
+
+    /* Down to 64 bits, then x^16 times that mod P */
+    uint64_t v = lo ^ clmul_lo(hi, g_fold.x64);
+    v ^= clmul_lo(clmul_hi(hi, g_fold.x64), g_fold.x64);
+
+    uint64_t q = v ^ clmul_hi(v, g_fold.mu);
+    return (uint16_t) clmul_lo(q, CRC16_POLY);
+}
+
+static uint16_t xmodem_clmul(uint16_t crc, const uint8_t *ptr, size_t len)
+{
+    if (len < CRC16_CLMUL_MIN)
+        return xmodem_slice8(crc, ptr, len);
+
+    size_t blocks = len / 16;
+    crc = crc16_blocks(crc, ptr, blocks, false);
+
+    return xmodem_slice8(crc, ptr + blocks * 16, len % 16);
+}
+
+static uint16_t x25_clmul(uint16_t crc, const uint8_t *ptr, size_t len)
+{
+    if (len < CRC16_CLMUL_MIN)
+        return x25_slice8(crc, ptr, len);
+
+    size_t blocks = len / 16;
+    crc = reverse16(crc16_blocks(reverse16(crc), ptr, blocks, true));
+
+    return x25_slice8(crc, ptr + blocks * 16, len % 16);
+}
+#endif
+
+static const struct crc16_kernel g_kernels[] = {
+    {"table", xmodem_table, x25_bitwise},
+    {"slice8", xmodem_slice8, x25_slice8},
+#ifdef CRC16_HAVE_CLMUL
+    {CRC16_CLMUL_NAME, xmodem_clmul, x25_clmul},
+#endif
+};
+
+static const struct crc16_kernel *g_kernel = &g_kernels[0];
+static size_t g_kernel_count = 1;
+
+/**
+ * Checks a kernel against the byte-wise table on every length up to
+ * CRC16_CHECK_LEN, aligned or not.
+ */
+static bool kernel_matches(const struct crc16_kernel *kernel)
+{
+    static const uint16_t inits[] = {0, CRC16_X25_INIT, 0x1d0f};
+    uint8_t buf[CRC16_CHECK_LEN + 8];
+    uint32_t seed = 0x12345678;
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 24;
+    }
+
+    for (size_t off = 0; off < 8; off += 5) {
+        for (size_t len = 0; len <= CRC16_CHECK_LEN; len++) {
+            for (size_t i = 0; i < sizeof(inits) / sizeof(inits[0]); i++) {
+                const uint8_t *p = buf + off;
+
+                if ((kernel->xmodem(inits[i], p, len) !=
+                     xmodem_table(inits[i], p, len)) ||
+                    (kernel->x25(inits[i], p, len) !=
+                     x25_bitwise(inits[i], p, len)))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Picks the fastest CRC kernel the CPU runs, called once at startup before
+ * any thread computes a CRC.
+ */
+void crc16_init(void)
+{
+    if (g_kernel_count > 1)
+        return;
+
+    init_slice_tables();
+    if (!kernel_matches(&g_kernels[1]))
+        return;
+    g_kernel = &g_kernels[1];
+    g_kernel_count = 2;
+
+#ifdef CRC16_HAVE_CLMUL
+    if (!cpu_has_clmul())
+        return;
+
+    g_fold.x64 = xpow_mod(64);
+    g_fold.x128 = xpow_mod(128);
+    g_fold.x192 = xpow_mod(192);
+    g_fold.mu = barrett_mu();
+
+    if (!kernel_matches(&g_kernels[2]))
+        return;
+    g_kernel = &g_kernels[2];
+    g_kernel_count = 3;
+#endif
+}
+
+const char *crc16_kernel_name(void)
+{
+    return g_kernel->name;
+}
+
+/**
+ * Gets the kernels that passed the check of crc16_init(), slowest first.
+ *
+ * @return The number of kernels.
+ */
+size_t crc16_get_kernels(const struct crc16_kernel **kernels)
+{
+    *kernels = g_kernels;
+    return g_kernel_count;
+}
+
+uint16_t crc16_calculate(uint8_t *ptr, uint32_t len)
+{
+    return g_kernel->xmodem(0x0, ptr, len);
+}
+
+/**
+ * Continues the CRC of a MAVLink frame, as crc_accumulate_buffer() does.
+ */
+uint16_t crc16_x25_update(uint16_t crc, const uint8_t *ptr, size_t len)
+{
+    return g_kernel->x25(crc, ptr, len);
+}
@@ -0,0 +1,32 @@
+#ifndef __CRC16_H__
+#define __CRC16_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Initial value of the MAVLink CRC, X25_INIT_CRC of the MAVLink headers */
+#define CRC16_X25_INIT 0xffff
+
+typedef uint16_t (*crc16_fn)(uint16_t crc, const uint8_t *ptr, size_t len);
+
+/* A set of CRC functions: CRC-16/XMODEM of the SIYI protocol, and the CRC of
+ * MAVLink (CRC-16/MCRF4XX, which MAVLink calls X25). Both continue the CRC
+ * `crc` of the data before. */
+struct crc16_kernel {
+    const char *name;
+    crc16_fn xmodem;
+    crc16_fn x25;
+};
+
+/* The CRCs are computed byte by byte with a table until crc16_init() picks
+ * the fastest kernel the CPU runs: carry-less multiplies (PCLMULQDQ on x86,
+ * PMULL on ARMv8) for long buffers, slicing-by-8 tables otherwise. A kernel
+ * is only picked if it matches the byte-wise table. */
+void crc16_init(void);
+const char *crc16_kernel_name(void);
+size_t crc16_get_kernels(const struct crc16_kernel **kernels);
+
+uint16_t crc16_calculate(uint8_t *ptr, uint32_t len);
+uint16_t crc16_x25_update(uint16_t crc, const uint8_t *ptr, size_t len);
+
+#endif
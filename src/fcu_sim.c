@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fcu_sim.h"
+#include "mavlink.h"
+#include "serial_link.h"
+#include "util.h"
+
+/* Sequence numbers of the simulated FCU, apart from the server's own */
+#define FCU_SIM_CHANNEL SERIAL_LINK_CHANNEL(SERIAL_LINK_MAX)
+
+/* Most bytes written to the PTY at once */
+#define FCU_SIM_BATCH_MAX 4096
+
+/* A periodic message */
+struct fcu_sim_stream {
+    uint64_t period_ns; /* 0 if disabled */
+    uint64_t next_ns;   /* When it is due next */
+    uint16_t (*encode)(mavlink_message_t *msg, uint64_t now_ns);
+};
+
+enum {
+    FCU_SIM_HEARTBEAT,
+    FCU_SIM_ATTITUDE,
+    FCU_SIM_RC_CHANNELS,
+    FCU_SIM_GPS_RAW_INT,
+    FCU_SIM_STREAMS,
+};
+
+static struct {
+    struct fcu_sim_config config;
+    int master;
+    int slave; /* Held open so the PTY never hangs up */
+    int event; /* Wakes the thread up to stop */
+    pthread_t tid;
+    atomic_bool running;
+    uint64_t start_ns;
+    uint64_t line_free_ns; /* When the emulated line is idle again */
+    struct fcu_sim_stream streams[FCU_SIM_STREAMS];
+    mavlink_message_t rx_msg;
+    mavlink_status_t rx_status;
+
+    unsigned long frames_sent;
+    unsigned long bytes_sent;
+    unsigned long frames_dropped; /* The server did not keep up */
+    unsigned long frames_received;
+} g_sim = {.master = -1, .slave = -1, .event = -1};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint32_t boot_ms(uint64_t now_ns)
+{
+    return (uint32_t) ((now_ns - g_sim.start_ns) / 1000000);
+}
+
+static uint16_t encode_heartbeat(mavlink_message_t *msg, uint64_t now_ns)
+{
+    mavlink_heartbeat_t heartbeat = {
+        .type = MAV_TYPE_QUADROTOR,
+        .autopilot = MAV_AUTOPILOT_PX4,
+        .base_mode = MAV_MODE_FLAG_CUSTOM_MODE_ENABLED,
+        .system_status = MAV_STATE_STANDBY,
+        .mavlink_version = 3,
+    };
+
+    return mavlink_msg_heartbeat_encode_chan(g_sim.config.sysid,
+                                             MAV_COMP_ID_AUTOPILOT1,
+                                             FCU_SIM_CHANNEL, msg, &heartbeat);
+}
+
+/* A slow wobble, so consecutive samples differ */
+static uint16_t encode_attitude(mavlink_message_t *msg, uint64_t now_ns)
+{
+    float t = (float) (now_ns - g_sim.start_ns) / 1e9f;
+    mavlink_attitude_t attitude = {
+        .time_boot_ms = boot_ms(now_ns),
+        .roll = 0.1f * sinf(t),
+        .pitch = 0.1f * cosf(t),
+        .yaw = fmodf(0.2f * t, 2 * (float) M_PI),
+        .rollspeed = 0.1f * cosf(t),
+        .pitchspeed = -0.1f * sinf(t),
+        .yawspeed = 0.2f,
+    };
+
+    return mavlink_msg_attitude_encode_chan(g_sim.config.sysid,
+                                            MAV_COMP_ID_AUTOPILOT1,
+                                            FCU_SIM_CHANNEL, msg, &attitude);
+}
+
+static uint16_t encode_rc_channels(mavlink_message_t *msg, uint64_t now_ns)
+{
+    /* Sticks centered, switches low */
+    mavlink_rc_channels_t rc = {
+        .time_boot_ms = boot_ms(now_ns),
+        .chancount = 8,
+        .chan1_raw = 1500,
+        .chan2_raw = 1500,
+        .chan3_raw = 1000,
+        .chan4_raw = 1500,
+        .chan5_raw = 1000,
+        .chan6_raw = 1000,
+        .chan7_raw = 1000,
+        .chan8_raw = 1000,
+        .rssi = 255,
+    };
+
+    return mavlink_msg_rc_channels_encode_chan(g_sim.config.sysid,
+                                               MAV_COMP_ID_AUTOPILOT1,
+                                               FCU_SIM_CHANNEL, msg, &rc);
+}
+
+/* Circling around a fixed point */
+static uint16_t encode_gps_raw_int(mavlink_message_t *msg, uint64_t now_ns)
+{
+    double t = (double) (now_ns - g_sim.start_ns) / 1e9;
+    mavlink_gps_raw_int_t gps = {
+        .time_usec = (now_ns - g_sim.start_ns) / 1000,
+        .fix_type = GPS_FIX_TYPE_3D_FIX,
+        .lat = 250330000 + (int32_t) (1000 * sin(0.1 * t)),
+        .lon = 1215650000 + (int32_t) (1000 * cos(0.1 * t)),
+        .alt = 100000,
+        .eph = 80,
+        .epv = 120,
+        .vel = 150,
+        .cog = UINT16_MAX,
+        .satellites_visible = 14,
+    };
+
+    return mavlink_msg_gps_raw_int_encode_chan(g_sim.config.sysid,
+                                               MAV_COMP_ID_AUTOPILOT1,
+                                               FCU_SIM_CHANNEL, msg, &gps);
+}
+
+/**
+ * Writes a batch to the PTY. With baud rate emulation, the line stays busy
+ * for as long as the batch would take on the wire. Whatever the server is
+ * too slow to take is lost, as it would be on a real UART.
+ */
+static void flush_batch(const uint8_t *buf, size_t len, int frames)
+{
+    long wbytes = write(g_sim.master, buf, len);
+
+    if (wbytes < (long) len) {
+        g_sim.frames_dropped += frames;
+        return;
+    }
+
+    g_sim.frames_sent += frames;
+    g_sim.bytes_sent += len;
+
+    /* 8N1, ten bits per byte */
+    if (g_sim.config.baudrate)
+        g_sim.line_free_ns =
+            monotonic_ns() + len * 10 * 1000000000ull / g_sim.config.baudrate;
+}
+
+static void send_message(const mavlink_message_t *msg)
+{
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    uint16_t len = mavlink_msg_to_send_buffer(buf, msg);
+
+    flush_batch(buf, len, 1);
+}
+
+/**
+ * Emits the streams that are due in one write.
+ */
+static void send_streams(uint64_t now_ns)
+{
+    uint8_t batch[FCU_SIM_BATCH_MAX];
+    size_t len = 0;
+    int frames = 0;
+
+    for (int i = 0; i < FCU_SIM_STREAMS; i++) {
+        struct fcu_sim_stream *stream = &g_sim.streams[i];
+
+        while (stream->period_ns && (stream->next_ns <= now_ns) &&
+               (len + MAVLINK_MAX_PACKET_LEN <= sizeof(batch))) {
+            mavlink_message_t msg;
+
+            stream->encode(&msg, now_ns);
+            len += mavlink_msg_to_send_buffer(batch + len, &msg);
+            frames++;
+
+            /* Skip what was missed rather than bursting to catch up */
+            stream->next_ns += stream->period_ns;
+            if (stream->next_ns + stream->period_ns <= now_ns)
+                stream->next_ns = now_ns;
+        }
+    }
+
+    if (len)
+        flush_batch(batch, len, frames);
+}
+
+/**
+ * Answers the commands the server sends to a flight controller: the
+ * autopilot capabilities request of the startup handshake gets an
+ * AUTOPILOT_VERSION, every other command is acked.
+ */
+static void handle_message(const mavlink_message_t *msg)
+{
+    g_sim.frames_received++;
+
+    if (msg->msgid != MAVLINK_MSG_ID_COMMAND_LONG)
+        return;
+
+    mavlink_command_long_t cmd;
+    mavlink_message_t reply;
+
+    mavlink_msg_command_long_decode(msg, &cmd);
+
+    if (cmd.target_system && (cmd.target_system != g_sim.config.sysid))
+        return;
+
+    bool version = (cmd.command == MAV_CMD_REQUEST_AUTOPILOT_CAPABILITIES) ||
+                   ((cmd.command == MAV_CMD_REQUEST_MESSAGE) &&
+                    ((int) cmd.param1 == MAVLINK_MSG_ID_AUTOPILOT_VERSION));
+
+    mavlink_command_ack_t ack = {
+        .command = cmd.command,
+        .result = version ? MAV_RESULT_ACCEPTED : MAV_RESULT_UNSUPPORTED,
+        .target_system = msg->sysid,
+        .target_component = msg->compid,
+    };
+    mavlink_msg_command_ack_encode_chan(g_sim.config.sysid,
+                                        MAV_COMP_ID_AUTOPILOT1,
+                                        FCU_SIM_CHANNEL, &reply, &ack);
+    send_message(&reply);
+
+    if (!version)
+        return;
+
+    mavlink_autopilot_version_t autopilot_version = {
+        .capabilities = MAV_PROTOCOL_CAPABILITY_MAVLINK2,
+        .flight_sw_version = 0x010e0000, /* 1.14.0 */
+        .uid = 0x5349u,
+    };
+    mavlink_msg_autopilot_version_encode_chan(
+        g_sim.config.sysid, MAV_COMP_ID_AUTOPILOT1, FCU_SIM_CHANNEL, &reply,
+        &autopilot_version);
+    send_message(&reply);
+}
+
+static void receive_messages(void)
+{
+    uint8_t buf[1024];
+    long rbytes;
+
+    while ((rbytes = read(g_sim.master, buf, sizeof(buf))) > 0) {
+        for (long i = 0; i < rbytes; i++) {
+            mavlink_message_t msg;
+            mavlink_status_t status;
+
+            if (mavlink_frame_char_buffer(&g_sim.rx_msg, &g_sim.rx_status,
+                                          buf[i], &msg,
+                                          &status) == MAVLINK_FRAMING_OK)
+                handle_message(&msg);
+        }
+    }
+}
+
+static void *fcu_sim_thread(void *args)
+{
+    for (;;) {
+        uint64_t now_ns = monotonic_ns();
+        uint64_t wake_ns = UINT64_MAX;
+
+        /* Nothing new goes on the line while it is busy */
+        if (now_ns >= g_sim.line_free_ns) {
+            send_streams(now_ns);
+            now_ns = monotonic_ns();
+        }
+
+        for (int i = 0; i < FCU_SIM_STREAMS; i++) {
+            if (g_sim.streams[i].period_ns &&
+                (g_sim.streams[i].next_ns < wake_ns))
+                wake_ns = g_sim.streams[i].next_ns;
+        }
+        if (g_sim.line_free_ns > wake_ns)
+            wake_ns = g_sim.line_free_ns;
+
+        struct pollfd fds[2] = {
+            {.fd = g_sim.master, .events = POLLIN},
+            {.fd = g_sim.event, .events = POLLIN},
+        };
+        struct timespec timeout, *timeout_p = NULL;
+
+        if (wake_ns != UINT64_MAX) {
+            uint64_t wait_ns = wake_ns > now_ns ? wake_ns - now_ns : 0;
+            timeout.tv_sec = wait_ns / 1000000000ull;
+            timeout.tv_nsec = wait_ns % 1000000000ull;
+            timeout_p = &timeout;
+        }
+
+        if (ppoll(fds, 2, timeout_p, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (fds[0].revents & POLLIN)
+            receive_messages();
+    }
+
+    return NULL;
+}
+
+static uint64_t period_ns(int rate)
+{
+    return rate > 0 ? 1000000000ull / (uint64_t) rate : 0;
+}
+
+/**
+ * Opens a PTY pair and starts simulating a flight controller on it.
+ *
+ * @param config    The messages to emit and how fast.
+ * @param path      Filled in with the path of the PTY for the server to open.
+ * @param path_len  The size of `path`.
+ */
+bool fcu_sim_start(const struct fcu_sim_config *config,
+                   char *path,
+                   size_t path_len)
+{
+    struct termios tio;
+
+    g_sim.config = *config;
+
+    g_sim.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if ((g_sim.master < 0) || (grantpt(g_sim.master) != 0) ||
+        (unlockpt(g_sim.master) != 0) ||
+        (ptsname_r(g_sim.master, path, path_len) != 0))
+        goto cleanup;
+
+    /* Raw until the server configures it, or the handshake would be echoed
+     * back and mangled */
+    g_sim.slave = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if ((g_sim.slave < 0) || (tcgetattr(g_sim.slave, &tio) != 0))
+        goto cleanup;
+    cfmakeraw(&tio);
+    if (tcsetattr(g_sim.slave, TCSANOW, &tio) != 0)
+        goto cleanup;
+
+    if ((g_sim.event = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto cleanup;
+
+    g_sim.start_ns = monotonic_ns();
+    g_sim.line_free_ns = 0;
+
+    const int rates[FCU_SIM_STREAMS] = {
+        [FCU_SIM_HEARTBEAT] = config->heartbeat_rate,
+        [FCU_SIM_ATTITUDE] = config->attitude_rate,
+        [FCU_SIM_RC_CHANNELS] = config->rc_channels_rate,
+        [FCU_SIM_GPS_RAW_INT] = config->gps_raw_int_rate,
+    };
+    uint16_t (*const encoders[FCU_SIM_STREAMS])(mavlink_message_t *,
+                                                uint64_t) = {
+        [FCU_SIM_HEARTBEAT] = encode_heartbeat,
+        [FCU_SIM_ATTITUDE] = encode_attitude,
+        [FCU_SIM_RC_CHANNELS] = encode_rc_channels,
+        [FCU_SIM_GPS_RAW_INT] = encode_gps_raw_int,
+    };
+
+    for (int i = 0; i < FCU_SIM_STREAMS; i++) {
+        g_sim.streams[i].period_ns = period_ns(rates[i]);
+        g_sim.streams[i].next_ns = g_sim.start_ns;
+        g_sim.streams[i].encode = encoders[i];
+    }
+
+    if (pthread_create(&g_sim.tid, NULL, fcu_sim_thread, NULL) != 0)
+        goto cleanup;
+
+    atomic_store(&g_sim.running, true);
+
+    status("Simulating a flight controller (sys_id=%d) on %s", config->sysid,
+           path);
+
+    return true;
+
+cleanup:
+    if (g_sim.event >= 0)
+        close(g_sim.event);
+    if (g_sim.slave >= 0)
+        close(g_sim.slave);
+    if (g_sim.master >= 0)
+        close(g_sim.master);
+    g_sim.event = g_sim.slave = g_sim.master = -1;
+
+    return false;
+}
+
+/**
+ * Stops the simulated flight controller and prints what it did.
+ */
+void fcu_sim_stop(void)
+{
+    uint64_t one = 1;
+
+    if (!atomic_exchange(&g_sim.running, false))
+        return;
+
+    write(g_sim.event, &one, sizeof(one));
+    pthread_join(g_sim.tid, NULL);
+
+    status(
+        "FCU simulator: %lu frames sent (%lu bytes), %lu dropped, %lu "
+        "received",
+        g_sim.frames_sent, g_sim.bytes_sent, g_sim.frames_dropped,
+        g_sim.frames_received);
+
+    close(g_sim.event);
+    close(g_sim.slave);
+    close(g_sim.master);
+    g_sim.event = g_sim.slave = g_sim.master = -1;
+}
@@ -0,0 +1,26 @@
+#ifndef __FCU_SIM_H__
+#define __FCU_SIM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A flight controller simulated on a pseudo-terminal, so the server can be
+ * run and benchmarked without any hardware. The server opens the PTY like a
+ * serial port. */
+struct fcu_sim_config {
+    int sysid;
+    int baudrate; /* Line rate to emulate, 0 for as fast as possible */
+
+    /* Messages per second, 0 disables a message */
+    int heartbeat_rate;
+    int attitude_rate;
+    int rc_channels_rate;
+    int gps_raw_int_rate;
+};
+
+bool fcu_sim_start(const struct fcu_sim_config *config,
+                   char *path,
+                   size_t path_len);
+void fcu_sim_stop(void);
+
+#endif
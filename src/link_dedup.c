@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "link_dedup.h"
+
+/* Set in every key, so the empty slots of the window never match */
+#define KEY_VALID (1ULL << 48)
+
+void link_dedup_init(struct link_dedup *dedup)
+{
+    memset(dedup, 0, sizeof(*dedup));
+}
+
+/**
+ * Follows the sequence number of a component. A number that goes back is a
+ * frame that came late and fills a gap counted earlier.
+ */
+static void track_seq(struct link_seq_tracker *tracker,
+                      uint8_t sysid,
+                      uint8_t compid,
+                      uint8_t seq)
+{
+    uint16_t id = (uint16_t) (sysid << 8 | compid);
+    int free_slot = -1;
+
+    for (int i = 0; i < LINK_DEDUP_SOURCES; i++) {
+        if (!tracker->sources[i].used) {
+            if (free_slot < 0)
+                free_slot = i;
+            continue;
+        }
+
+        if (tracker->sources[i].id != id)
+            continue;
+
+        uint8_t delta = (uint8_t) (seq - tracker->sources[i].seq);
+
+        if (delta == 0)
+            return;
+
+        if (delta < 128) {
+            tracker->lost += delta - 1;
+            tracker->sources[i].seq = seq;
+        } else if (tracker->lost) {
+            tracker->lost--;
+        }
+        return;
+    }
+
+    if (free_slot < 0) {
+        free_slot = tracker->next_victim;
+        tracker->next_victim = (tracker->next_victim + 1) % LINK_DEDUP_SOURCES;
+    }
+
+    tracker->sources[free_slot].id = id;
+    tracker->sources[free_slot].seq = seq;
+    tracker->sources[free_slot].used = true;
+}
+
+/**
+ * Checks a frame received on a port against the frames seen lately.
+ *
+ * @return true if this is the earliest copy and the frame should be
+ * forwarded, false if a copy was forwarded already.
+ */
+bool link_dedup_accept(struct link_dedup *dedup,
+                       int port,
+                       uint8_t sysid,
+                       uint8_t compid,
+                       uint8_t seq,
+                       uint32_t msgid,
+                       uint64_t now_ns)
+{
+    struct link_dedup_port_stats *stats = &dedup->ports[port];
+    uint64_t key = KEY_VALID | (uint64_t) sysid << 40 |
+                   (uint64_t) compid << 32 | (uint64_t) seq << 24 |
+                   (msgid & 0xffffff);
+
+    stats->frames++;
+    track_seq(&dedup->ports_seq[port], sysid, compid, seq);
+
+    /* Newest first, the copy of a frame is usually just behind it */
+    for (unsigned i = 1; i <= LINK_DEDUP_WINDOW; i++) {
+        unsigned slot = (dedup->next - i) % LINK_DEDUP_WINDOW;
+
+        if (dedup->keys[slot] != key)
+            continue;
+
+        if (dedup->port[slot] != port) {
+            uint64_t lag_us = (now_ns - dedup->seen_ns[slot]) / 1000;
+
+            stats->lag_sum_us += lag_us;
+            if (lag_us > stats->lag_max_us)
+                stats->lag_max_us = lag_us;
+        }
+        stats->duplicates++;
+        return false;
+    }
+
+    dedup->keys[dedup->next] = key;
+    dedup->seen_ns[dedup->next] = now_ns;
+    dedup->port[dedup->next] = (uint8_t) port;
+    dedup->next = (dedup->next + 1) % LINK_DEDUP_WINDOW;
+
+    stats->first++;
+    dedup->forwarded++;
+    track_seq(&dedup->merged_seq, sysid, compid, seq);
+
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef __LINK_DEDUP_H__
+#define __LINK_DEDUP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Ports carrying the same MAVLink stream, e.g. two telemetry radios */
+#define LINK_DEDUP_PORTS 2
+
+/* Frames remembered to spot the late copies. A component's sequence number
+ * wraps after 256 of its frames, so a window under 256 frames never takes a
+ * new frame for the copy of an old one. */
+#define LINK_DEDUP_WINDOW 128
+
+/* Components whose sequence numbers are followed to count lost frames */
+#define LINK_DEDUP_SOURCES 8
+
+/* Sequence numbers of the components heard on a port */
+struct link_seq_tracker {
+    struct {
+        uint16_t id; /* sysid << 8 | compid */
+        uint8_t seq; /* Newest sequence number */
+        bool used;
+    } sources[LINK_DEDUP_SOURCES];
+    unsigned next_victim; /* Source replaced when all are used */
+    unsigned long lost;   /* Frames missing from the sequence */
+};
+
+struct link_dedup_port_stats {
+    unsigned long frames;     /* Frames received */
+    unsigned long first;      /* Frames forwarded as the earliest copy */
+    unsigned long duplicates; /* Copies dropped as another came first */
+    uint64_t lag_sum_us;      /* How long the dropped copies came after */
+    uint64_t lag_max_us;
+};
+
+/* Merges the copies of a MAVLink stream received on several ports into one,
+ * keeping the earliest copy of every frame. Frames are told apart by their
+ * (sysid, compid, seq, msgid). */
+struct link_dedup {
+    uint64_t keys[LINK_DEDUP_WINDOW];
+    uint64_t seen_ns[LINK_DEDUP_WINDOW];
+    uint8_t port[LINK_DEDUP_WINDOW];
+    unsigned next; /* Slot of the next frame */
+
+    struct link_seq_tracker ports_seq[LINK_DEDUP_PORTS];
+    struct link_seq_tracker merged_seq; /* Of the forwarded frames */
+    struct link_dedup_port_stats ports[LINK_DEDUP_PORTS];
+    unsigned long forwarded;
+};
+
+void link_dedup_init(struct link_dedup *dedup);
+bool link_dedup_accept(struct link_dedup *dedup,
+                       int port,
+                       uint8_t sysid,
+                       uint8_t compid,
+                       uint8_t seq,
+                       uint32_t msgid,
+                       uint64_t now_ns);
+
+#endif
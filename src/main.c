@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "crc16.h"
 #include "device.h"
 #include "mavlink.h"
 #include "mavlink_publisher.h"
@@ -76,15 +77,17 @@ int main(int argc, char const *argv[])
         {"ip-port", 1, NULL, 'p'},
         {"send-tune", 1, NULL, 't'},
         {"print-rc", 0, NULL, 'r'},
+        {"fcu-sim", 0, NULL, 'f'},
     };
     /* clang-format on */
 
     bool commander_mode = false;
+    bool fcu_sim = false;
     char *net_port = NULL;
     char *cmd_arg = NULL;
 
     int c, optidx = 0;
-    while ((c = getopt_long(argc, (char **) argv, "p:hrt", opts, &optidx)) !=
+    while ((c = getopt_long(argc, (char **) argv, "p:hrtf", opts, &optidx)) !=
            -1) {
         switch (c) {
         case 'h':
@@ -99,6 +102,9 @@ int main(int argc, char const *argv[])
             break;
         case 'r':
             break;
+        case 'f':
+            fcu_sim = true;
+            break;
         default:
             break;
         }
@@ -106,14 +112,20 @@ int main(int argc, char const *argv[])
 
     uart_server_args_t uart_server_args = {
         .net_port = net_port,
+        .fcu_sim = fcu_sim,
     };
 
+    crc16_init();
+
     if (commander_mode) {
         run_commander(cmd_arg);
     } else {
         load_serial_configs("configs/serial.yaml");
+        load_server_configs("configs/server.yaml");
         load_devices_configs("configs/devices.yaml");
         load_rc_configs("configs/rc.yaml");
+        if (fcu_sim)
+            load_fcu_sim_configs("configs/fcu_sim.yaml");
         run_server(&uart_server_args);
     }
 
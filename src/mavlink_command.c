@@ -0,0 +1,405 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "mavlink_command.h"
+#include "mavlink_publisher.h"
+#include "mavlink_receiver.h"
+#include "serial_link.h"
+#include "util.h"
+
+/* Commands registered, and asynchronous commands waiting for a worker */
+#define MAVLINK_COMMAND_MAX 32
+#define MAVLINK_COMMAND_QUEUE 16
+#define MAVLINK_COMMAND_WORKERS 2
+
+/* Commands remembered to spot the retransmissions, and how long the result
+ * of a completed one is sent again instead of running it again */
+#define MAVLINK_COMMAND_RECENT 16
+#define MAVLINK_COMMAND_REPLAY_MS 3000
+
+struct command_entry {
+    uint16_t command;
+    mavlink_command_fn fn;
+    bool async;
+};
+
+/* A command running or completed not long ago */
+struct command_record {
+    bool used;
+    bool running;
+    struct mavlink_command cmd;
+    mavlink_command_fn fn;
+    uint8_t result;
+    uint8_t progress;
+    uint64_t time_ns; /* Received, then completed */
+};
+
+static struct command_entry g_commands[MAVLINK_COMMAND_MAX];
+static size_t g_command_count;
+
+static struct command_record g_recent[MAVLINK_COMMAND_RECENT];
+
+/* Asynchronous commands waiting for a worker, as records */
+static struct command_record *g_queue[MAVLINK_COMMAND_QUEUE];
+static size_t g_queue_head;
+static size_t g_queue_len;
+
+static pthread_t g_workers[MAVLINK_COMMAND_WORKERS];
+static int g_worker_count;
+static bool g_stop;
+
+/* Guards everything above */
+static pthread_mutex_t g_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void send_ack(const struct mavlink_command *cmd,
+                     uint8_t result,
+                     uint8_t progress)
+{
+    mavlink_send_ack(cmd->command, result, progress, 0, cmd->sysid,
+                     cmd->compid);
+}
+
+static bool same_sender(const struct mavlink_command *a,
+                        const struct mavlink_command *b)
+{
+    return (a->command == b->command) && (a->sysid == b->sysid) &&
+           (a->compid == b->compid);
+}
+
+static bool same_params(const struct mavlink_command *a,
+                        const struct mavlink_command *b)
+{
+    return (a->is_int == b->is_int) && (a->frame == b->frame) &&
+           (a->x == b->x) && (a->y == b->y) &&
+           !memcmp(a->param, b->param, sizeof(a->param));
+}
+
+static struct command_record *find_record(const struct mavlink_command *cmd)
+{
+    for (int i = 0; i < MAVLINK_COMMAND_RECENT; i++) {
+        if (g_recent[i].used && same_sender(&g_recent[i].cmd, cmd))
+            return &g_recent[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Takes a record for a command, the one of its sender's previous command if
+ * there is one, the oldest completed one otherwise.
+ *
+ * @return NULL if every record is of a running command.
+ */
+static struct command_record *claim_record(struct command_record *prev)
+{
+    struct command_record *oldest = NULL;
+
+    if (prev)
+        return prev;
+
+    for (int i = 0; i < MAVLINK_COMMAND_RECENT; i++) {
+        struct command_record *rec = &g_recent[i];
+
+        if (!rec->used)
+            return rec;
+        if (!rec->running && (!oldest || (rec->time_ns < oldest->time_ns)))
+            oldest = rec;
+    }
+
+    return oldest;
+}
+
+static const struct command_entry *find_entry(uint16_t command)
+{
+    for (size_t i = 0; i < g_command_count; i++) {
+        if (g_commands[i].command == command)
+            return &g_commands[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Records the result of a command and acks it, called with the lock held so
+ * the ack cannot overtake the progress of a retransmission.
+ */
+static void finish_command(struct command_record *rec, uint8_t result)
+{
+    rec->running = false;
+    rec->result = result;
+    rec->time_ns = monotonic_ns();
+
+    send_ack(&rec->cmd, result, 0);
+}
+
+static void *command_worker_thread(void *args)
+{
+    pthread_mutex_lock(&g_mtx);
+
+    for (;;) {
+        while (!g_queue_len && !g_stop)
+            pthread_cond_wait(&g_cond, &g_mtx);
+
+        if (g_stop)
+            break;
+
+        struct command_record *rec = g_queue[g_queue_head];
+        g_queue_head = (g_queue_head + 1) % MAVLINK_COMMAND_QUEUE;
+        g_queue_len--;
+
+        struct mavlink_command cmd = rec->cmd;
+        mavlink_command_fn fn = rec->fn;
+
+        pthread_mutex_unlock(&g_mtx);
+
+        /* Ack on the link the command came from */
+        serial_link_bind(cmd.link);
+        uint8_t result = fn(&cmd);
+
+        pthread_mutex_lock(&g_mtx);
+        finish_command(rec, result);
+    }
+
+    pthread_mutex_unlock(&g_mtx);
+
+    return NULL;
+}
+
+/**
+ * Registers the function running a command, before the links start.
+ *
+ * @return false if the command is registered already or there are too many.
+ */
+bool mavlink_command_register(uint16_t command,
+                              mavlink_command_fn fn,
+                              bool async)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&g_mtx);
+
+    if (!find_entry(command) && (g_command_count < MAVLINK_COMMAND_MAX)) {
+        g_commands[g_command_count++] = (struct command_entry){command, fn,
+                                                               async};
+        ok = true;
+    }
+
+    pthread_mutex_unlock(&g_mtx);
+
+    return ok;
+}
+
+/**
+ * Starts the command worker threads. Asynchronous commands run on the
+ * handler thread until then.
+ */
+bool mavlink_command_start(void)
+{
+    g_stop = false;
+
+    for (; g_worker_count < MAVLINK_COMMAND_WORKERS; g_worker_count++) {
+        if (pthread_create(&g_workers[g_worker_count], NULL,
+                           command_worker_thread, NULL) != 0) {
+            mavlink_command_stop();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Stops the command worker threads once they complete the commands they
+ * are running. Commands still waiting are dropped without an ack.
+ */
+void mavlink_command_stop(void)
+{
+    pthread_mutex_lock(&g_mtx);
+    g_stop = true;
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_mtx);
+
+    for (int i = 0; i < g_worker_count; i++)
+        pthread_join(g_workers[i], NULL);
+    g_worker_count = 0;
+
+    pthread_mutex_lock(&g_mtx);
+    g_queue_len = 0;
+    pthread_mutex_unlock(&g_mtx);
+}
+
+static void decode_command(const mavlink_message_t *msg,
+                           struct mavlink_command *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->sysid = msg->sysid;
+    cmd->compid = msg->compid;
+    cmd->link = serial_link_id();
+
+    if (msg->msgid == MAVLINK_MSG_ID_COMMAND_INT) {
+        mavlink_command_int_t cmd_int;
+        mavlink_msg_command_int_decode(msg, &cmd_int);
+
+        cmd->command = cmd_int.command;
+        cmd->target_system = cmd_int.target_system;
+        cmd->target_component = cmd_int.target_component;
+        cmd->is_int = true;
+        cmd->frame = cmd_int.frame;
+        cmd->param[0] = cmd_int.param1;
+        cmd->param[1] = cmd_int.param2;
+        cmd->param[2] = cmd_int.param3;
+        cmd->param[3] = cmd_int.param4;
+        cmd->param[4] = (float) cmd_int.x * 1e-7f;
+        cmd->param[5] = (float) cmd_int.y * 1e-7f;
+        cmd->param[6] = cmd_int.z;
+        cmd->x = cmd_int.x;
+        cmd->y = cmd_int.y;
+    } else {
+        mavlink_command_long_t cmd_long;
+        mavlink_msg_command_long_decode(msg, &cmd_long);
+
+        cmd->command = cmd_long.command;
+        cmd->target_system = cmd_long.target_system;
+        cmd->target_component = cmd_long.target_component;
+        cmd->confirmation = cmd_long.confirmation;
+        cmd->param[0] = cmd_long.param1;
+        cmd->param[1] = cmd_long.param2;
+        cmd->param[2] = cmd_long.param3;
+        cmd->param[3] = cmd_long.param4;
+        cmd->param[4] = cmd_long.param5;
+        cmd->param[5] = cmd_long.param6;
+        cmd->param[6] = cmd_long.param7;
+    }
+}
+
+/**
+ * Tells if a command is for the server, which shares the system ID of the
+ * flight controller of its link and runs the commands of its camera.
+ * Commands for the flight controller or other components are none of its
+ * business, not even to be rejected.
+ */
+static bool for_server(const struct mavlink_command *cmd)
+{
+    return ((cmd->target_system == 0) ||
+            (cmd->target_system == get_fcu_sysid())) &&
+           ((cmd->target_component == MAV_COMP_ID_ALL) ||
+            (cmd->target_component == MAV_COMP_ID_CAMERA));
+}
+
+/**
+ * Runs, or queues for the workers, a COMMAND_LONG or COMMAND_INT received
+ * on the link of the calling thread, if it is for the server.
+ */
+void mavlink_command_receive(const mavlink_message_t *msg)
+{
+    struct mavlink_command cmd;
+
+    decode_command(msg, &cmd);
+
+    if (!for_server(&cmd))
+        return;
+
+    pthread_mutex_lock(&g_mtx);
+
+    const struct command_entry *entry = find_entry(cmd.command);
+
+    if (!entry) {
+        pthread_mutex_unlock(&g_mtx);
+        status("Received undefined command #%d.", cmd.command);
+        return;
+    }
+
+    struct command_record *prev = find_record(&cmd);
+    bool resent = prev && same_params(&prev->cmd, &cmd);
+
+    if (prev && prev->running) {
+        /* A retransmission gets the progress, another command waits */
+        if (resent)
+            send_ack(&cmd, MAV_RESULT_IN_PROGRESS, prev->progress);
+        else
+            send_ack(&cmd, MAV_RESULT_TEMPORARILY_REJECTED, 0);
+        pthread_mutex_unlock(&g_mtx);
+        return;
+    }
+
+    /* A GCS retrying COMMAND_LONG bumps the confirmation, COMMAND_INT has
+     * no such thing so an identical one is taken as a retry */
+    if (resent && (cmd.is_int || cmd.confirmation) &&
+        (monotonic_ns() - prev->time_ns <
+         MAVLINK_COMMAND_REPLAY_MS * 1000000ull)) {
+        send_ack(&cmd, prev->result, 0);
+        pthread_mutex_unlock(&g_mtx);
+        return;
+    }
+
+    struct command_record *rec = claim_record(prev);
+
+    if (!rec) {
+        send_ack(&cmd, MAV_RESULT_TEMPORARILY_REJECTED, 0);
+        pthread_mutex_unlock(&g_mtx);
+        return;
+    }
+
+    *rec = (struct command_record){.used = true,
+                                   .running = true,
+                                   .cmd = cmd,
+                                   .fn = entry->fn,
+                                   .time_ns = monotonic_ns()};
+
+    if (entry->async && g_worker_count) {
+        if (g_queue_len == MAVLINK_COMMAND_QUEUE) {
+            finish_command(rec, MAV_RESULT_TEMPORARILY_REJECTED);
+        } else {
+            /* Acked before a worker can pick it up and complete it */
+            send_ack(&cmd, MAV_RESULT_IN_PROGRESS, 0);
+            g_queue[(g_queue_head + g_queue_len++) % MAVLINK_COMMAND_QUEUE] =
+                rec;
+            pthread_cond_signal(&g_cond);
+        }
+        pthread_mutex_unlock(&g_mtx);
+        return;
+    }
+
+    pthread_mutex_unlock(&g_mtx);
+
+    uint8_t result = entry->fn(&cmd);
+
+    pthread_mutex_lock(&g_mtx);
+    finish_command(rec, result);
+    pthread_mutex_unlock(&g_mtx);
+}
+
+/**
+ * Reports how far an asynchronous command got, from its function.
+ *
+ * @return false once the workers are stopping, the command should then
+ * return at once.
+ */
+bool mavlink_command_progress(const struct mavlink_command *cmd,
+                              uint8_t percent)
+{
+    pthread_mutex_lock(&g_mtx);
+
+    struct command_record *rec = find_record(cmd);
+    bool stop = g_stop;
+
+    if (rec && rec->running && !stop) {
+        rec->progress = percent;
+        send_ack(cmd, MAV_RESULT_IN_PROGRESS, percent);
+    }
+
+    pthread_mutex_unlock(&g_mtx);
+
+    return !stop;
+}
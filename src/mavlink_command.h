@@ -0,0 +1,48 @@
+#ifndef __MAVLINK_COMMAND_H__
+#define __MAVLINK_COMMAND_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mavlink.h"
+
+/* A COMMAND_LONG or COMMAND_INT received. For COMMAND_INT, param[4] and
+ * param[5] are x and y scaled by 1e-7 and `x` and `y` hold them as sent. */
+struct mavlink_command {
+    uint16_t command;
+    uint8_t sysid; /* The sender, acked back */
+    uint8_t compid;
+    uint8_t target_system;    /* 0 for every system */
+    uint8_t target_component; /* 0 for every component */
+    uint8_t confirmation;     /* 0 for COMMAND_INT, which has none */
+    bool is_int;
+    uint8_t frame;
+    float param[7];
+    int32_t x;
+    int32_t y;
+    int link; /* The serial link it came from */
+};
+
+/* Runs a command and returns its MAV_RESULT */
+typedef uint8_t (*mavlink_command_fn)(const struct mavlink_command *cmd);
+
+/* Commands handled by the server. A command registered as asynchronous is
+ * acked MAV_RESULT_IN_PROGRESS at once and run on a pool of command worker
+ * threads, which acks its final result, so a slow camera action never holds
+ * up the handler thread of the link. Other commands are run and acked on
+ * the handler thread. A retransmitted command (same sender, command and
+ * parameters, or a nonzero confirmation for COMMAND_LONG) is not run
+ * again: it gets the progress of the copy still running, or the result of
+ * the copy that just completed. A long asynchronous command reports its
+ * progress with mavlink_command_progress(), in percent or UINT8_MAX when it
+ * is unknown, which also tells it to give up when the server stops. */
+bool mavlink_command_register(uint16_t command,
+                              mavlink_command_fn fn,
+                              bool async);
+bool mavlink_command_start(void);
+void mavlink_command_stop(void);
+void mavlink_command_receive(const mavlink_message_t *msg);
+bool mavlink_command_progress(const struct mavlink_command *cmd,
+                              uint8_t percent);
+
+#endif
@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mavlink_dispatch.h"
+
+/* A message ID has 24 bits, split into the index of a page and the index of
+ * the message in it. Pages are only allocated once a handler of one of their
+ * messages is registered, most messages fall in the first one. */
+#define MSGID_BITS 24
+#define PAGE_BITS 12
+#define PAGE_SIZE (1u << PAGE_BITS)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGE_COUNT (1u << (MSGID_BITS - PAGE_BITS))
+
+struct mavlink_handler {
+    uint32_t msgid;
+    mavlink_handler_fn fn;
+    void *ctx;
+    atomic_uint_least64_t calls;
+    atomic_uint_least64_t time_ns;
+    struct mavlink_handler *_Atomic next; /* Of the same message */
+    struct mavlink_handler *_Atomic next_all; /* In registration order */
+};
+
+struct handler_page {
+    struct mavlink_handler *_Atomic first[PAGE_SIZE];
+};
+
+static struct handler_page *_Atomic g_pages[PAGE_COUNT];
+
+/* Every handler, for the statistics */
+static struct mavlink_handler *_Atomic g_handlers;
+static struct mavlink_handler *g_handlers_tail;
+
+/* Serializes the registrations, dispatching takes no lock */
+static pthread_mutex_t g_register_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Registers a handler of a MAVLink message, called with `ctx` for every
+ * frame of the message received. Handlers already registered for the message
+ * are still called, before this one.
+ *
+ * @return false if the message ID is out of range or out of memory.
+ */
+bool mavlink_register_handler(uint32_t msgid, mavlink_handler_fn fn, void *ctx)
+{
+    if ((msgid >> MSGID_BITS) || !fn)
+        return false;
+
+    struct mavlink_handler *handler = calloc(1, sizeof(*handler));
+
+    if (!handler)
+        return false;
+
+    handler->msgid = msgid;
+    handler->fn = fn;
+    handler->ctx = ctx;
+
+    pthread_mutex_lock(&g_register_mtx);
+
+    struct handler_page *page = atomic_load(&g_pages[msgid >> PAGE_BITS]);
+
+    if (!page) {
+        page = calloc(1, sizeof(*page));
+        if (!page) {
+            pthread_mutex_unlock(&g_register_mtx);
+            free(handler);
+            return false;
+        }
+        atomic_store_explicit(&g_pages[msgid >> PAGE_BITS], page,
+                              memory_order_release);
+    }
+
+    /* Append, the handler is published once it is fully set up */
+    struct mavlink_handler *_Atomic *link = &page->first[msgid & PAGE_MASK];
+    struct mavlink_handler *last;
+
+    while ((last = atomic_load_explicit(link, memory_order_relaxed)))
+        link = &last->next;
+    atomic_store_explicit(link, handler, memory_order_release);
+
+    if (g_handlers_tail)
+        atomic_store_explicit(&g_handlers_tail->next_all, handler,
+                              memory_order_release);
+    else
+        atomic_store_explicit(&g_handlers, handler, memory_order_release);
+    g_handlers_tail = handler;
+
+    pthread_mutex_unlock(&g_register_mtx);
+
+    return true;
+}
+
+/**
+ * Tells whether a message has a handler, to skip the frames nobody wants
+ * before queueing them.
+ */
+bool mavlink_has_handler(uint32_t msgid)
+{
+    struct handler_page *page = atomic_load_explicit(
+        &g_pages[(msgid >> PAGE_BITS) % PAGE_COUNT], memory_order_acquire);
+
+    return page && atomic_load_explicit(&page->first[msgid & PAGE_MASK],
+                                        memory_order_relaxed);
+}
+
+/**
+ * Calls the handlers of a received frame.
+ *
+ * @return false if the message has no handler.
+ */
+bool mavlink_dispatch(const struct mavlink_frame_view *frame)
+{
+    struct handler_page *page = atomic_load_explicit(
+        &g_pages[(frame->msgid >> PAGE_BITS) % PAGE_COUNT],
+        memory_order_acquire);
+
+    if (!page)
+        return false;
+
+    struct mavlink_handler *handler = atomic_load_explicit(
+        &page->first[frame->msgid & PAGE_MASK], memory_order_acquire);
+
+    if (!handler)
+        return false;
+
+    mavlink_message_t msg;
+    mavlink_frame_to_msg(frame, &msg);
+
+    for (; handler;
+         handler = atomic_load_explicit(&handler->next, memory_order_acquire)) {
+        uint64_t start = monotonic_ns();
+
+        handler->fn(&msg, handler->ctx);
+
+        /* Links call the same handlers from their own threads */
+        atomic_fetch_add_explicit(&handler->calls, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&handler->time_ns, monotonic_ns() - start,
+                                  memory_order_relaxed);
+    }
+
+    return true;
+}
+
+/**
+ * Gets the counters of up to `max` handlers, in registration order.
+ *
+ * @return The number of handlers copied.
+ */
+size_t mavlink_get_handler_stats(struct mavlink_handler_stats *stats,
+                                 size_t max)
+{
+    struct mavlink_handler *handler =
+        atomic_load_explicit(&g_handlers, memory_order_acquire);
+    size_t count = 0;
+
+    for (; handler && (count < max);
+         handler =
+             atomic_load_explicit(&handler->next_all, memory_order_acquire)) {
+        stats[count++] = (struct mavlink_handler_stats){
+            handler->msgid, handler->fn, handler->ctx,
+            atomic_load_explicit(&handler->calls, memory_order_relaxed),
+            atomic_load_explicit(&handler->time_ns, memory_order_relaxed)};
+    }
+
+    return count;
+}
@@ -0,0 +1,35 @@
+#ifndef __MAVLINK_DISPATCH_H__
+#define __MAVLINK_DISPATCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavlink.h"
+#include "mavlink_scan.h"
+
+typedef void (*mavlink_handler_fn)(mavlink_message_t *msg, void *ctx);
+
+struct mavlink_handler_stats {
+    uint32_t msgid;
+    mavlink_handler_fn fn;
+    void *ctx;
+    uint64_t calls;
+    uint64_t time_ns; /* Spent in the handler, all calls together */
+};
+
+/* Handlers of the MAVLink messages received from the flight controllers,
+ * looked up by message ID in a two-level table, so dispatching a frame costs
+ * the same however many handlers there are. A message may have several
+ * handlers, called in the order they were registered. Handlers may be
+ * registered from any thread at any time and stay registered for good. They
+ * are called on the handler thread of the link the message came from (see
+ * mavlink_worker.h), and a frame is only copied into a `mavlink_message_t` if
+ * the message has a handler. */
+bool mavlink_register_handler(uint32_t msgid, mavlink_handler_fn fn, void *ctx);
+bool mavlink_has_handler(uint32_t msgid);
+bool mavlink_dispatch(const struct mavlink_frame_view *frame);
+size_t mavlink_get_handler_stats(struct mavlink_handler_stats *stats,
+                                 size_t max);
+
+#endif
@@ -1,17 +1,23 @@
 #include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "mavlink.h"
 #include "mavlink_receiver.h"
+#include "mavlink_router.h"
 #include "serial.h"
+#include "serial_link.h"
+#include "serial_tx.h"
+#include "telemetry_cache.h"
 #include "util.h"
 
 #define RB5_ID 2  // TODO: Define in YAML instead
 
-extern serial_t serial;
-extern pthread_mutex_t serial_tx_mtx;
+/* The port of the link served by the calling thread, writes go through the
+ * serial writer of that link */
+extern __thread serial_t serial;
 
 extern bool serial_workaround_verbose;
 
@@ -44,14 +50,31 @@ static const char *tune_table[] = {
 
 #define TUNE_CNT ARRAY_SIZE(tune_table)
 
-static void mavlink_send_msg(const mavlink_message_t *msg, int fd)
+/**
+ * Sends a message of one of the server's components where its target is:
+ * the serial port, the clients of the link, or both for a broadcast. The
+ * clients get it from the thread of the link, see `mavlink_router_post()`.
+ */
+static void mavlink_send_msg(const mavlink_message_t *msg,
+                             enum serial_tx_lane lane)
 {
     uint8_t buf[MAVLINK_MAX_PACKET_LEN];
     size_t len = mavlink_msg_to_send_buffer(buf, msg);
 
-    pthread_mutex_lock(&serial_tx_mtx);
-    serial_write(fd, buf, len);
-    pthread_mutex_unlock(&serial_tx_mtx);
+    mavlink_router_learn(msg->sysid, msg->compid, MAVLINK_ROUTE_LOCAL);
+
+    int dest = mavlink_router_dest(msg->msgid,
+                                   (const uint8_t *) _MAV_PAYLOAD(msg),
+                                   msg->len, MAVLINK_ROUTE_LOCAL);
+
+    if ((dest == MAVLINK_ROUTE_NONE) || (dest == MAVLINK_ROUTE_LOCAL))
+        return;
+
+    if (dest != MAVLINK_ROUTE_SERIAL)
+        mavlink_router_post(buf, len, msg, dest);
+
+    if ((dest == MAVLINK_ROUTE_SERIAL) || (dest == MAVLINK_ROUTE_ALL))
+        serial_tx_send(lane, buf, len);
 }
 
 static void mavlink_send_camera_hearbeart(int fd)
@@ -67,7 +90,7 @@ static void mavlink_send_camera_hearbeart(int fd)
     mavlink_message_t msg;
     mavlink_msg_heartbeat_pack(sys_id, component_id, &msg, type, autopilot,
                                base_mode, custom_mode, sys_status);
-    mavlink_send_msg(&msg, fd);
+    mavlink_send_msg(&msg, SERIAL_TX_TELEMETRY);
 }
 
 void mavlink_send_play_tune(int tune_num, int fd)
@@ -84,7 +107,7 @@ void mavlink_send_play_tune(int tune_num, int fd)
     mavlink_message_t msg;
     mavlink_msg_play_tune_pack(sys_id, component_id, &msg, target_system,
                                target_component, tune_table[tune_num], tune2);
-    mavlink_send_msg(&msg, fd);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 
     status("RB5: Sent play_tune message.");
 }
@@ -107,11 +130,13 @@ void mavlink_send_request_autopilot_capabilities(int fd)
     float param6 = 0;
     float param7 = 0;
 
+    /* Sent by the thread of every link during its handshake */
     mavlink_message_t msg;
-    mavlink_msg_command_long_pack(
-        sys_id, component_id, &msg, target_system, target_component, command,
-        confirmation, param1, param2, param3, param4, param5, param6, param7);
-    mavlink_send_msg(&msg, fd);
+    mavlink_msg_command_long_pack_chan(
+        sys_id, component_id, SERIAL_LINK_CHANNEL(serial_link_id()), &msg,
+        target_system, target_component, command, confirmation, param1, param2,
+        param3, param4, param5, param6, param7);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 
     if (serial_workaround_verbose)
         status("Requesting autopilot capabilities...");
@@ -126,7 +151,7 @@ void mavlink_send_ping(int fd)
     mavlink_message_t msg;
     mavlink_msg_ping_pack(sys_id, component_id, &msg, 0, 0, 255,
                           target_component);
-    mavlink_send_msg(&msg, fd);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 
     status("RB5: Sent ping message.");
 }
@@ -145,7 +170,7 @@ void mavlink_send_ack(uint16_t cmd,
     mavlink_msg_command_ack_pack(sys_id, component_id, &msg, cmd, result,
                                  progress, result_param2, target_system,
                                  target_component);
-    mavlink_send_msg(&msg, serial);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 }
 
 void mavlink_send_gimbal_manager_info(int fd)
@@ -167,7 +192,7 @@ void mavlink_send_gimbal_manager_info(int fd)
     mavlink_msg_gimbal_manager_information_pack(
         sys_id, component_id, &msg, time_boot_ms, cap_flags, gimbal_device_id,
         tilt_max, tilt_min, tilt_rate_max, pan_max, pan_min, pan_rate_max);
-    mavlink_send_msg(&msg, fd);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 }
 
 void mavlink_send_camera_info(uint8_t target_system, uint8_t target_component)
@@ -205,7 +230,7 @@ void mavlink_send_camera_info(uint8_t target_system, uint8_t target_component)
         firmware_version, focal_length, sensor_size_h, sensor_size_v,
         resolution_h, resolution_v, lens_id, flags, cam_definition_version,
         cam_definition_uri, gimbal_device_id);
-    mavlink_send_msg(&msg, serial);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 }
 
 void mavlink_send_camera_settings(uint8_t target_system,
@@ -225,7 +250,7 @@ void mavlink_send_camera_settings(uint8_t target_system,
     mavlink_message_t msg;
     mavlink_msg_camera_settings_pack(sys_id, component_id, &msg, time_boot_ms,
                                      mode_id, zoom_level, focus_level);
-    mavlink_send_msg(&msg, serial);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 }
 
 void mavlink_send_storage_information(uint8_t target_system,
@@ -258,7 +283,7 @@ void mavlink_send_storage_information(uint8_t target_system,
         sys_id, component_id, &msg, time_boot_ms, storage_id, storage_count,
         status, total_capacity, used_capacity, available_capacity, read_speed,
         write_speed, type, "microSD 1", storage_usage);
-    mavlink_send_msg(&msg, serial);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 }
 
 static bool video_status = false;
@@ -299,7 +324,91 @@ void mavlink_send_camera_capture_status(uint8_t target_system,
     mavlink_msg_camera_capture_status_pack(
         sys_id, component_id, &msg, time_boot_ms, image_status, video_status,
         image_interval, recording_time_ms, available_capacity, image_count);
-    mavlink_send_msg(&msg, serial);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
+}
+
+/* Telemetry older than this is not used to tag a capture */
+#define CAPTURE_TELEMETRY_MAX_AGE_NS 2000000000ull
+
+static atomic_int image_index;
+
+/**
+ * Gets the latest payload of a message from the flight controller of the
+ * link served by the calling thread, unless it is stale.
+ */
+static bool get_fcu_telemetry(uint32_t msgid,
+                              mavlink_message_t *msg,
+                              uint64_t *age_ns)
+{
+    uint64_t time_ns;
+    struct timespec ts;
+
+    if (!telemetry_cache_get(msgid, get_fcu_sysid(), MAV_COMP_ID_AUTOPILOT1,
+                             msg, &time_ns))
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *age_ns = (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec -
+              time_ns;
+
+    return *age_ns < CAPTURE_TELEMETRY_MAX_AGE_NS;
+}
+
+/**
+ * Reports an image just captured, tagged with the position, attitude and
+ * time the flight controller last sent, as ground stations geotag images
+ * from this message. Fields the flight controller has not sent lately are
+ * left zero.
+ */
+void mavlink_send_camera_image_captured(void)
+{
+    mavlink_camera_image_captured_t captured = {
+        .image_index = atomic_fetch_add(&image_index, 1),
+        .camera_id = 0,
+        .capture_result = 1,
+        .q = {1, 0, 0, 0},
+    };
+    mavlink_message_t msg;
+    uint64_t age_ns;
+
+    if (get_fcu_telemetry(MAVLINK_MSG_ID_GLOBAL_POSITION_INT, &msg, &age_ns)) {
+        mavlink_global_position_int_t pos;
+        mavlink_msg_global_position_int_decode(&msg, &pos);
+
+        captured.time_boot_ms = pos.time_boot_ms;
+        captured.lat = pos.lat;
+        captured.lon = pos.lon;
+        captured.alt = pos.alt;
+        captured.relative_alt = pos.relative_alt;
+    } else if (get_fcu_telemetry(MAVLINK_MSG_ID_GPS_RAW_INT, &msg, &age_ns)) {
+        mavlink_gps_raw_int_t gps;
+        mavlink_msg_gps_raw_int_decode(&msg, &gps);
+
+        captured.lat = gps.lat;
+        captured.lon = gps.lon;
+        captured.alt = gps.alt;
+    }
+
+    if (get_fcu_telemetry(MAVLINK_MSG_ID_ATTITUDE, &msg, &age_ns)) {
+        mavlink_attitude_t attitude;
+        mavlink_msg_attitude_decode(&msg, &attitude);
+
+        mavlink_euler_to_quaternion(attitude.roll, attitude.pitch,
+                                    attitude.yaw, captured.q);
+    }
+
+    /* The flight controller's clock, as of the capture */
+    if (get_fcu_telemetry(MAVLINK_MSG_ID_SYSTEM_TIME, &msg, &age_ns)) {
+        mavlink_system_time_t system_time;
+        mavlink_msg_system_time_decode(&msg, &system_time);
+
+        if (system_time.time_unix_usec)
+            captured.time_utc = system_time.time_unix_usec + age_ns / 1000;
+    }
+
+    mavlink_msg_camera_image_captured_encode(
+        get_fcu_sysid(), MAV_COMP_ID_CAMERA, &msg, &captured);
+    mavlink_send_msg(&msg, SERIAL_TX_CONTROL);
 }
 
 #define MSG_SCHEDULER_INIT(freq)          \
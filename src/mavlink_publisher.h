@@ -28,5 +28,6 @@ void mavlink_send_storage_information(uint8_t target_system,
                                       uint8_t target_component);
 void mavlink_send_camera_capture_status(uint8_t target_system,
                                         uint8_t target_component);
+void mavlink_send_camera_image_captured(void);
 
 #endif
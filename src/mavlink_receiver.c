@@ -1,52 +1,53 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "device.h"
+#include "link_dedup.h"
 #include "mavlink.h"
+#include "mavlink_command.h"
+#include "mavlink_dispatch.h"
 #include "mavlink_publisher.h"
 #include "mavlink_receiver.h"
+#include "mavlink_worker.h"
 #include "rtsp_stream.h"
+#include "serial_link.h"
 #include "siyi_camera.h"
+#include "telemetry_cache.h"
+#include "traffic_stats.h"
 #include "util.h"
 
-#define FCU_CHANNEL MAVLINK_COMM_1
-
 extern bool serial_workaround_verbose;
-static bool serial_is_ready = false;
-static uint8_t fcu_sysid = 0;
 
-static void mav_fcu_ping(mavlink_message_t *recvd_msg)
+/* The flight controller behind a serial link, on one port or on two
+ * redundant ones (port 1 being the redundant one). `ready` and `sysid` are
+ * set by the handler thread of the link. */
+struct fcu_link {
+    atomic_bool ready;
+    atomic_uint_least8_t sysid;
+    struct mavlink_scanner scanner[LINK_DEDUP_PORTS];
+    bool redundant;
+    struct link_dedup dedup;
+};
+
+static struct fcu_link fcu_links[SERIAL_LINK_MAX];
+
+/* Recording is toggled by the RC on the handler threads and by commands on
+ * the command workers */
+static pthread_mutex_t record_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* The flight controller of the link served by the calling thread */
+static struct fcu_link *current_fcu(void)
 {
-    status("Received ping message.");
+    return &fcu_links[serial_link_id()];
 }
 
-static void mav_fcu_gps_raw_int(mavlink_message_t *recvd_msg)
+static void mav_fcu_ping(mavlink_message_t *recvd_msg)
 {
-    mavlink_gps_raw_int_t gps_raw_int;
-    mavlink_msg_gps_raw_int_decode(recvd_msg, &gps_raw_int);
-
-    /* Check: mavlink_msg_gps_raw_int.h
-     typedef struct __mavlink_gps_raw_int_t {
-         uint64_t time_usec;
-         int32_t lat;
-         int32_t lon;
-         int32_t alt;
-         uint16_t eph;
-         uint16_t epv;
-         uint16_t vel;
-         uint16_t cog;
-         uint8_t fix_type;
-         uint8_t satellites_visible;
-         int32_t alt_ellipsoid;
-         uint32_t h_acc;
-         uint32_t v_acc;
-         uint32_t vel_acc;
-         uint32_t hdg_acc;
-         uint16_t yaw;
-     } mavlink_gps_raw_int_t;
-     */
-
-    //    status("FCU: Received gps_raw_int message.");
+    status("Received ping message.");
 }
 
 static void mav_fcu_rc_channels(mavlink_message_t *recvd_msg)
@@ -91,6 +92,11 @@ static void mav_fcu_rc_channels(mavlink_message_t *recvd_msg)
     int zoom_inc = 5;  // 0.5
     static bool zoom_stop = false;
 
+    /* The camera and gimbal are driven from the flight controller of link 0
+     * only, its handler thread is then the only one using the state above */
+    if (serial_link_id() != 0)
+        return;
+
     /* Initialization */
     if (button_a_last == 0)
         button_a_last = button_a;
@@ -161,6 +167,7 @@ static void mav_fcu_rc_channels(mavlink_message_t *recvd_msg)
     /* Handle video recording button */
     if (record != record_last) {
         record_last = record;
+        pthread_mutex_lock(&record_mtx);
         camera_change_record_state(0);
         if (get_video_status(0)) {
             status("Stop recording video");
@@ -169,128 +176,369 @@ static void mav_fcu_rc_channels(mavlink_message_t *recvd_msg)
             status("Start recording video");
             set_video_status(0);
         }
+        pthread_mutex_unlock(&record_mtx);
     }
 
     /* Send camera control signal */
     gimbal_rotate(0, (int16_t) (cam_yaw * 10), (int16_t) (cam_pitch * 10));
 }
 
-static void mav_command_long(mavlink_message_t *recvd_msg)
+static uint8_t cmd_digicam_control(const struct mavlink_command *cmd)
+{
+    /* Superseded by MAV_CMD_IMAGE_START_CAPTURE */
+    return MAV_RESULT_UNSUPPORTED;
+}
+
+static uint8_t cmd_request_camera_information(const struct mavlink_command *cmd)
+{
+    mavlink_send_camera_info(cmd->sysid, cmd->compid);
+    return MAV_RESULT_ACCEPTED;
+}
+
+static uint8_t cmd_request_camera_settings(const struct mavlink_command *cmd)
+{
+    mavlink_send_camera_settings(cmd->sysid, cmd->compid);
+    return MAV_RESULT_ACCEPTED;
+}
+
+static uint8_t cmd_request_storage_information(
+    const struct mavlink_command *cmd)
+{
+    mavlink_send_storage_information(cmd->sysid, cmd->compid);
+    return MAV_RESULT_ACCEPTED;
+}
+
+static uint8_t cmd_request_camera_capture_status(
+    const struct mavlink_command *cmd)
+{
+    mavlink_send_camera_capture_status(cmd->sysid, cmd->compid);
+    return MAV_RESULT_ACCEPTED;
+}
+
+static uint8_t cmd_set_camera_mode(const struct mavlink_command *cmd)
+{
+    mavlink_send_camera_capture_status(cmd->sysid, cmd->compid);
+    return MAV_RESULT_ACCEPTED;
+}
+
+static uint8_t cmd_set_camera_zoom(const struct mavlink_command *cmd)
+{
+    /* param1: zoom type, param2: zoom value, only a percentage of the zoom
+     * range is supported */
+    if ((int) cmd->param[0] != ZOOM_TYPE_RANGE)
+        return MAV_RESULT_UNSUPPORTED;
+
+    float percent = cmd->param[1];
+    bound_float(&percent, 100.0f, 0.0f);
+
+    /* 1.0x to 4.0x, like the zoom scroll of the RC */
+    int zoom_ratio = 10 + (int) (percent * 30.0f / 100.0f + 0.5f);
+    camera_zoom(0, zoom_ratio / 10, zoom_ratio % 10);
+
+    return MAV_RESULT_ACCEPTED;
+}
+
+/* Set by IMAGE_STOP_CAPTURE to end a sequence of captures */
+static atomic_bool image_capture_stop;
+
+/**
+ * Waits for the interval between two captures, reporting the progress of
+ * the sequence every second.
+ *
+ * @return false if the sequence is to end.
+ */
+static bool wait_capture_interval(const struct mavlink_command *cmd,
+                                  float interval,
+                                  uint8_t percent)
 {
-    /* Decode command_long message */
-    mavlink_command_long_t mav_cmd_long;
-    mavlink_msg_command_long_decode(recvd_msg, &mav_cmd_long);
-
-    switch (mav_cmd_long.command) {
-    case MAV_CMD_DO_DIGICAM_CONTROL: /* 203 */
-        // camera_save_image(0);
-        break;
-    case MAV_CMD_REQUEST_CAMERA_INFORMATION: /* 521 */
-        mavlink_send_camera_info(recvd_msg->sysid, recvd_msg->compid);
-        break;
-    case MAV_CMD_REQUEST_CAMERA_SETTINGS: /* 522 */
-        mavlink_send_camera_settings(recvd_msg->sysid, recvd_msg->compid);
-        break;
-    case MAV_CMD_REQUEST_STORAGE_INFORMATION: /* 525 */
-        mavlink_send_storage_information(recvd_msg->sysid, recvd_msg->compid);
-        break;
-    case MAV_CMD_REQUEST_CAMERA_CAPTURE_STATUS: /* 527 */
-        mavlink_send_camera_capture_status(recvd_msg->sysid, recvd_msg->compid);
-        break;
-    case MAV_CMD_SET_CAMERA_MODE: /* 530 */
-        mavlink_send_ack(MAV_CMD_SET_CAMERA_MODE, MAV_RESULT_ACCEPTED, 0, 0,
-                         recvd_msg->sysid, recvd_msg->compid);
-        mavlink_send_camera_capture_status(recvd_msg->sysid, recvd_msg->compid);
-        break;
-    case MAV_CMD_IMAGE_START_CAPTURE: /* 2000 */
+    int slices = (int) (interval * 10.0f + 0.5f); /* 100 ms each */
+
+    for (int i = 1; i <= slices; i++) {
+        usleep(100000);
+
+        if (atomic_load(&image_capture_stop))
+            return false;
+        if (((i % 10) == 0) && !mavlink_command_progress(cmd, percent))
+            return false;
+    }
+
+    return true;
+}
+
+static uint8_t cmd_image_start_capture(const struct mavlink_command *cmd)
+{
+    /* param2: seconds between images, param3: number of images, 0 to take
+     * them until MAV_CMD_IMAGE_STOP_CAPTURE */
+    float interval = cmd->param[1];
+    int total = cmd->param[2] >= 1.0f ? (int) cmd->param[2] : 0;
+
+    if ((total != 1) && !(interval > 0.0f))
+        return MAV_RESULT_DENIED;
+
+    atomic_store(&image_capture_stop, false);
+
+    for (int i = 0; !total || (i < total); i++) {
+        /* The progress of a capture until stopped is unknown */
+        uint8_t percent = total ? (uint8_t) (i * 100 / total) : UINT8_MAX;
+
+        if (i && (!mavlink_command_progress(cmd, percent) ||
+                  !wait_capture_interval(cmd, interval, percent)))
+            break;
+
         camera_save_image(0);
-        mavlink_send_ack(MAV_CMD_IMAGE_START_CAPTURE, MAV_RESULT_ACCEPTED, 0, 0,
-                         recvd_msg->sysid, recvd_msg->compid);
-        break;
-    case MAV_CMD_IMAGE_STOP_CAPTURE: /* 2001 */
-        mavlink_send_ack(MAV_CMD_IMAGE_STOP_CAPTURE, MAV_RESULT_ACCEPTED, 0, 0,
-                         recvd_msg->sysid, recvd_msg->compid);
-        break;
-    case MAV_CMD_VIDEO_START_CAPTURE: /* 2500 */
-        mavlink_send_ack(MAV_CMD_VIDEO_START_CAPTURE, MAV_RESULT_ACCEPTED, 0, 0,
-                         recvd_msg->sysid, recvd_msg->compid);
-        /* Start recording */
-        if (!get_video_status(0)) {
-            status("Start recording video");
-            camera_change_record_state(0);
-        }
-        set_video_status(0);
-        break;
-    case MAV_CMD_VIDEO_STOP_CAPTURE: /* 2501 */
-        mavlink_send_ack(MAV_CMD_VIDEO_STOP_CAPTURE, MAV_RESULT_ACCEPTED, 0, 0,
-                         recvd_msg->sysid, recvd_msg->compid);
-        /* Stop recording */
-        if (get_video_status(0)) {
-            status("Stop recording video");
-            camera_change_record_state(0);
-        }
-        reset_video_status(0);
-        break;
-    default:
-        status("Received undefined command_long message #%d.",
-               mav_cmd_long.command);
-        break;
+        mavlink_send_camera_image_captured();
     }
+
+    return MAV_RESULT_ACCEPTED;
 }
 
-static void mav_fcu_autopilot_version(mavlink_message_t *recvd_msg)
+static uint8_t cmd_image_stop_capture(const struct mavlink_command *cmd)
 {
-    serial_is_ready = true;
-    fcu_sysid = recvd_msg->sysid;
-    status("Established connection with flight controller (sys_id=%d)",
-           fcu_sysid);
+    atomic_store(&image_capture_stop, true);
+    return MAV_RESULT_ACCEPTED;
 }
 
-uint8_t get_fcu_sysid(void)
+static uint8_t cmd_video_start_capture(const struct mavlink_command *cmd)
 {
-    return fcu_sysid;
+    pthread_mutex_lock(&record_mtx);
+
+    /* Start recording */
+    if (!get_video_status(0)) {
+        status("Start recording video");
+        camera_change_record_state(0);
+    }
+    set_video_status(0);
+
+    pthread_mutex_unlock(&record_mtx);
+
+    return MAV_RESULT_ACCEPTED;
 }
 
-static void parse_mavlink_msg(mavlink_message_t *msg,
-                              struct mavlink_cmd *cmd_list,
-                              size_t msg_cnt)
+static uint8_t cmd_video_stop_capture(const struct mavlink_command *cmd)
 {
-    for (int i = 0; i < msg_cnt; i++) {
-        if (msg->msgid == cmd_list[i].msg_id) {
-            cmd_list[i].handler(msg);
-            return;
-        }
+    pthread_mutex_lock(&record_mtx);
+
+    /* Stop recording */
+    if (get_video_status(0)) {
+        status("Stop recording video");
+        camera_change_record_state(0);
     }
+    reset_video_status(0);
+
+    pthread_mutex_unlock(&record_mtx);
+
+    return MAV_RESULT_ACCEPTED;
+}
+
+static void mav_command(mavlink_message_t *recvd_msg)
+{
+    mavlink_command_receive(recvd_msg);
+}
+
+static void mav_fcu_autopilot_version(mavlink_message_t *recvd_msg)
+{
+    struct fcu_link *fcu = current_fcu();
+
+    /* Also the reply to the latency probes, only report it once */
+    if (!fcu->ready)
+        status(
+            "Established connection with flight controller (sys_id=%d) on "
+            "link %d",
+            recvd_msg->sysid, serial_link_id());
+    fcu->ready = true;
+    fcu->sysid = recvd_msg->sysid;
+}
+
+uint8_t get_fcu_sysid(void)
+{
+    return current_fcu()->sysid;
 }
 
 static struct mavlink_cmd fcu_cmds[] = {
     DEF_MAVLINK_CMD(mav_fcu_ping, 4),
-    DEF_MAVLINK_CMD(mav_fcu_gps_raw_int, 24),
     DEF_MAVLINK_CMD(mav_fcu_rc_channels, 65),
-    DEF_MAVLINK_CMD(mav_command_long, 76),
+    DEF_MAVLINK_CMD(mav_command, 75),
+    DEF_MAVLINK_CMD(mav_command, 76),
     DEF_MAVLINK_CMD(mav_fcu_autopilot_version, 148),
 };
 
-static mavlink_status_t fcu_status;
-static mavlink_message_t fcu_msg;
+/* Camera commands, the slow ones run on the command workers */
+static const struct {
+    uint16_t command;
+    mavlink_command_fn fn;
+    bool async;
+} camera_cmds[] = {
+    {MAV_CMD_DO_DIGICAM_CONTROL, cmd_digicam_control, false},
+    {MAV_CMD_REQUEST_CAMERA_INFORMATION, cmd_request_camera_information, false},
+    {MAV_CMD_REQUEST_CAMERA_SETTINGS, cmd_request_camera_settings, false},
+    {MAV_CMD_REQUEST_STORAGE_INFORMATION, cmd_request_storage_information,
+     false},
+    {MAV_CMD_REQUEST_CAMERA_CAPTURE_STATUS, cmd_request_camera_capture_status,
+     false},
+    {MAV_CMD_SET_CAMERA_MODE, cmd_set_camera_mode, false},
+    {MAV_CMD_SET_CAMERA_ZOOM, cmd_set_camera_zoom, true},
+    {MAV_CMD_IMAGE_START_CAPTURE, cmd_image_start_capture, true},
+    {MAV_CMD_IMAGE_STOP_CAPTURE, cmd_image_stop_capture, false},
+    {MAV_CMD_VIDEO_START_CAPTURE, cmd_video_start_capture, true},
+    {MAV_CMD_VIDEO_STOP_CAPTURE, cmd_video_stop_capture, true},
+};
+
+/* Kept in the telemetry cache for the rest of the server */
+static const uint32_t cached_msgids[] = {
+    MAVLINK_MSG_ID_HEARTBEAT,           MAVLINK_MSG_ID_SYS_STATUS,
+    MAVLINK_MSG_ID_SYSTEM_TIME,         MAVLINK_MSG_ID_GPS_RAW_INT,
+    MAVLINK_MSG_ID_ATTITUDE,            MAVLINK_MSG_ID_GLOBAL_POSITION_INT,
+    MAVLINK_MSG_ID_GIMBAL_DEVICE_ATTITUDE_STATUS,
+};
 
 static bool mavlink_rx_verbose = false;
 
-void read_mavlink_msg(uint8_t *buf, size_t nbytes)
+static void call_fcu_cmd(mavlink_message_t *msg, void *ctx)
 {
-    const size_t msg_cnt = sizeof(fcu_cmds) / sizeof(struct mavlink_cmd);
-    for (int i = 0; i < nbytes; i++) {
-        if (mavlink_parse_char(FCU_CHANNEL, buf[i], &fcu_msg, &fcu_status) ==
-            1) {
-            parse_mavlink_msg(&fcu_msg, fcu_cmds, msg_cnt);
-        }
+    ((struct mavlink_cmd *) ctx)->handler(msg);
+}
+
+/**
+ * Registers the handlers of the messages the server itself is interested in
+ * and the commands it runs, and the messages it caches. Other modules
+ * register theirs with `mavlink_register_handler()`,
+ * `mavlink_command_register()` and `telemetry_cache_track()`.
+ */
+void mavlink_receiver_init(void)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(cached_msgids); i++)
+        telemetry_cache_track(cached_msgids[i]);
+
+    for (size_t i = 0; i < ARRAY_SIZE(camera_cmds); i++)
+        mavlink_command_register(camera_cmds[i].command, camera_cmds[i].fn,
+                                 camera_cmds[i].async);
+
+    for (size_t i = 0; i < ARRAY_SIZE(fcu_cmds); i++) {
+        if (!mavlink_register_handler(fcu_cmds[i].msg_id, call_fcu_cmd,
+                                      &fcu_cmds[i]))
+            status("Failed to register the handler of message #%d",
+                   fcu_cmds[i].msg_id);
+    }
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Whether a frame is the earliest copy received over the redundant ports */
+static bool first_copy(struct fcu_link *fcu,
+                       int port,
+                       const struct mavlink_frame_view *frame)
+{
+    return !fcu->redundant ||
+           link_dedup_accept(&fcu->dedup, port, frame->sysid, frame->compid,
+                             frame->seq, frame->msgid, monotonic_ns());
+}
+
+/* A port being read, see `read_port()` */
+struct port_reader {
+    struct fcu_link *fcu;
+    int port;
+    mavlink_frame_cb forward;
+};
+
+static void handle_frame(const struct mavlink_frame_view *frame, void *ctx)
+{
+    struct port_reader *reader = (struct port_reader *) ctx;
+
+    if (frame->status == MAVLINK_FRAME_BAD_CRC) {
+        traffic_stats_crc_error();
+        return;
     }
 
-    if (mavlink_rx_verbose)
-        status("Received undefined message #%d", fcu_msg.msgid);
+    traffic_stats_frame_read(frame);
+
+    if (!first_copy(reader->fcu, reader->port, frame))
+        return;
+
+    traffic_stats_frame(frame);
+
+    /* Handlers run on the handler thread, the frame is copied */
+    if (frame->status == MAVLINK_FRAME_OK) {
+        telemetry_cache_update(frame);
+        if (mavlink_has_handler(frame->msgid))
+            mavlink_worker_push(frame);
+        else if (mavlink_rx_verbose)
+            status("Received undefined message #%d", frame->msgid);
+    }
+
+    if (reader->forward)
+        reader->forward(frame);
+}
+
+static void read_port(int port,
+                      uint8_t *buf,
+                      size_t nbytes,
+                      mavlink_frame_cb forward)
+{
+    struct fcu_link *fcu = current_fcu();
+    struct port_reader reader = {fcu, port, forward};
+
+    traffic_stats_serial_in(nbytes);
+    mavlink_scan(&fcu->scanner[port], buf, nbytes, handle_frame, &reader);
+}
+
+/**
+ * Parses the data read from the flight controller and queues the messages
+ * the server is interested in for their handlers. Every valid frame is also
+ * passed to `forward` if set, as are frames of messages unknown to our
+ * dialect, whose CRC cannot be checked here.
+ */
+void read_mavlink_msg(uint8_t *buf, size_t nbytes, mavlink_frame_cb forward)
+{
+    read_port(0, buf, nbytes, forward);
+}
+
+/**
+ * Like `read_mavlink_msg()`, for the data read from the redundant port of
+ * the link. Only the earliest copy of a frame received over either port is
+ * handled and forwarded.
+ */
+void read_redundant_mavlink_msg(uint8_t *buf,
+                                size_t nbytes,
+                                mavlink_frame_cb forward)
+{
+    read_port(1, buf, nbytes, forward);
+}
+
+/**
+ * Starts deduplicating the frames of the link, read from two ports from now
+ * on.
+ */
+void mavlink_enable_redundancy(void)
+{
+    struct fcu_link *fcu = current_fcu();
+
+    link_dedup_init(&fcu->dedup);
+    fcu->redundant = true;
+}
+
+/**
+ * Gets the counters of the redundant ports of the link.
+ *
+ * @return false if the link has no redundant port.
+ */
+bool get_redundancy_stats(struct link_dedup *stats)
+{
+    struct fcu_link *fcu = current_fcu();
+
+    if (!fcu->redundant)
+        return false;
+
+    *stats = fcu->dedup;
+    return true;
 }
 
 bool flight_controller_connected(void)
 {
-    return serial_is_ready;
+    return current_fcu()->ready;
 }
@@ -3,7 +3,9 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "link_dedup.h"
 #include "mavlink.h"
+#include "mavlink_scan.h"
 
 #define DEF_MAVLINK_CMD(handler_function, id)     \
     {                                             \
@@ -15,7 +17,16 @@ struct mavlink_cmd {
     void (*handler)(mavlink_message_t *msg);
 };
 
-void read_mavlink_msg(uint8_t *buf, size_t nbytes);
+/* Called for every frame read, see `read_mavlink_msg()` */
+typedef void (*mavlink_frame_cb)(const struct mavlink_frame_view *frame);
+
+void mavlink_receiver_init(void);
+void read_mavlink_msg(uint8_t *buf, size_t nbytes, mavlink_frame_cb forward);
+void read_redundant_mavlink_msg(uint8_t *buf,
+                                size_t nbytes,
+                                mavlink_frame_cb forward);
+void mavlink_enable_redundancy(void);
+bool get_redundancy_stats(struct link_dedup *stats);
 bool flight_controller_connected(void);
 uint8_t get_fcu_sysid(void);
 
@@ -0,0 +1,341 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "mavlink_router.h"
+#include "serial_link.h"
+#include "util.h"
+
+/* A route is a single word, so it is learned and looked up without a lock:
+ * ROUTE_USED, the sysid and compid, and the endpoint in the low 32 bits. A
+ * slot is never freed, a forgotten route keeps its slot with no endpoint. */
+#define ROUTE_USED (1ull << 48)
+#define ROUTE_KEY(route) ((route) >> 32)
+#define ROUTE_SYSID(route) (((route) >> 40) & 0xff)
+#define SLOT_MASK (MAVLINK_ROUTE_SLOTS - 1)
+
+struct route_queue {
+    bool open; /* The thread of the link serves clients */
+    int event; /* Wakes the thread of the link up */
+    struct mavlink_routed_frame frames[MAVLINK_ROUTE_QUEUE];
+    size_t head;
+    size_t len;
+    unsigned long dropped;
+};
+
+static _Atomic uint64_t g_routes[SERIAL_LINK_MAX][MAVLINK_ROUTE_SLOTS];
+
+static struct route_queue g_queues[SERIAL_LINK_MAX];
+static pthread_mutex_t g_queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t make_route(uint8_t sysid, uint8_t compid, int endpoint)
+{
+    return ROUTE_USED | (uint64_t) sysid << 40 | (uint64_t) compid << 32 |
+           (uint32_t) endpoint;
+}
+
+static int route_endpoint(uint64_t route)
+{
+    return (int32_t) (uint32_t) route;
+}
+
+static size_t key_hash(uint64_t key)
+{
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & SLOT_MASK;
+}
+
+/* The routes of the link served by the calling thread */
+static _Atomic uint64_t *current_routes(void)
+{
+    return g_routes[serial_link_id()];
+}
+
+static struct route_queue *current_queue(void)
+{
+    return &g_queues[serial_link_id()];
+}
+
+/**
+ * Remembers the endpoint a system's component was heard on. Components of
+ * the server are learned as MAVLINK_ROUTE_LOCAL as they send, and are never
+ * taken for remote ones afterwards, even if a frame of theirs comes back
+ * from the flight controller or a client. A full table learns nothing more,
+ * the frames for the components it misses go everywhere.
+ */
+void mavlink_router_learn(uint8_t sysid, uint8_t compid, int endpoint)
+{
+    _Atomic uint64_t *routes = current_routes();
+    uint64_t route = make_route(sysid, compid, endpoint);
+    size_t idx = key_hash(ROUTE_KEY(route));
+
+    for (size_t i = 0; i < MAVLINK_ROUTE_SLOTS; i++) {
+        _Atomic uint64_t *slot = &routes[(idx + i) & SLOT_MASK];
+        uint64_t cur = atomic_load_explicit(slot, memory_order_relaxed);
+
+        /* Another thread may claim the slot first, for this key or another
+         * one */
+        while (!cur) {
+            if (atomic_compare_exchange_weak_explicit(slot, &cur, route,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                return;
+        }
+
+        if (ROUTE_KEY(cur) != ROUTE_KEY(route))
+            continue;
+
+        while ((cur != route) &&
+               ((route_endpoint(cur) != MAVLINK_ROUTE_LOCAL) ||
+                (endpoint == MAVLINK_ROUTE_LOCAL))) {
+            if (atomic_compare_exchange_weak_explicit(slot, &cur, route,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                return;
+        }
+
+        return;
+    }
+}
+
+/**
+ * Forgets the routes through an endpoint that went away, e.g. a client that
+ * disconnected.
+ */
+void mavlink_router_forget(int endpoint)
+{
+    _Atomic uint64_t *routes = current_routes();
+
+    for (size_t i = 0; i < MAVLINK_ROUTE_SLOTS; i++) {
+        uint64_t cur = atomic_load_explicit(&routes[i], memory_order_relaxed);
+
+        while (cur && (route_endpoint(cur) == endpoint)) {
+            uint64_t none =
+                (cur & ~0xffffffffull) | (uint32_t) MAVLINK_ROUTE_ALL;
+
+            if (atomic_compare_exchange_weak_explicit(&routes[i], &cur, none,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+    }
+}
+
+static uint64_t find_route(_Atomic uint64_t *routes,
+                           uint8_t sysid,
+                           uint8_t compid)
+{
+    uint64_t key = ROUTE_KEY(make_route(sysid, compid, 0));
+    size_t idx = key_hash(key);
+
+    for (size_t i = 0; i < MAVLINK_ROUTE_SLOTS; i++) {
+        uint64_t cur = atomic_load_explicit(&routes[(idx + i) & SLOT_MASK],
+                                            memory_order_relaxed);
+
+        if (!cur)
+            return 0;
+        if (ROUTE_KEY(cur) == key)
+            return cur;
+    }
+
+    return 0;
+}
+
+/**
+ * Finds the endpoint of every component of a system but those behind `src`.
+ *
+ * @return MAVLINK_ROUTE_ALL if the system is unknown or behind several
+ * endpoints, MAVLINK_ROUTE_NONE if it is only behind `src`.
+ */
+static int system_endpoint(_Atomic uint64_t *routes, uint8_t sysid, int src)
+{
+    int found = MAVLINK_ROUTE_ALL;
+    bool behind_src = false;
+
+    for (size_t i = 0; i < MAVLINK_ROUTE_SLOTS; i++) {
+        uint64_t cur = atomic_load_explicit(&routes[i], memory_order_relaxed);
+        int endpoint = route_endpoint(cur);
+
+        if (!cur || (ROUTE_SYSID(cur) != sysid) ||
+            (endpoint == MAVLINK_ROUTE_ALL))
+            continue;
+
+        if (endpoint == src)
+            behind_src = true;
+        else if (found == MAVLINK_ROUTE_ALL)
+            found = endpoint;
+        else if (found != endpoint)
+            return MAVLINK_ROUTE_ALL;
+    }
+
+    if ((found == MAVLINK_ROUTE_ALL) && behind_src)
+        return MAVLINK_ROUTE_NONE;
+
+    return found;
+}
+
+/**
+ * Finds where a frame received from `src` goes, from the target of its
+ * message. A component never heard of a known system is reached through
+ * every endpoint of the system.
+ *
+ * @return The endpoint of its target, MAVLINK_ROUTE_ALL for a broadcast or
+ * a target never heard, MAVLINK_ROUTE_NONE for a target behind `src`.
+ */
+int mavlink_router_dest(uint32_t msgid,
+                        const uint8_t *payload,
+                        uint8_t payload_len,
+                        int src)
+{
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(msgid);
+    uint8_t sysid = 0, compid = 0;
+
+    if (!entry || !(entry->flags & MAV_MSG_ENTRY_FLAG_HAVE_TARGET_SYSTEM))
+        return MAVLINK_ROUTE_ALL;
+
+    /* The trailing zeros of a MAVLink 2 payload are not sent */
+    if (entry->target_system_ofs < payload_len)
+        sysid = payload[entry->target_system_ofs];
+    if ((entry->flags & MAV_MSG_ENTRY_FLAG_HAVE_TARGET_COMPONENT) &&
+        (entry->target_component_ofs < payload_len))
+        compid = payload[entry->target_component_ofs];
+
+    if (sysid == 0)
+        return MAVLINK_ROUTE_ALL;
+
+    _Atomic uint64_t *routes = current_routes();
+
+    if (compid) {
+        uint64_t route = find_route(routes, sysid, compid);
+        int endpoint = route_endpoint(route);
+
+        if (route && (endpoint != MAVLINK_ROUTE_ALL))
+            return endpoint == src ? MAVLINK_ROUTE_NONE : endpoint;
+    }
+
+    return system_endpoint(routes, sysid, src);
+}
+
+/**
+ * Starts taking the frames generated by the server for the clients of the
+ * calling thread's link.
+ *
+ * @return The eventfd to watch, -1 on failure.
+ */
+int mavlink_router_open(void)
+{
+    struct route_queue *q = current_queue();
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&g_queue_mtx);
+    q->open = true;
+    q->event = fd;
+    q->head = q->len = 0;
+    pthread_mutex_unlock(&g_queue_mtx);
+
+    return fd;
+}
+
+/**
+ * Stops taking frames for the clients of the link, the frames still queued
+ * are dropped.
+ */
+void mavlink_router_close(void)
+{
+    struct route_queue *q = current_queue();
+
+    pthread_mutex_lock(&g_queue_mtx);
+
+    if (q->open) {
+        close(q->event);
+        q->open = false;
+        q->len = 0;
+    }
+
+    pthread_mutex_unlock(&g_queue_mtx);
+}
+
+/**
+ * Queues a frame generated by the server for the clients of the calling
+ * thread's link, `msg` being the message it was packed from.
+ *
+ * @return false if the link serves no clients or the queue is full.
+ */
+bool mavlink_router_post(const uint8_t *data,
+                         size_t len,
+                         const mavlink_message_t *msg,
+                         int dest)
+{
+    struct route_queue *q = current_queue();
+    unsigned long dropped = 0;
+    uint64_t one = 1;
+    bool ok = false;
+
+    if (len > MAVLINK_MAX_PACKET_LEN)
+        return false;
+
+    pthread_mutex_lock(&g_queue_mtx);
+
+    if (q->open && (q->len < MAVLINK_ROUTE_QUEUE)) {
+        struct mavlink_routed_frame *frame =
+            &q->frames[(q->head + q->len++) % MAVLINK_ROUTE_QUEUE];
+
+        memcpy(frame->data, data, len);
+        frame->len = (uint16_t) len;
+        frame->msgid = msg->msgid;
+        frame->sysid = msg->sysid;
+        frame->compid = msg->compid;
+        frame->dest = dest;
+
+        /* The thread of the link drains the whole queue once woken up */
+        if (q->len == 1)
+            write(q->event, &one, sizeof(one));
+        ok = true;
+    } else if (q->open) {
+        dropped = ++q->dropped;
+    }
+
+    pthread_mutex_unlock(&g_queue_mtx);
+
+    /* Report the 1st, 2nd, 4th, 8th... drop */
+    if (dropped && ((dropped & (dropped - 1)) == 0))
+        status("Clients of link %d fall behind the server's messages, %lu "
+               "frames dropped so far",
+               serial_link_id(), dropped);
+
+    return ok;
+}
+
+/**
+ * Hands the frames queued for the clients to `cb`, on the thread of the
+ * link once its eventfd is readable.
+ */
+void mavlink_router_drain(mavlink_route_cb cb)
+{
+    struct route_queue *q = current_queue();
+    struct mavlink_routed_frame frame;
+    uint64_t count;
+
+    read(q->event, &count, sizeof(count));
+
+    for (;;) {
+        pthread_mutex_lock(&g_queue_mtx);
+
+        if (!q->len) {
+            pthread_mutex_unlock(&g_queue_mtx);
+            return;
+        }
+
+        frame = q->frames[q->head];
+        q->head = (q->head + 1) % MAVLINK_ROUTE_QUEUE;
+        q->len--;
+
+        pthread_mutex_unlock(&g_queue_mtx);
+
+        cb(&frame);
+    }
+}
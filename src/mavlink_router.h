@@ -0,0 +1,63 @@
+#ifndef __MAVLINK_ROUTER_H__
+#define __MAVLINK_ROUTER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavlink.h"
+#include "mavlink_scan.h"
+
+/* Systems and components whose endpoint a link remembers */
+#define MAVLINK_ROUTE_SLOTS 256
+
+/* Frames generated by the server waiting for the thread of a link */
+#define MAVLINK_ROUTE_QUEUE 32
+
+/* Endpoints of a link, and where a frame goes */
+#define MAVLINK_ROUTE_NONE (-2) /* Nowhere, its target is behind its source */
+#define MAVLINK_ROUTE_ALL (-1)  /* Every endpoint but its source */
+#define MAVLINK_ROUTE_SERIAL 0  /* The serial port */
+#define MAVLINK_ROUTE_LOCAL 1   /* The components of the server itself */
+#define MAVLINK_ROUTE_CLIENT(slot) (2 + (slot))
+
+/* A frame generated by the server, for the clients of a link */
+struct mavlink_routed_frame {
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+    uint16_t len;
+    uint32_t msgid;
+    uint8_t sysid;
+    uint8_t compid;
+    int dest;
+};
+
+typedef void (*mavlink_route_cb)(const struct mavlink_routed_frame *frame);
+
+/* Routes MAVLink between the endpoints of a link like mavlink-router does.
+ * Every link learns which endpoint each (sysid, compid) it hears is behind,
+ * the latest one heard wins, except for the components of the server which
+ * stay local. A frame whose message has a target goes to the endpoint of
+ * its target only, a target component of 0 to every endpoint of the target
+ * system. Broadcasts and frames for a target never heard go everywhere but
+ * where they came from. The functions below act on the link of the calling
+ * thread (see serial_link.h) and are safe to call from any thread. */
+void mavlink_router_learn(uint8_t sysid, uint8_t compid, int endpoint);
+void mavlink_router_forget(int endpoint);
+int mavlink_router_dest(uint32_t msgid,
+                        const uint8_t *payload,
+                        uint8_t payload_len,
+                        int src);
+
+/* Frames generated by the server on other threads reach the clients through
+ * the thread of the link, which is woken up by the eventfd returned by
+ * mavlink_router_open() and hands them to `cb` with mavlink_router_drain().
+ * Frames posted while the link serves no clients are dropped. */
+int mavlink_router_open(void);
+void mavlink_router_close(void);
+bool mavlink_router_post(const uint8_t *data,
+                         size_t len,
+                         const mavlink_message_t *msg,
+                         int dest);
+void mavlink_router_drain(mavlink_route_cb cb);
+
+#endif
@@ -0,0 +1,288 @@
+#include <string.h>
+#include <sys/param.h>
+
+#include "crc16.h"
+#include "mavlink_scan.h"
+
+#define MAVLINK_V1_HEADER_LEN (MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1)
+#define MAVLINK_V2_HEADER_LEN MAVLINK_NUM_HEADER_BYTES
+
+enum frame_check {
+    FRAME_INVALID,    /* Not the start of a frame */
+    FRAME_INCOMPLETE, /* Cut by the end of the data */
+    FRAME_COMPLETE,
+};
+
+/**
+ * Finds the next byte that may start a frame.
+ */
+static const uint8_t *find_stx(const uint8_t *p, const uint8_t *end)
+{
+    /* Frames usually come back to back */
+    if ((*p == MAVLINK_STX) || (*p == MAVLINK_STX_MAVLINK1))
+        return p;
+
+    const uint8_t *v2 = memchr(p, MAVLINK_STX, end - p);
+    const uint8_t *v1 =
+        memchr(p, MAVLINK_STX_MAVLINK1, (v2 ? v2 : end) - p);
+
+    return v1 ? v1 : v2;
+}
+
+/**
+ * Reads the header of a frame starting at `p` and, once the frame is all
+ * there, checks its CRC.
+ */
+static enum frame_check check_frame(const uint8_t *p,
+                                    size_t avail,
+                                    struct mavlink_frame_view *frame)
+{
+    size_t header_len;
+
+    if (avail < 2)
+        return FRAME_INCOMPLETE;
+
+    frame->magic = p[0];
+    frame->payload_len = p[1];
+
+    if (frame->magic == MAVLINK_STX_MAVLINK1) {
+        header_len = MAVLINK_V1_HEADER_LEN;
+        if (avail < header_len)
+            return FRAME_INCOMPLETE;
+
+        frame->incompat_flags = 0;
+        frame->compat_flags = 0;
+        frame->seq = p[2];
+        frame->sysid = p[3];
+        frame->compid = p[4];
+        frame->msgid = p[5];
+    } else {
+        header_len = MAVLINK_V2_HEADER_LEN;
+        if (avail < header_len)
+            return FRAME_INCOMPLETE;
+
+        /* A flag we do not know is a false start */
+        if (p[2] & ~MAVLINK_IFLAG_SIGNED)
+            return FRAME_INVALID;
+
+        frame->incompat_flags = p[2];
+        frame->compat_flags = p[3];
+        frame->seq = p[4];
+        frame->sysid = p[5];
+        frame->compid = p[6];
+        frame->msgid = p[7] | (uint32_t) p[8] << 8 | (uint32_t) p[9] << 16;
+    }
+
+    size_t crc_at = header_len + frame->payload_len;
+    size_t len = crc_at + MAVLINK_NUM_CHECKSUM_BYTES;
+
+    if (frame->incompat_flags & MAVLINK_IFLAG_SIGNED)
+        len += MAVLINK_SIGNATURE_BLOCK_LEN;
+
+    if (avail < len)
+        return FRAME_INCOMPLETE;
+
+    frame->data = p;
+    frame->len = (uint16_t) len;
+    frame->payload = p + header_len;
+
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(frame->msgid);
+
+    if (!entry) {
+        frame->status = MAVLINK_FRAME_UNCHECKED;
+        return FRAME_COMPLETE;
+    }
+
+    /* The CRC covers everything after the STX, then the CRC extra */
+    uint16_t crc = crc16_x25_update(CRC16_X25_INIT, p + 1, crc_at - 1);
+    crc = crc16_x25_update(crc, &entry->crc_extra, 1);
+
+    frame->status = (crc == (p[crc_at] | p[crc_at + 1] << 8))
+                        ? MAVLINK_FRAME_OK
+                        : MAVLINK_FRAME_BAD_CRC;
+
+    return FRAME_COMPLETE;
+}
+
+/**
+ * Looks for a frame whose CRC matches within a frame of a message unknown to
+ * our dialect, whose own CRC cannot be checked. An STX found in payload
+ * bytes would otherwise swallow the real frames that follow it.
+ *
+ * @return FRAME_COMPLETE if a good frame starts within it, FRAME_INCOMPLETE
+ * if one may but is cut by the end of the data, FRAME_INVALID otherwise.
+ */
+static enum frame_check find_hidden_frame(
+    const struct mavlink_frame_view *frame,
+    const uint8_t *end)
+{
+    const uint8_t *frame_end = frame->data + frame->len;
+    const uint8_t *p = frame->data + 1;
+
+    while ((p < frame_end) && (p = find_stx(p, frame_end))) {
+        struct mavlink_frame_view inner;
+
+        switch (check_frame(p, end - p, &inner)) {
+        case FRAME_INCOMPLETE:
+            return FRAME_INCOMPLETE;
+        case FRAME_COMPLETE:
+            if (inner.status == MAVLINK_FRAME_OK)
+                return FRAME_COMPLETE;
+            break;
+        case FRAME_INVALID:
+            break;
+        }
+
+        p++;
+    }
+
+    return FRAME_INVALID;
+}
+
+/**
+ * Passes every frame of a buffer to `cb`.
+ *
+ * @return Where the frame cut by the end of the buffer starts, or the length
+ * of the buffer if there is none.
+ */
+static size_t scan_buffer(struct mavlink_scanner *scanner,
+                          const uint8_t *buf,
+                          size_t len,
+                          mavlink_scan_cb cb,
+                          void *ctx)
+{
+    const uint8_t *end = buf + len;
+    const uint8_t *p = buf;
+
+    while (p < end) {
+        const uint8_t *stx = find_stx(p, end);
+
+        if (!stx) {
+            scanner->skipped += end - p;
+            break;
+        }
+
+        scanner->skipped += stx - p;
+        p = stx;
+
+        struct mavlink_frame_view frame;
+
+        switch (check_frame(p, end - p, &frame)) {
+        case FRAME_INCOMPLETE:
+            return p - buf;
+        case FRAME_INVALID:
+            scanner->skipped++;
+            p++;
+            continue;
+        case FRAME_COMPLETE:
+            break;
+        }
+
+        if (frame.status == MAVLINK_FRAME_UNCHECKED) {
+            /* The frame that would start within it lies within the room
+             * kept for a cut frame, see `pending` */
+            enum frame_check hidden = find_hidden_frame(&frame, end);
+
+            if (hidden == FRAME_INCOMPLETE)
+                return p - buf;
+
+            if (hidden == FRAME_COMPLETE) {
+                /* A false start, resync on the frame it hides */
+                scanner->skipped++;
+                p++;
+                continue;
+            }
+        }
+
+        scanner->frames++;
+        cb(&frame, ctx);
+
+        if (frame.status == MAVLINK_FRAME_BAD_CRC) {
+            /* Maybe a false start, look for a frame right after it */
+            scanner->bad_crc++;
+            scanner->skipped++;
+            p++;
+        } else {
+            p += frame.len;
+        }
+    }
+
+    return len;
+}
+
+/**
+ * Passes every frame found in the data read from a port to `cb`, including
+ * the frames of known messages with a bad CRC. The start of a frame cut by
+ * the end of the data is kept until the next call.
+ */
+void mavlink_scan(struct mavlink_scanner *scanner,
+                  const uint8_t *data,
+                  size_t len,
+                  mavlink_scan_cb cb,
+                  void *ctx)
+{
+    while (scanner->pending_len) {
+        /* Complete the frame cut by a previous read. Whatever starts at the
+         * beginning of `pending` fits in it, a frame of an unknown message
+         * and a frame it hides included, so each round makes progress. */
+        size_t take = MIN(len, sizeof(scanner->pending) - scanner->pending_len);
+        size_t total = scanner->pending_len + take;
+
+        memcpy(scanner->pending + scanner->pending_len, data, take);
+
+        size_t used = scan_buffer(scanner, scanner->pending, total, cb, ctx);
+
+        if (used >= scanner->pending_len) {
+            /* Scan the rest where it is */
+            data += used - scanner->pending_len;
+            len -= used - scanner->pending_len;
+            scanner->pending_len = 0;
+            break;
+        }
+
+        memmove(scanner->pending, scanner->pending + used, total - used);
+        scanner->pending_len = total - used;
+        data += take;
+        len -= take;
+
+        if (!len)
+            return;
+    }
+
+    size_t used = scan_buffer(scanner, data, len, cb, ctx);
+
+    memcpy(scanner->pending, data + used, len - used);
+    scanner->pending_len = len - used;
+}
+
+/**
+ * Copies a frame into a message, for the functions decoding messages. The
+ * payload trimmed by MAVLink 2 is zero-filled.
+ */
+void mavlink_frame_to_msg(const struct mavlink_frame_view *frame,
+                          mavlink_message_t *msg)
+{
+    const uint8_t *ck = frame->payload + frame->payload_len;
+    char *payload = _MAV_PAYLOAD_NON_CONST(msg);
+
+    msg->magic = frame->magic;
+    msg->len = frame->payload_len;
+    msg->incompat_flags = frame->incompat_flags;
+    msg->compat_flags = frame->compat_flags;
+    msg->seq = frame->seq;
+    msg->sysid = frame->sysid;
+    msg->compid = frame->compid;
+    msg->msgid = frame->msgid;
+
+    memcpy(payload, frame->payload, frame->payload_len);
+    memset(payload + frame->payload_len, 0,
+           MAVLINK_MAX_PAYLOAD_LEN - frame->payload_len);
+
+    msg->ck[0] = ck[0];
+    msg->ck[1] = ck[1];
+    msg->checksum = ck[0] | ck[1] << 8;
+
+    if (frame->incompat_flags & MAVLINK_IFLAG_SIGNED)
+        memcpy(msg->signature, ck + MAVLINK_NUM_CHECKSUM_BYTES,
+               MAVLINK_SIGNATURE_BLOCK_LEN);
+}
@@ -0,0 +1,60 @@
+#ifndef __MAVLINK_SCAN_H__
+#define __MAVLINK_SCAN_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavlink.h"
+
+enum mavlink_frame_status {
+    MAVLINK_FRAME_OK,        /* The CRC matches */
+    MAVLINK_FRAME_UNCHECKED, /* Unknown to our dialect, no CRC extra */
+    MAVLINK_FRAME_BAD_CRC,   /* A known message with a bad CRC */
+};
+
+/* A frame found by the scanner. It points into the data scanned, or into
+ * the scanner for a frame split across reads, and is only valid during the
+ * callback. */
+struct mavlink_frame_view {
+    const uint8_t *data; /* The whole frame as it was on the wire */
+    uint16_t len;
+    enum mavlink_frame_status status;
+
+    uint8_t magic;
+    uint8_t payload_len;
+    uint8_t incompat_flags;
+    uint8_t compat_flags;
+    uint8_t seq;
+    uint8_t sysid;
+    uint8_t compid;
+    uint32_t msgid;
+    const uint8_t *payload;
+};
+
+/* Finds the MAVLink frames in a byte stream a whole read at a time instead
+ * of a byte at a time: frame starts are searched with memchr(), and a frame
+ * is checked with a single CRC pass once all of it is there. Only the start
+ * of a frame cut by the end of a read is copied, to be completed by the
+ * next one. A zeroed scanner is ready for use. */
+struct mavlink_scanner {
+    uint8_t pending[2 * MAVLINK_MAX_PACKET_LEN]; /* A frame, and one within */
+    size_t pending_len;
+
+    unsigned long frames;  /* Frames found, good or not */
+    unsigned long bad_crc; /* False starts included */
+    unsigned long skipped; /* Bytes outside of frames */
+};
+
+typedef void (*mavlink_scan_cb)(const struct mavlink_frame_view *frame,
+                                void *ctx);
+
+void mavlink_scan(struct mavlink_scanner *scanner,
+                  const uint8_t *data,
+                  size_t len,
+                  mavlink_scan_cb cb,
+                  void *ctx);
+void mavlink_frame_to_msg(const struct mavlink_frame_view *frame,
+                          mavlink_message_t *msg);
+
+#endif
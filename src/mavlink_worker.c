@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mavlink_dispatch.h"
+#include "mavlink_worker.h"
+#include "serial_link.h"
+#include "util.h"
+
+/* Frames queued per link, a power of two */
+#define MAVLINK_WORKER_SLOTS 256
+
+#define CACHE_LINE 64
+
+struct mavlink_worker_slot {
+    uint64_t queued_ns;
+    struct mavlink_frame_view frame; /* Its pointers are rebuilt on pop */
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+};
+
+/* Bounded SPSC queue: the thread of the link alone advances `tail`, the
+ * handler thread alone advances `head`, each on its own cache line */
+struct mavlink_worker {
+    struct mavlink_worker_slot *slots;
+    pthread_t tid;
+    int event; /* Wakes the handler thread up */
+    atomic_bool running;
+    atomic_bool stop;
+    atomic_bool sleeping;
+
+    alignas(CACHE_LINE) atomic_size_t tail;
+    size_t depth_max; /* Of the producer */
+    atomic_uint_least64_t overflows;
+
+    alignas(CACHE_LINE) atomic_size_t head;
+    atomic_uint_least64_t handled;
+    atomic_uint_least64_t latency_sum_ns;
+    atomic_uint_least64_t latency_max_ns;
+};
+
+static struct mavlink_worker g_workers[SERIAL_LINK_MAX];
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* The worker of the link served by the calling thread */
+static struct mavlink_worker *current_worker(void)
+{
+    return &g_workers[serial_link_id()];
+}
+
+static bool queue_empty(struct mavlink_worker *w)
+{
+    return atomic_load_explicit(&w->head, memory_order_relaxed) ==
+           atomic_load_explicit(&w->tail, memory_order_acquire);
+}
+
+static void wait_for_frames(struct mavlink_worker *w)
+{
+    uint64_t count;
+
+    atomic_store(&w->sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* A frame may have been queued before the flag was set */
+    if (queue_empty(w) && !atomic_load(&w->stop))
+        read(w->event, &count, sizeof(count));
+
+    atomic_store(&w->sleeping, false);
+}
+
+static void handle_slot(struct mavlink_worker *w,
+                        struct mavlink_worker_slot *slot)
+{
+    struct mavlink_frame_view frame = slot->frame;
+
+    frame.payload = slot->data + (frame.payload - frame.data);
+    frame.data = slot->data;
+
+    mavlink_dispatch(&frame);
+
+    uint64_t latency = monotonic_ns() - slot->queued_ns;
+
+    atomic_fetch_add_explicit(&w->handled, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->latency_sum_ns, latency,
+                              memory_order_relaxed);
+    if (latency >
+        atomic_load_explicit(&w->latency_max_ns, memory_order_relaxed))
+        atomic_store_explicit(&w->latency_max_ns, latency,
+                              memory_order_relaxed);
+}
+
+static void *mavlink_worker_thread(void *args)
+{
+    struct mavlink_worker *w = args;
+
+    /* Handlers act on the link the frames came from */
+    serial_link_bind((int) (w - g_workers));
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+
+        if (head == atomic_load_explicit(&w->tail, memory_order_acquire)) {
+            if (atomic_load(&w->stop))
+                break;
+
+            wait_for_frames(w);
+            continue;
+        }
+
+        handle_slot(w, &w->slots[head % MAVLINK_WORKER_SLOTS]);
+
+        /* Hand the slot back to the thread of the link */
+        atomic_store_explicit(&w->head, head + 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the handler thread of the calling thread's link.
+ */
+bool mavlink_worker_start(void)
+{
+    struct mavlink_worker *w = current_worker();
+
+    w->slots = calloc(MAVLINK_WORKER_SLOTS, sizeof(struct mavlink_worker_slot));
+    if (!w->slots)
+        return false;
+
+    w->depth_max = 0;
+    atomic_init(&w->head, 0);
+    atomic_init(&w->tail, 0);
+    atomic_init(&w->overflows, 0);
+    atomic_init(&w->handled, 0);
+    atomic_init(&w->latency_sum_ns, 0);
+    atomic_init(&w->latency_max_ns, 0);
+    atomic_init(&w->stop, false);
+    atomic_init(&w->sleeping, false);
+
+    if ((w->event = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto cleanup;
+
+    if (pthread_create(&w->tid, NULL, mavlink_worker_thread, w) != 0)
+        goto cleanup;
+
+    atomic_store(&w->running, true);
+
+    return true;
+
+cleanup:
+    if (w->event >= 0)
+        close(w->event);
+    w->event = -1;
+    free(w->slots);
+    w->slots = NULL;
+
+    return false;
+}
+
+/**
+ * Handles the frames still queued and stops the handler thread.
+ */
+void mavlink_worker_stop(void)
+{
+    struct mavlink_worker *w = current_worker();
+    uint64_t one = 1;
+
+    if (!atomic_exchange(&w->running, false))
+        return;
+
+    atomic_store(&w->stop, true);
+    write(w->event, &one, sizeof(one));
+    pthread_join(w->tid, NULL);
+
+    close(w->event);
+    w->event = -1;
+    free(w->slots);
+    w->slots = NULL;
+}
+
+/**
+ * Queues a frame for its handlers, without waiting for them. Called from
+ * the thread of the link only.
+ *
+ * @return false if the handler thread is not running or the queue is full
+ * and the frame was dropped.
+ */
+bool mavlink_worker_push(const struct mavlink_frame_view *frame)
+{
+    struct mavlink_worker *w = current_worker();
+    uint64_t one = 1;
+
+    if (!atomic_load_explicit(&w->running, memory_order_relaxed))
+        return false;
+
+    size_t tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    size_t depth =
+        tail - atomic_load_explicit(&w->head, memory_order_acquire);
+
+    if (depth == MAVLINK_WORKER_SLOTS) {
+        uint64_t overflows = atomic_fetch_add(&w->overflows, 1) + 1;
+
+        /* Report the 1st, 2nd, 4th, 8th... overflow */
+        if ((overflows & (overflows - 1)) == 0)
+            status(
+                "Message handlers of link %d fall behind, %lu frames dropped "
+                "so far",
+                serial_link_id(), (unsigned long) overflows);
+        return false;
+    }
+
+    struct mavlink_worker_slot *slot = &w->slots[tail % MAVLINK_WORKER_SLOTS];
+
+    memcpy(slot->data, frame->data, frame->len);
+    slot->frame = *frame;
+    slot->queued_ns = monotonic_ns();
+
+    atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+    if (depth + 1 > w->depth_max)
+        w->depth_max = depth + 1;
+
+    /* Only wake the handler thread up if it went to sleep. The fence orders
+     * the tail store before the flag load, as the handler thread orders its
+     * flag store before its tail load. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&w->sleeping, false))
+        write(w->event, &one, sizeof(one));
+
+    return true;
+}
+
+/**
+ * Gets the counters of the handler thread of the calling thread's link.
+ */
+void mavlink_worker_get_stats(struct mavlink_worker_stats *stats)
+{
+    struct mavlink_worker *w = current_worker();
+    uint64_t handled = atomic_load(&w->handled);
+
+    stats->depth = atomic_load(&w->tail) - atomic_load(&w->head);
+    stats->depth_max = w->depth_max;
+    stats->handled = handled;
+    stats->overflows = atomic_load(&w->overflows);
+    stats->latency_avg_us =
+        handled ? atomic_load(&w->latency_sum_ns) / handled / 1000 : 0;
+    stats->latency_max_us = atomic_load(&w->latency_max_ns) / 1000;
+}
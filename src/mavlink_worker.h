@@ -0,0 +1,31 @@
+#ifndef __MAVLINK_WORKER_H__
+#define __MAVLINK_WORKER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavlink_scan.h"
+
+struct mavlink_worker_stats {
+    size_t depth;            /* Frames waiting for their handlers */
+    size_t depth_max;        /* Most frames ever waiting */
+    uint64_t handled;        /* Frames passed to their handlers */
+    uint64_t overflows;      /* Frames dropped because the queue was full */
+    uint64_t latency_avg_us; /* From queueing to the end of the handlers */
+    uint64_t latency_max_us;
+};
+
+/* The handlers of the received messages run on a thread of their own, so a
+ * slow one (a camera command may block for seconds) never holds up reading
+ * the serial port and feeding the clients. The thread of the link copies
+ * the frames that have a handler into a lock-free single-producer,
+ * single-consumer queue, and drops them if it is full. Each serial link has
+ * its own handler thread, bound to the link, and the functions below act on
+ * the link of the calling thread (see serial_link.h). */
+bool mavlink_worker_start(void);
+void mavlink_worker_stop(void);
+bool mavlink_worker_push(const struct mavlink_frame_view *frame);
+void mavlink_worker_get_stats(struct mavlink_worker_stats *stats);
+
+#endif
@@ -1,6 +1,8 @@
 /* serial.c - A wrapper over platform-specific serial port functionality. */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,6 +10,12 @@
 #include <unistd.h>
 
 #include "serial.h"
+#if defined(__linux__)
+#include "serial_linux.h"
+#endif
+
+/* How long a write may wait for the port to drain before giving up */
+#define SERIAL_WRITE_TIMEOUT 1000 /* ms */
 
 static int convert_baudrate(int baudrate)
 {
@@ -153,6 +161,15 @@ serial_t serial_open(const char *port_s,
 {
     serial_t fd;
     int br = convert_baudrate(cfg->baudrate);
+    bool custom_baudrate = false;
+
+#if defined(__linux__)
+    /* Open at any standard rate, termios2 sets the real one below */
+    if ((br == B0) && cfg->baudrate) {
+        br = B38400;
+        custom_baudrate = true;
+    }
+#endif
 
     if (br == B0) {
         fprintf(stderr, "baudrate %u is not supported\n", cfg->baudrate);
@@ -216,7 +233,10 @@ serial_t serial_open(const char *port_s,
             }
         }
 
-        tio.c_cflag &= ~CRTSCTS; /* Disable flow control. */
+        if (cfg->rtscts)
+            tio.c_cflag |= CRTSCTS; /* Enable hardware flow control. */
+        else
+            tio.c_cflag &= ~CRTSCTS; /* Disable flow control. */
         tio.c_cflag &= ~CSIZE;
 
         /* Set data bits */
@@ -242,13 +262,33 @@ serial_t serial_open(const char *port_s,
             return SERIAL_INVALID_FD;
         }
 
-        tio.c_cc[VMIN] = 1; /* Non-cannonical. */
-        tio.c_cc[VTIME] = timeout < 0 ? 0 : (timeout + 99) / 100;
+        /* Non-cannonical. With VTIME at 0, the port only polls readable
+         * once VMIN bytes have arrived, so fewer wakeups carry more bytes */
+        tio.c_cc[VMIN] = cfg->vmin;
+        if (cfg->vtime >= 0)
+            tio.c_cc[VTIME] = cfg->vtime;
+        else
+            tio.c_cc[VTIME] = timeout < 0 ? 0 : (timeout + 99) / 100;
 
         if (tcsetattr(fd, TCSANOW, &tio) < 0) {
             serial_close(fd);
             return SERIAL_INVALID_FD;
         }
+
+#if defined(__linux__)
+        if (custom_baudrate && !serial_set_custom_baudrate(fd, cfg->baudrate)) {
+            fprintf(stderr, "baudrate %u is not supported\n", cfg->baudrate);
+            serial_close(fd);
+            return SERIAL_INVALID_FD;
+        }
+
+        if (cfg->low_latency && !serial_set_low_latency(fd))
+            fprintf(stderr, "%s does not support low latency mode\n", port_s);
+
+        if ((cfg->latency_timer > 0) &&
+            !serial_set_latency_timer(port_s, cfg->latency_timer))
+            fprintf(stderr, "Failed to set the latency timer of %s\n", port_s);
+#endif
     }
 
     return fd;
@@ -264,19 +304,50 @@ long serial_read(serial_t fd, unsigned char *o_buf, size_t size)
     return count;
 }
 
-bool serial_write(serial_t fd, const unsigned char *buf, size_t size)
+bool serial_write(serial_t fd,
+                  const unsigned char *buf,
+                  size_t size,
+                  struct serial_write_stats *stats)
 {
     size_t written = 0;
 
-    for (;;) {
+    while (written < size) {
         long w = write(fd, buf + written, size - written);
 
-        if (w < 0)
-            return false;
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                break;
+
+            /* The port is opened non-blocking, wait for the UART to drain
+             * instead of losing the rest of the data */
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            int ret;
+
+            stats->stalls++;
+
+            do {
+                ret = poll(&pfd, 1, SERIAL_WRITE_TIMEOUT);
+            } while ((ret < 0) && (errno == EINTR));
+
+            if ((ret <= 0) || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+                break;
+
+            continue;
+        }
+
+        if ((size_t) w < size - written)
+            stats->partial_writes++;
 
         written += (size_t) w;
+    }
 
-        if (written == size)
-            return true;
+    if (written < size) {
+        stats->dropped_bytes += size - written;
+        return false;
     }
+
+    return true;
 }
@@ -59,6 +59,11 @@ struct SerialConfig {
     enum SerialParity parity;
     int data_bits;
     enum SerialStopBits stop_bits;
+    bool rtscts;       /* RTS/CTS hardware flow control */
+    bool low_latency;  /* Ask the driver not to batch received bytes */
+    int latency_timer; /* FTDI latency timer in ms, 0 to leave it as is */
+    int vmin;          /* Bytes before the port polls readable, if !vtime */
+    int vtime;         /* Inter-byte timeout (in 0.1 s), -1 for `timeout` */
 };
 
 /**
@@ -68,10 +73,14 @@ struct SerialConfig {
  * or "/dev/ttyS0" on Linux)
  * @param cfg       Pointer to serial port configuration info.
  * @param timeout   The read timeout (in milliseconds) to set on the port. A
- * negative value for infinity.
+ * negative value for infinity. Only used if `cfg->vtime` is negative.
  *
  * @return          An OS handle to the open serial port if successful.
  * `SERIAL_INVALID_FD` otherwise.
+ *
+ * Baud rates without a standard constant are set with termios2 on Linux. The
+ * low latency settings are best effort, a port that doesn't support them is
+ * still opened.
  */
 serial_t serial_open(const char *port_s,
                      const struct SerialConfig *cfg,
@@ -89,6 +98,12 @@ serial_t serial_open(const char *port_s,
  */
 long serial_read(serial_t fd, unsigned char *o_buf, size_t size);
 
+struct serial_write_stats {
+    unsigned long stalls;         /* Writes that found the port full */
+    unsigned long partial_writes; /* Writes that took only part of the data */
+    unsigned long dropped_bytes;  /* Bytes given up on */
+};
+
 /**
  * Writes data into a serial port.
  *
@@ -96,11 +111,20 @@ long serial_read(serial_t fd, unsigned char *o_buf, size_t size);
  * @param buf   Pointer to a memory buffer containing data to write into the
  * serial port.
  * @param size  The amount of bytes to write.
+ * @param stats The counters of the caller's writes, which the stalls,
+ * partial writes and dropped bytes of this one are added to.
  *
  * @return      TRUE if all the bytes were successfully written into the serial
  * port. FALSE otherwise.
+ *
+ * When the port's transmit buffer is full, the call waits for it to become
+ * writable again. The rest of the data is only dropped if the port makes no
+ * progress for a second.
  */
-bool serial_write(serial_t fd, const unsigned char *buf, size_t size);
+bool serial_write(serial_t fd,
+                  const unsigned char *buf,
+                  size_t size,
+                  struct serial_write_stats *stats);
 
 /**
  * Closes an open serial port.
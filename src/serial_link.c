@@ -0,0 +1,19 @@
+#include "serial_link.h"
+
+static __thread int g_link = 0;
+
+/**
+ * Makes the calling thread serve a link.
+ */
+void serial_link_bind(int link)
+{
+    g_link = link;
+}
+
+/**
+ * Returns the link served by the calling thread.
+ */
+int serial_link_id(void)
+{
+    return g_link;
+}
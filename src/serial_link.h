@@ -0,0 +1,18 @@
+#ifndef __SERIAL_LINK_H__
+#define __SERIAL_LINK_H__
+
+/* Serial ports served by one server process, each to its own flight
+ * controller. Link 0 is the port of `port` in serial.yaml. */
+#define SERIAL_LINK_MAX 4
+
+/* MAVLink channel of a link, for the sequence numbers of what the server
+ * sends on it. What it receives is parsed by a `struct mavlink_scanner`. */
+#define SERIAL_LINK_CHANNEL(link) (MAVLINK_COMM_1 + (link))
+
+/* Every link is served by a thread of its own. The modules that keep state
+ * per link look it up with the link of the calling thread, which is link 0
+ * for the threads that serve no link, such as the RB5 publisher. */
+void serial_link_bind(int link);
+int serial_link_id(void);
+
+#endif
@@ -0,0 +1,72 @@
+/* serial_linux.c - Linux-specific serial port tuning.
+ *
+ * Kept apart from serial.c, as the kernel's termios2 definitions in
+ * <asm/termbits.h> clash with the libc ones in <termios.h>. */
+
+#include <asm/termbits.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "serial_linux.h"
+
+bool serial_set_custom_baudrate(int fd, unsigned baudrate)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return false;
+
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baudrate;
+    tio.c_ospeed = baudrate;
+
+    if (ioctl(fd, TCSETS2, &tio) < 0)
+        return false;
+
+    /* Drivers round the rate to what their clock can divide down to, refuse
+     * one that ends up too far off to keep the framing */
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return false;
+
+    unsigned diff = tio.c_ospeed > baudrate ? tio.c_ospeed - baudrate
+                                            : baudrate - tio.c_ospeed;
+    return diff <= baudrate / 50;
+}
+
+bool serial_set_low_latency(int fd)
+{
+    struct serial_struct ss;
+
+    if (ioctl(fd, TIOCGSERIAL, &ss) < 0)
+        return false;
+
+    ss.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &ss) == 0;
+}
+
+bool serial_set_latency_timer(const char *port_s, int ms)
+{
+    char real_path[PATH_MAX];
+    char sysfs_path[PATH_MAX];
+
+    /* Follow links such as /dev/serial/by-id/... to the ttyUSBx node */
+    if (!realpath(port_s, real_path))
+        return false;
+
+    snprintf(sysfs_path, sizeof(sysfs_path),
+             "/sys/bus/usb-serial/devices/%s/latency_timer",
+             basename(real_path));
+
+    FILE *file = fopen(sysfs_path, "w");
+    if (!file)
+        return false;
+
+    bool ok = fprintf(file, "%d\n", ms) > 0;
+    return (fclose(file) == 0) && ok;
+}
@@ -0,0 +1,42 @@
+/* serial_linux.h - Linux-specific serial port tuning. */
+
+#ifndef __SERIAL_LINUX_H__
+#define __SERIAL_LINUX_H__
+
+#include <stdbool.h>
+
+/**
+ * Sets a baud rate that has no Bxxx constant, e.g. 921600 on some libcs or
+ * 1843200, with termios2 and BOTHER. The rest of the port settings are left
+ * as they are.
+ *
+ * @param fd        An open serial port.
+ * @param baudrate  The baud rate to set.
+ *
+ * @return          TRUE if the driver accepted the rate. FALSE otherwise.
+ */
+bool serial_set_custom_baudrate(int fd, unsigned baudrate);
+
+/**
+ * Asks the driver to push received bytes to the tty layer as soon as they
+ * arrive (ASYNC_LOW_LATENCY) instead of in batches.
+ *
+ * @param fd    An open serial port.
+ *
+ * @return      TRUE on success. FALSE if the driver doesn't support it.
+ */
+bool serial_set_low_latency(int fd);
+
+/**
+ * Sets the latency timer of an FTDI USB adapter, which holds back received
+ * bytes for up to 16 ms by default.
+ *
+ * @param port_s    The name of the serial port, e.g. "/dev/ttyUSB0".
+ * @param ms        The latency timer, from 1 to 255 ms.
+ *
+ * @return          TRUE on success. FALSE if the port isn't an FTDI adapter
+ * or the timer can't be written.
+ */
+bool serial_set_latency_timer(const char *port_s, int ms);
+
+#endif
@@ -0,0 +1,425 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serial_link.h"
+#include "serial_tx.h"
+#include "traffic_stats.h"
+#include "util.h"
+
+/* Frames queued per lane, powers of two */
+#define SERIAL_TX_CONTROL_SLOTS 32
+#define SERIAL_TX_TELEMETRY_SLOTS 32
+#define SERIAL_TX_BULK_SLOTS 256
+
+/* Most bytes handed to a single write, roughly 90ms at 115200 bps */
+#define SERIAL_TX_BATCH_MAX 1024
+
+struct serial_tx_slot {
+    atomic_size_t seq; /* Position the slot is ready for, see push/pop */
+    uint64_t queued_ns;
+    uint16_t len;
+    uint8_t data[SERIAL_TX_FRAME_MAX];
+};
+
+/* Bounded MPSC queue: producers claim a position with a CAS on `tail` and
+ * publish the slot through its sequence number, the writer thread alone
+ * advances `head` */
+struct serial_tx_queue {
+    struct serial_tx_slot *slots;
+    size_t mask;
+    atomic_size_t tail;
+    atomic_size_t head;
+
+    /* Updated by the writer thread only */
+    atomic_uint_least64_t sent;
+    atomic_uint_least64_t latency_sum_ns;
+    atomic_uint_least64_t latency_max_ns;
+
+    atomic_uint_least64_t dropped;
+};
+
+/* The writer of one serial link */
+struct serial_tx_writer {
+    serial_t fd;
+    pthread_t tid;
+    int event; /* Wakes the writer thread up */
+    atomic_bool running;
+    atomic_bool stop;
+    atomic_bool sleeping;
+    struct serial_tx_queue lanes[SERIAL_TX_LANES];
+
+    /* See `struct serial_write_stats` */
+    atomic_ulong write_stalls;
+    atomic_ulong partial_writes;
+    atomic_ulong dropped_bytes;
+};
+
+static struct serial_tx_writer g_tx[SERIAL_LINK_MAX];
+
+static const size_t lane_slots[SERIAL_TX_LANES] = {
+    [SERIAL_TX_CONTROL] = SERIAL_TX_CONTROL_SLOTS,
+    [SERIAL_TX_TELEMETRY] = SERIAL_TX_TELEMETRY_SLOTS,
+    [SERIAL_TX_BULK] = SERIAL_TX_BULK_SLOTS,
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static bool queue_init(struct serial_tx_queue *q, size_t slots)
+{
+    q->slots = calloc(slots, sizeof(struct serial_tx_slot));
+    if (!q->slots)
+        return false;
+
+    for (size_t i = 0; i < slots; i++)
+        atomic_init(&q->slots[i].seq, i);
+
+    q->mask = slots - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+
+    return true;
+}
+
+static bool queue_push(struct serial_tx_queue *q,
+                       const uint8_t *buf,
+                       size_t len)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    struct serial_tx_slot *slot;
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            /* The slot is free, try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* The writer has not released the slot yet, the lane is full */
+            return false;
+        } else {
+            /* Another producer got there first */
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot->data, buf, len);
+    slot->len = (uint16_t) len;
+    slot->queued_ns = monotonic_ns();
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    return true;
+}
+
+/* Returns the oldest published slot, or NULL if there is none */
+static struct serial_tx_slot *queue_peek(struct serial_tx_queue *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct serial_tx_slot *slot = &q->slots[head & q->mask];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1)
+        return NULL;
+
+    return slot;
+}
+
+/* Hands the slot returned by `queue_peek()` back to the producers */
+static void queue_pop(struct serial_tx_queue *q, struct serial_tx_slot *slot)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, head + q->mask + 1,
+                          memory_order_release);
+    atomic_store_explicit(&q->head, head + 1, memory_order_relaxed);
+}
+
+/* The writer of the link served by the calling thread */
+static struct serial_tx_writer *current_writer(void)
+{
+    return &g_tx[serial_link_id()];
+}
+
+static bool queues_empty(struct serial_tx_writer *tx)
+{
+    for (int lane = 0; lane < SERIAL_TX_LANES; lane++) {
+        if (queue_peek(&tx->lanes[lane]))
+            return false;
+    }
+
+    return true;
+}
+
+static void wait_for_frames(struct serial_tx_writer *tx)
+{
+    uint64_t count;
+
+    atomic_store(&tx->sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* A producer may have queued a frame before the flag was set */
+    if (queues_empty(tx) && !atomic_load(&tx->stop))
+        read(tx->event, &count, sizeof(count));
+
+    atomic_store(&tx->sleeping, false);
+}
+
+static void *serial_tx_thread(void *args)
+{
+    struct serial_tx_writer *tx = args;
+    uint8_t batch[SERIAL_TX_BATCH_MAX];
+    uint64_t queued_ns[SERIAL_TX_BATCH_MAX / 8];
+    int batch_lane[SERIAL_TX_BATCH_MAX / 8];
+
+    /* Count what is written on the link of the writer */
+    serial_link_bind((int) (tx - g_tx));
+
+    for (;;) {
+        size_t len = 0;
+        int frames = 0;
+
+        /* Fill the batch in priority order, whole frames only */
+        for (int lane = 0; lane < SERIAL_TX_LANES; lane++) {
+            struct serial_tx_queue *q = &tx->lanes[lane];
+            struct serial_tx_slot *slot;
+
+            while ((frames < (int) ARRAY_SIZE(queued_ns)) &&
+                   (slot = queue_peek(q)) &&
+                   (len + slot->len <= sizeof(batch))) {
+                memcpy(batch + len, slot->data, slot->len);
+                len += slot->len;
+                queued_ns[frames] = slot->queued_ns;
+                batch_lane[frames] = lane;
+                frames++;
+
+                queue_pop(q, slot);
+            }
+        }
+
+        if (frames == 0) {
+            if (atomic_load(&tx->stop))
+                break;
+
+            wait_for_frames(tx);
+            continue;
+        }
+
+        struct serial_write_stats wstats = {0};
+
+        serial_write(tx->fd, batch, len, &wstats);
+        traffic_stats_serial_out(len);
+
+        if (wstats.stalls || wstats.partial_writes || wstats.dropped_bytes) {
+            atomic_fetch_add_explicit(&tx->write_stalls, wstats.stalls,
+                                      memory_order_relaxed);
+            atomic_fetch_add_explicit(&tx->partial_writes,
+                                      wstats.partial_writes,
+                                      memory_order_relaxed);
+            atomic_fetch_add_explicit(&tx->dropped_bytes, wstats.dropped_bytes,
+                                      memory_order_relaxed);
+        }
+
+        uint64_t now = monotonic_ns();
+
+        for (int i = 0; i < frames; i++) {
+            struct serial_tx_queue *q = &tx->lanes[batch_lane[i]];
+            uint64_t latency = now - queued_ns[i];
+
+            atomic_fetch_add_explicit(&q->sent, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&q->latency_sum_ns, latency,
+                                      memory_order_relaxed);
+            if (latency > atomic_load_explicit(&q->latency_max_ns,
+                                               memory_order_relaxed))
+                atomic_store_explicit(&q->latency_max_ns, latency,
+                                      memory_order_relaxed);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the writer thread for the serial port of the calling thread's link.
+ */
+bool serial_tx_start(serial_t fd)
+{
+    struct serial_tx_writer *tx = current_writer();
+
+    tx->fd = fd;
+    tx->event = -1;
+    atomic_init(&tx->stop, false);
+    atomic_init(&tx->sleeping, false);
+    atomic_init(&tx->write_stalls, 0);
+    atomic_init(&tx->partial_writes, 0);
+    atomic_init(&tx->dropped_bytes, 0);
+
+    for (int lane = 0; lane < SERIAL_TX_LANES; lane++) {
+        if (!queue_init(&tx->lanes[lane], lane_slots[lane]))
+            goto cleanup;
+    }
+
+    if ((tx->event = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto cleanup;
+
+    if (pthread_create(&tx->tid, NULL, serial_tx_thread, tx) != 0)
+        goto cleanup;
+
+    atomic_store(&tx->running, true);
+
+    return true;
+
+cleanup:
+    if (tx->event >= 0)
+        close(tx->event);
+    tx->event = -1;
+
+    for (int lane = 0; lane < SERIAL_TX_LANES; lane++) {
+        free(tx->lanes[lane].slots);
+        tx->lanes[lane].slots = NULL;
+    }
+
+    return false;
+}
+
+/**
+ * Writes out the frames still queued and stops the writer thread.
+ */
+void serial_tx_stop(void)
+{
+    struct serial_tx_writer *tx = current_writer();
+    uint64_t one = 1;
+
+    if (!atomic_exchange(&tx->running, false))
+        return;
+
+    atomic_store(&tx->stop, true);
+    write(tx->event, &one, sizeof(one));
+    pthread_join(tx->tid, NULL);
+
+    close(tx->event);
+    tx->event = -1;
+}
+
+/**
+ * Queues a whole frame (or a run of bytes that belong to no frame) for the
+ * serial port.
+ *
+ * @return false if the lane is full and the frame was dropped.
+ */
+bool serial_tx_send(enum serial_tx_lane lane, const uint8_t *buf, size_t len)
+{
+    struct serial_tx_writer *tx = current_writer();
+    struct serial_tx_queue *q = &tx->lanes[lane];
+    uint64_t one = 1;
+
+    if (!atomic_load(&tx->running) || (len > SERIAL_TX_FRAME_MAX))
+        return false;
+
+    if (!queue_push(q, buf, len)) {
+        uint64_t dropped = atomic_fetch_add(&q->dropped, 1) + 1;
+
+        /* Report the 1st, 2nd, 4th, 8th... drop */
+        if ((dropped & (dropped - 1)) == 0)
+            status("Serial TX %s lane full, %lu frames dropped so far",
+                   serial_tx_lane_name(lane), (unsigned long) dropped);
+        return false;
+    }
+
+    /* Only wake the writer up if it went to sleep. The fence orders the
+     * slot store before the flag load, as the writer orders its flag store
+     * before its slot loads. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&tx->sleeping, false))
+        write(tx->event, &one, sizeof(one));
+
+    return true;
+}
+
+/**
+ * Returns how many more frames a lane takes right now. Other producers may
+ * fill it meanwhile, so this is exact only for a lane with one producer.
+ */
+size_t serial_tx_space(enum serial_tx_lane lane)
+{
+    struct serial_tx_writer *tx = current_writer();
+    struct serial_tx_queue *q = &tx->lanes[lane];
+    size_t depth = atomic_load_explicit(&q->tail, memory_order_relaxed) -
+                   atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (!atomic_load(&tx->running) || (depth > q->mask))
+        return 0;
+
+    return q->mask + 1 - depth;
+}
+
+/**
+ * Takes a snapshot of the per-lane counters of the calling thread's link.
+ * Safe to call from any thread.
+ */
+void serial_tx_get_stats(struct serial_tx_stats stats[SERIAL_TX_LANES])
+{
+    struct serial_tx_writer *tx = current_writer();
+
+    for (int lane = 0; lane < SERIAL_TX_LANES; lane++) {
+        struct serial_tx_queue *q = &tx->lanes[lane];
+        uint64_t sent = atomic_load_explicit(&q->sent, memory_order_relaxed);
+        uint64_t sum =
+            atomic_load_explicit(&q->latency_sum_ns, memory_order_relaxed);
+
+        stats[lane].depth =
+            atomic_load_explicit(&q->tail, memory_order_relaxed) -
+            atomic_load_explicit(&q->head, memory_order_relaxed);
+        stats[lane].sent = sent;
+        stats[lane].dropped =
+            atomic_load_explicit(&q->dropped, memory_order_relaxed);
+        stats[lane].latency_avg_us = sent ? sum / sent / 1000 : 0;
+        stats[lane].latency_max_us =
+            atomic_load_explicit(&q->latency_max_ns, memory_order_relaxed) /
+            1000;
+    }
+}
+
+/**
+ * Takes a snapshot of the write counters of the calling thread's link. Safe
+ * to call from any thread.
+ */
+void serial_tx_get_write_stats(struct serial_write_stats *stats)
+{
+    struct serial_tx_writer *tx = current_writer();
+
+    stats->stalls =
+        atomic_load_explicit(&tx->write_stalls, memory_order_relaxed);
+    stats->partial_writes =
+        atomic_load_explicit(&tx->partial_writes, memory_order_relaxed);
+    stats->dropped_bytes =
+        atomic_load_explicit(&tx->dropped_bytes, memory_order_relaxed);
+}
+
+const char *serial_tx_lane_name(enum serial_tx_lane lane)
+{
+    switch (lane) {
+    case SERIAL_TX_CONTROL:
+        return "control";
+    case SERIAL_TX_TELEMETRY:
+        return "telemetry";
+    case SERIAL_TX_BULK:
+        return "bulk";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef __SERIAL_TX_H__
+#define __SERIAL_TX_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "serial.h"
+
+/* Largest MAVLink frame (v2 with a signature) */
+#define SERIAL_TX_FRAME_MAX 280
+
+/* Everything written to the serial port goes through a single writer thread.
+ * Producers queue whole frames on one of these lanes without taking a lock,
+ * and the writer always drains a lane before looking at the next one, so a
+ * long passthrough burst never delays acks or heartbeats by more than one
+ * write. Each serial link has its own writer, the functions below act on the
+ * link of the calling thread (see serial_link.h). */
+enum serial_tx_lane {
+    SERIAL_TX_CONTROL,   /* Command acks and replies to requests */
+    SERIAL_TX_TELEMETRY, /* Periodic messages such as heartbeats */
+    SERIAL_TX_BULK,      /* Client passthrough */
+    SERIAL_TX_LANES,
+};
+
+struct serial_tx_stats {
+    size_t depth;            /* Frames waiting to be written */
+    uint64_t sent;           /* Frames written */
+    uint64_t dropped;        /* Frames refused because the lane was full */
+    uint64_t latency_avg_us; /* From queueing to the end of the write */
+    uint64_t latency_max_us;
+};
+
+bool serial_tx_start(serial_t fd);
+void serial_tx_stop(void);
+bool serial_tx_send(enum serial_tx_lane lane, const uint8_t *buf, size_t len);
+size_t serial_tx_space(enum serial_tx_lane lane);
+void serial_tx_get_stats(struct serial_tx_stats stats[SERIAL_TX_LANES]);
+void serial_tx_get_write_stats(struct serial_write_stats *stats);
+const char *serial_tx_lane_name(enum serial_tx_lane lane);
+
+#endif
@@ -0,0 +1,254 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include "telemetry_cache.h"
+
+#define KEY_USED (1ull << 40)
+#define SLOT_MASK (TELEMETRY_CACHE_SLOTS - 1)
+
+struct telemetry_slot {
+    _Atomic uint64_t key; /* KEY_USED, msgid, sysid and compid, 0 if free */
+    atomic_uint seq;      /* Odd while the entry is being written */
+    uint64_t time_ns;
+    uint8_t len;
+    uint8_t payload[MAVLINK_MAX_PAYLOAD_LEN];
+};
+
+/* A copy of an entry, taken under its seqlock */
+struct telemetry_entry {
+    uint64_t time_ns;
+    uint8_t len;
+    uint8_t payload[MAVLINK_MAX_PAYLOAD_LEN];
+};
+
+static struct telemetry_slot g_slots[TELEMETRY_CACHE_SLOTS];
+
+static _Atomic uint32_t g_tracked[TELEMETRY_CACHE_MSGIDS];
+static atomic_size_t g_tracked_count;
+static pthread_mutex_t g_track_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t make_key(uint32_t msgid, uint8_t sysid, uint8_t compid)
+{
+    return KEY_USED | (uint64_t) msgid << 16 | (uint64_t) sysid << 8 | compid;
+}
+
+static size_t key_hash(uint64_t key)
+{
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & SLOT_MASK;
+}
+
+/**
+ * Finds the entry of a sender's message, claiming a free slot for it if
+ * `create` is set. Entries are never removed.
+ */
+static struct telemetry_slot *find_slot(uint64_t key, bool create)
+{
+    size_t idx = key_hash(key);
+
+    for (size_t i = 0; i < TELEMETRY_CACHE_SLOTS; i++) {
+        struct telemetry_slot *slot = &g_slots[(idx + i) & SLOT_MASK];
+        uint64_t cur = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+        if (cur == key)
+            return slot;
+
+        if (cur)
+            continue;
+
+        if (!create)
+            return NULL;
+
+        /* Another link may claim it first, for this key or another one */
+        if (atomic_compare_exchange_strong(&slot->key, &cur, key) ||
+            (cur == key))
+            return slot;
+    }
+
+    return NULL;
+}
+
+static bool is_tracked(uint32_t msgid)
+{
+    size_t count =
+        atomic_load_explicit(&g_tracked_count, memory_order_acquire);
+
+    for (size_t i = 0; i < count; i++) {
+        if (atomic_load_explicit(&g_tracked[i], memory_order_relaxed) == msgid)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Starts caching a message. Frames received before are not in the cache.
+ *
+ * @return false if too many messages are tracked already.
+ */
+bool telemetry_cache_track(uint32_t msgid)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&g_track_mtx);
+
+    size_t count = atomic_load(&g_tracked_count);
+
+    if (is_tracked(msgid)) {
+        /* Nothing to do */
+    } else if (count == TELEMETRY_CACHE_MSGIDS) {
+        ok = false;
+    } else {
+        atomic_store_explicit(&g_tracked[count], msgid, memory_order_relaxed);
+        atomic_store_explicit(&g_tracked_count, count + 1,
+                              memory_order_release);
+    }
+
+    pthread_mutex_unlock(&g_track_mtx);
+
+    return ok;
+}
+
+/**
+ * Stores a frame received with a good CRC, if its message is tracked.
+ */
+void telemetry_cache_update(const struct mavlink_frame_view *frame)
+{
+    if (!is_tracked(frame->msgid))
+        return;
+
+    struct telemetry_slot *slot = find_slot(
+        make_key(frame->msgid, frame->sysid, frame->compid), true);
+
+    if (!slot)
+        return;
+
+    /* Links write the same entry if they hear the same sender, the odd
+     * sequence number is also the lock of the writers */
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    do {
+        while (seq & 1)
+            seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(
+        &slot->seq, &seq, seq + 1, memory_order_acquire, memory_order_relaxed));
+    atomic_thread_fence(memory_order_release);
+
+    slot->time_ns = monotonic_ns();
+    slot->len = frame->payload_len;
+    memcpy(slot->payload, frame->payload, frame->payload_len);
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Copies an entry, retrying until no writer changed it in the meantime.
+ *
+ * @return false if the slot was claimed but not written yet.
+ */
+static bool read_slot(struct telemetry_slot *slot,
+                      struct telemetry_entry *entry)
+{
+    for (;;) {
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq == 0)
+            return false;
+        if (seq & 1)
+            continue;
+
+        entry->time_ns = slot->time_ns;
+        entry->len = slot->len;
+        memcpy(entry->payload, slot->payload, entry->len);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+            return true;
+    }
+}
+
+static void entry_to_msg(const struct telemetry_entry *entry,
+                         uint64_t key,
+                         mavlink_message_t *msg)
+{
+    char *payload = _MAV_PAYLOAD_NON_CONST(msg);
+
+    memset(msg, 0, sizeof(*msg));
+    msg->magic = MAVLINK_STX;
+    msg->len = entry->len;
+    msg->msgid = (key >> 16) & 0xffffff;
+    msg->sysid = (key >> 8) & 0xff;
+    msg->compid = key & 0xff;
+
+    memcpy(payload, entry->payload, entry->len);
+}
+
+/**
+ * Gets the latest payload of a message from a sender, to be decoded with
+ * the mavlink_msg_*_decode() functions, and when it was received
+ * (CLOCK_MONOTONIC). `time_ns` may be NULL.
+ *
+ * @return false if the message is not tracked or was not received yet.
+ */
+bool telemetry_cache_get(uint32_t msgid,
+                         uint8_t sysid,
+                         uint8_t compid,
+                         mavlink_message_t *msg,
+                         uint64_t *time_ns)
+{
+    uint64_t key = make_key(msgid, sysid, compid);
+    struct telemetry_slot *slot = find_slot(key, false);
+    struct telemetry_entry entry;
+
+    if (!slot || !read_slot(slot, &entry))
+        return false;
+
+    entry_to_msg(&entry, key, msg);
+    if (time_ns)
+        *time_ns = entry.time_ns;
+
+    return true;
+}
+
+/**
+ * Like telemetry_cache_get(), for the sender of the message heard last.
+ */
+bool telemetry_cache_get_latest(uint32_t msgid,
+                                mavlink_message_t *msg,
+                                uint64_t *time_ns)
+{
+    struct telemetry_entry entry, latest = {0};
+    uint64_t latest_key = 0;
+
+    for (size_t i = 0; i < TELEMETRY_CACHE_SLOTS; i++) {
+        uint64_t key =
+            atomic_load_explicit(&g_slots[i].key, memory_order_acquire);
+
+        if (!key || (((key >> 16) & 0xffffff) != msgid) ||
+            !read_slot(&g_slots[i], &entry))
+            continue;
+
+        if (!latest_key || (entry.time_ns > latest.time_ns)) {
+            latest = entry;
+            latest_key = key;
+        }
+    }
+
+    if (!latest_key)
+        return false;
+
+    entry_to_msg(&latest, latest_key, msg);
+    if (time_ns)
+        *time_ns = latest.time_ns;
+
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef __TELEMETRY_CACHE_H__
+#define __TELEMETRY_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mavlink.h"
+#include "mavlink_scan.h"
+
+/* Messages tracked, and the senders of them the cache holds at most */
+#define TELEMETRY_CACHE_MSGIDS 32
+#define TELEMETRY_CACHE_SLOTS 512
+
+/* The latest payload of every tracked message from every sender, with the
+ * time it was received, so any thread can read the current state of the
+ * vehicle. The threads of the links store the frames as they parse them,
+ * each entry behind a seqlock: readers never take a lock nor block a link,
+ * they just retry if the entry changed while they were copying it. */
+bool telemetry_cache_track(uint32_t msgid);
+void telemetry_cache_update(const struct mavlink_frame_view *frame);
+bool telemetry_cache_get(uint32_t msgid,
+                         uint8_t sysid,
+                         uint8_t compid,
+                         mavlink_message_t *msg,
+                         uint64_t *time_ns);
+bool telemetry_cache_get_latest(uint32_t msgid,
+                                mavlink_message_t *msg,
+                                uint64_t *time_ns);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bcast_ring.h"
+
+/* Frames of 100 bytes in a ring of 4096, a reader is congested once more
+ * than 20 of them are waiting for it */
+#define RING_SIZE 4096
+#define FRAME_LEN 100
+
+#define ENDPOINT_A 1
+#define ENDPOINT_B 2
+
+static struct bcast_ring g_ring;
+static int g_failures;
+
+/* Each frame is filled with its tag, so a reader can tell which it got */
+static void write_frame(uint32_t msgid, uint8_t tag, int dest)
+{
+    uint8_t frame[FRAME_LEN];
+
+    memset(frame, tag, sizeof(frame));
+    bcast_ring_write(&g_ring, frame, sizeof(frame), msgid, 1, 1, 0, dest);
+}
+
+/**
+ * Sends a reader everything it is due, the tags of the frames being stored
+ * in `tags`.
+ *
+ * @return The number of frames sent.
+ */
+static int drain(struct bcast_reader *reader, uint8_t *tags, int max)
+{
+    struct bcast_batch batch;
+    uint64_t offset;
+    int count = 0;
+
+    for (;;) {
+        bcast_reader_peek(&g_ring, reader, &batch);
+        if (batch.count == 0) {
+            reader->cursor = batch.next;
+            break;
+        }
+
+        for (int i = 0; (i < batch.count) && (count < max); i++)
+            bcast_ring_copy(&g_ring, batch.frame[i].offset, &tags[count++], 1);
+
+        bcast_reader_consume(reader, &batch, batch.bytes, &offset);
+    }
+
+    return count;
+}
+
+static bool got(const uint8_t *tags, int count, uint8_t tag)
+{
+    for (int i = 0; i < count; i++) {
+        if (tags[i] == tag)
+            return true;
+    }
+
+    return false;
+}
+
+static void check(bool ok, const char *what)
+{
+    printf("%-64s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        g_failures++;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+/* A congested reader coalesces a message to its latest frame for every
+ * endpoint, a newer frame for another endpoint must not hide it */
+static void check_shed(void)
+{
+    static const struct bcast_shed shed = {0};
+    struct bcast_reader reader;
+    uint8_t tags[64];
+
+    bcast_ring_init(&g_ring, RING_SIZE);
+    bcast_reader_attach(&g_ring, &reader, NULL, NULL, &shed, ENDPOINT_A);
+
+    for (int i = 0; i < 25; i++)
+        write_frame(30, i, BCAST_DEST_ALL);
+    write_frame(33, 100, BCAST_DEST_ALL);
+    write_frame(33, 101, ENDPOINT_A);
+    write_frame(33, 102, ENDPOINT_B);
+
+    int count = drain(&reader, tags, 64);
+
+    check(!got(tags, count, 0) && got(tags, count, 24),
+          "shed: older frames of every endpoint are coalesced");
+    check(got(tags, count, 100),
+          "shed: frame for every endpoint kept after one for another");
+    check(got(tags, count, 101), "shed: frame for the reader alone kept");
+    check(!got(tags, count, 102), "shed: frame for another endpoint skipped");
+
+    bcast_reader_detach(&g_ring, &reader);
+    bcast_ring_free(&g_ring);
+}
+
+/* A capped message held back until its interval is over is sent then,
+ * a newer frame for another endpoint must not drop it */
+static void check_rates(void)
+{
+    static const struct bcast_rates rates = {1, {31}, {50000000}};
+    struct bcast_reader reader;
+    uint8_t tags[64];
+    int count;
+
+    bcast_ring_init(&g_ring, RING_SIZE);
+    bcast_reader_attach(&g_ring, &reader, NULL, &rates, NULL, ENDPOINT_A);
+
+    write_frame(31, 1, BCAST_DEST_ALL);
+    count = drain(&reader, tags, 64);
+    check((count == 1) && (tags[0] == 1), "rates: first frame sent at once");
+
+    write_frame(31, 2, BCAST_DEST_ALL);
+    write_frame(31, 3, BCAST_DEST_ALL);
+    write_frame(31, 4, ENDPOINT_A);
+    write_frame(31, 5, ENDPOINT_B);
+    count = drain(&reader, tags, 64);
+    check((count == 1) && (tags[0] == 4),
+          "rates: early frames held back, frame for the reader alone sent");
+
+    sleep_ms(60);
+    count = drain(&reader, tags, 64);
+    check((count == 1) && (tags[0] == 3),
+          "rates: latest held frame sent once the interval is over");
+
+    sleep_ms(60);
+    count = drain(&reader, tags, 64);
+    check(count == 0, "rates: nothing sent twice");
+
+    bcast_reader_detach(&g_ring, &reader);
+    bcast_ring_free(&g_ring);
+}
+
+/**
+ * Checks how the broadcast ring coalesces and caps the messages of readers
+ * routed frames for every endpoint and for single endpoints.
+ */
+int main(void)
+{
+    check_shed();
+    check_rates();
+
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,515 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "serial_link.h"
+#include "traffic_stats.h"
+#include "util.h"
+
+/* Busiest messages and clients listed per link in a report */
+#define TRAFFIC_REPORT_MSGIDS 8
+#define TRAFFIC_REPORT_CLIENTS 16
+
+/* Bits on the line per byte with 8N1, start and stop bits included */
+#define LINE_BITS_PER_BYTE 10
+
+/* Written by a single thread, see `counter_add()` */
+typedef atomic_uint_least64_t counter_t;
+
+struct msg_counter {
+    atomic_uint_least32_t key; /* msgid + 1, 0 while the slot is free */
+    counter_t frames;
+    counter_t bytes;
+};
+
+struct source_counter {
+    atomic_uint_least32_t key; /* (sysid << 8 | compid) + 1 */
+    uint8_t seq;               /* Newest sequence number */
+    counter_t frames;
+    counter_t lost;
+};
+
+struct client_counter {
+    atomic_int id;
+    counter_t bytes_sent;
+    counter_t dropped;
+};
+
+struct traffic_link {
+    atomic_uint_least64_t start_ns; /* Published once the link is set up */
+    unsigned baudrate;
+
+    counter_t bytes_in;
+    counter_t bytes_out; /* Written by the serial writer thread */
+    counter_t frame_bytes;
+    counter_t frames;
+    counter_t crc_errors;
+    counter_t lost;
+    counter_t other_msgids;
+    counter_t client_bytes_sent;
+    counter_t client_dropped;
+
+    /* Open addressing, slots are taken for good */
+    struct msg_counter msgs[TRAFFIC_STATS_MSGIDS];
+    struct source_counter sources[TRAFFIC_STATS_SOURCES];
+
+    /* Indexed by the slot of the client in the link's client table */
+    struct client_counter *_Atomic clients;
+    int client_count;
+};
+
+static struct traffic_link g_traffic[SERIAL_LINK_MAX];
+
+static struct traffic_link *current_link(void)
+{
+    return &g_traffic[serial_link_id()];
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Only the owning thread writes a counter, so a plain load and store is
+ * enough and no locked instruction is needed. The atomics only keep the
+ * readers from seeing a torn value. */
+static inline void counter_add(counter_t *counter, uint64_t n)
+{
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(counter_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * Sets up the counters of the link of the calling thread, with room for the
+ * clients of its client table.
+ */
+bool traffic_stats_link_start(unsigned baudrate, int max_clients)
+{
+    struct traffic_link *tl = current_link();
+    struct client_counter *clients =
+        calloc(max_clients, sizeof(struct client_counter));
+
+    if (!clients)
+        return false;
+
+    for (int i = 0; i < max_clients; i++)
+        atomic_init(&clients[i].id, -1);
+
+    tl->baudrate = baudrate;
+    tl->client_count = max_clients;
+    atomic_store_explicit(&tl->clients, clients, memory_order_release);
+    atomic_store_explicit(&tl->start_ns, monotonic_ns(), memory_order_release);
+
+    return true;
+}
+
+void traffic_stats_serial_in(size_t bytes)
+{
+    counter_add(&current_link()->bytes_in, bytes);
+}
+
+void traffic_stats_serial_out(size_t bytes)
+{
+    counter_add(&current_link()->bytes_out, bytes);
+}
+
+/**
+ * Counts the bytes of a frame as read from a port, before duplicates are
+ * told apart. What was read outside of frames is line noise or frames cut
+ * short.
+ */
+void traffic_stats_frame_read(const struct mavlink_frame_view *frame)
+{
+    counter_add(&current_link()->frame_bytes, frame->len);
+}
+
+void traffic_stats_crc_error(void)
+{
+    counter_add(&current_link()->crc_errors, 1);
+}
+
+static struct msg_counter *find_msg(struct traffic_link *tl, uint32_t msgid)
+{
+    uint32_t key = msgid + 1;
+
+    for (unsigned i = 0; i < TRAFFIC_STATS_MSGIDS; i++) {
+        struct msg_counter *msg =
+            &tl->msgs[(msgid + i) % TRAFFIC_STATS_MSGIDS];
+        uint32_t slot_key =
+            atomic_load_explicit(&msg->key, memory_order_relaxed);
+
+        if (slot_key == key)
+            return msg;
+
+        if (slot_key == 0) {
+            atomic_store_explicit(&msg->key, key, memory_order_release);
+            return msg;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Follows the sequence number of a component. A number that goes back is a
+ * frame that came late and fills a gap counted earlier.
+ */
+static void track_seq(struct traffic_link *tl,
+                      uint8_t sysid,
+                      uint8_t compid,
+                      uint8_t seq)
+{
+    uint32_t key = (uint32_t) (sysid << 8 | compid) + 1;
+
+    for (unsigned i = 0; i < TRAFFIC_STATS_SOURCES; i++) {
+        struct source_counter *src =
+            &tl->sources[(sysid * 31u + compid + i) % TRAFFIC_STATS_SOURCES];
+        uint32_t slot_key =
+            atomic_load_explicit(&src->key, memory_order_relaxed);
+
+        if (slot_key == 0) {
+            src->seq = seq;
+            counter_add(&src->frames, 1);
+            atomic_store_explicit(&src->key, key, memory_order_release);
+            return;
+        }
+
+        if (slot_key != key)
+            continue;
+
+        uint8_t delta = (uint8_t) (seq - src->seq);
+
+        counter_add(&src->frames, 1);
+
+        if ((delta > 0) && (delta < 128)) {
+            counter_add(&src->lost, delta - 1);
+            counter_add(&tl->lost, delta - 1);
+            src->seq = seq;
+        } else if ((delta >= 128) && counter_get(&src->lost)) {
+            counter_add(&src->lost, (uint64_t) -1);
+            counter_add(&tl->lost, (uint64_t) -1);
+        }
+        return;
+    }
+}
+
+/**
+ * Counts a frame handled on the link, the copies dropped from a redundant
+ * port aside.
+ */
+void traffic_stats_frame(const struct mavlink_frame_view *frame)
+{
+    struct traffic_link *tl = current_link();
+    struct msg_counter *counter = find_msg(tl, frame->msgid);
+
+    counter_add(&tl->frames, 1);
+
+    if (counter) {
+        counter_add(&counter->frames, 1);
+        counter_add(&counter->bytes, frame->len);
+    } else {
+        counter_add(&tl->other_msgids, 1);
+    }
+
+    track_seq(tl, frame->sysid, frame->compid, frame->seq);
+}
+
+static struct client_counter *client_counter(int slot)
+{
+    struct traffic_link *tl = current_link();
+    struct client_counter *clients =
+        atomic_load_explicit(&tl->clients, memory_order_relaxed);
+
+    if (!clients || (slot < 0) || (slot >= tl->client_count))
+        return NULL;
+
+    return &clients[slot];
+}
+
+void traffic_stats_client_open(int slot, int id)
+{
+    struct client_counter *client = client_counter(slot);
+
+    if (!client)
+        return;
+
+    atomic_store_explicit(&client->bytes_sent, 0, memory_order_relaxed);
+    atomic_store_explicit(&client->dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&client->id, id, memory_order_release);
+}
+
+void traffic_stats_client_close(int slot)
+{
+    struct client_counter *client = client_counter(slot);
+
+    if (client)
+        atomic_store_explicit(&client->id, -1, memory_order_release);
+}
+
+void traffic_stats_client_sent(int slot, size_t bytes)
+{
+    struct client_counter *client = client_counter(slot);
+
+    if (client)
+        counter_add(&client->bytes_sent, bytes);
+    counter_add(&current_link()->client_bytes_sent, bytes);
+}
+
+/**
+ * Counts what a client lost as it lagged: frames, or bytes for raw clients.
+ */
+void traffic_stats_client_dropped(int slot, size_t count)
+{
+    struct client_counter *client = client_counter(slot);
+
+    if (client)
+        counter_add(&client->dropped, count);
+    counter_add(&current_link()->client_dropped, count);
+}
+
+/**
+ * Takes a snapshot of the counters of a link, from any thread. Each counter
+ * is read on its own, so counters updated meanwhile may be a frame apart.
+ *
+ * @return false if the link was never started.
+ */
+bool traffic_stats_snapshot(int link, struct traffic_stats *snap)
+{
+    if ((link < 0) || (link >= SERIAL_LINK_MAX))
+        return false;
+
+    struct traffic_link *tl = &g_traffic[link];
+
+    snap->start_ns = atomic_load_explicit(&tl->start_ns, memory_order_acquire);
+    snap->time_ns = monotonic_ns();
+
+    if (snap->start_ns == 0)
+        return false;
+
+    snap->baudrate = tl->baudrate;
+    snap->bytes_in = counter_get(&tl->bytes_in);
+    snap->bytes_out = counter_get(&tl->bytes_out);
+    snap->frame_bytes = counter_get(&tl->frame_bytes);
+    snap->frames = counter_get(&tl->frames);
+    snap->crc_errors = counter_get(&tl->crc_errors);
+    snap->lost = counter_get(&tl->lost);
+    snap->other_msgids = counter_get(&tl->other_msgids);
+    snap->client_bytes_sent = counter_get(&tl->client_bytes_sent);
+    snap->client_dropped = counter_get(&tl->client_dropped);
+
+    snap->msg_count = 0;
+    for (int i = 0; i < TRAFFIC_STATS_MSGIDS; i++) {
+        struct msg_counter *msg = &tl->msgs[i];
+        uint32_t key = atomic_load_explicit(&msg->key, memory_order_acquire);
+
+        if (key == 0)
+            continue;
+
+        snap->msgs[snap->msg_count++] = (struct traffic_msg_stats){
+            key - 1, counter_get(&msg->frames), counter_get(&msg->bytes)};
+    }
+
+    snap->source_count = 0;
+    for (int i = 0; i < TRAFFIC_STATS_SOURCES; i++) {
+        struct source_counter *src = &tl->sources[i];
+        uint32_t key = atomic_load_explicit(&src->key, memory_order_acquire);
+
+        if (key == 0)
+            continue;
+
+        snap->sources[snap->source_count++] = (struct traffic_source_stats){
+            (uint8_t) ((key - 1) >> 8), (uint8_t) (key - 1),
+            counter_get(&src->frames), counter_get(&src->lost)};
+    }
+
+    return true;
+}
+
+/**
+ * Gets the counters of up to `max` clients connected to a link, from any
+ * thread.
+ *
+ * @return The number of clients copied.
+ */
+size_t traffic_stats_clients(int link,
+                             struct traffic_client_stats *clients,
+                             size_t max)
+{
+    if ((link < 0) || (link >= SERIAL_LINK_MAX))
+        return 0;
+
+    struct traffic_link *tl = &g_traffic[link];
+
+    /* The table is published along with `start_ns` */
+    if (!atomic_load_explicit(&tl->start_ns, memory_order_acquire))
+        return 0;
+
+    struct client_counter *table =
+        atomic_load_explicit(&tl->clients, memory_order_relaxed);
+    size_t count = 0;
+
+    for (int i = 0; (i < tl->client_count) && (count < max); i++) {
+        int id = atomic_load_explicit(&table[i].id, memory_order_acquire);
+
+        if (id < 0)
+            continue;
+
+        clients[count++] = (struct traffic_client_stats){
+            id, counter_get(&table[i].bytes_sent),
+            counter_get(&table[i].dropped)};
+    }
+
+    return count;
+}
+
+static const struct traffic_msg_stats *find_prev_msg(
+    const struct traffic_stats *prev,
+    uint32_t msgid)
+{
+    for (size_t i = 0; prev && (i < prev->msg_count); i++) {
+        if (prev->msgs[i].msgid == msgid)
+            return &prev->msgs[i];
+    }
+
+    return NULL;
+}
+
+static const struct traffic_source_stats *find_prev_source(
+    const struct traffic_stats *prev,
+    const struct traffic_source_stats *src)
+{
+    for (size_t i = 0; prev && (i < prev->source_count); i++) {
+        if ((prev->sources[i].sysid == src->sysid) &&
+            (prev->sources[i].compid == src->compid))
+            return &prev->sources[i];
+    }
+
+    return NULL;
+}
+
+/* Share of the line taken by `bytes_per_sec`, in percent */
+static double line_share(const struct traffic_stats *cur, double bytes_per_sec)
+{
+    if (cur->baudrate == 0)
+        return 0;
+
+    return bytes_per_sec * LINE_BITS_PER_BYTE * 100 / cur->baudrate;
+}
+
+/**
+ * Prints the traffic of a link between two snapshots, or since the link
+ * started if `prev` is NULL: the bandwidth in both directions, the messages
+ * taking most of it, the components that lost frames and the clients.
+ */
+void traffic_stats_print(int link,
+                         const struct traffic_stats *prev,
+                         const struct traffic_stats *cur)
+{
+    static const struct traffic_stats zero;
+    uint64_t since = prev ? prev->time_ns : cur->start_ns;
+    double secs = (double) (cur->time_ns - since) / 1e9;
+
+    if (!prev)
+        prev = &zero;
+
+    if (secs <= 0)
+        return;
+
+    double in_rate = (double) (cur->bytes_in - prev->bytes_in) / secs;
+    double out_rate = (double) (cur->bytes_out - prev->bytes_out) / secs;
+    uint64_t bytes_in = cur->bytes_in - prev->bytes_in;
+    uint64_t frame_bytes = cur->frame_bytes - prev->frame_bytes;
+
+    status(
+        "Link %d traffic over %.1f s: in %.0f B/s (%.1f%% of %u bps), out "
+        "%.0f B/s (%.1f%%), %.1f frames/s, %lu bytes outside of frames, %lu "
+        "CRC errors, %ld frames lost",
+        link, secs, in_rate, line_share(cur, in_rate), cur->baudrate, out_rate,
+        line_share(cur, out_rate),
+        (double) (cur->frames - prev->frames) / secs,
+        (unsigned long) (bytes_in > frame_bytes ? bytes_in - frame_bytes : 0),
+        (unsigned long) (cur->crc_errors - prev->crc_errors),
+        (long) (cur->lost - prev->lost));
+
+    /* The busiest messages first */
+    struct traffic_msg_stats top[TRAFFIC_REPORT_MSGIDS];
+    size_t top_count = 0;
+
+    for (size_t i = 0; i < cur->msg_count; i++) {
+        const struct traffic_msg_stats *msg = &cur->msgs[i];
+        const struct traffic_msg_stats *old = find_prev_msg(prev, msg->msgid);
+        struct traffic_msg_stats delta = {
+            msg->msgid, msg->frames - (old ? old->frames : 0),
+            msg->bytes - (old ? old->bytes : 0)};
+        size_t pos = top_count;
+
+        if (delta.frames == 0)
+            continue;
+
+        while ((pos > 0) && (top[pos - 1].bytes < delta.bytes))
+            pos--;
+
+        if (pos == TRAFFIC_REPORT_MSGIDS)
+            continue;
+
+        if (top_count < TRAFFIC_REPORT_MSGIDS)
+            top_count++;
+        memmove(&top[pos + 1], &top[pos],
+                (top_count - pos - 1) * sizeof(top[0]));
+        top[pos] = delta;
+    }
+
+    for (size_t i = 0; i < top_count; i++) {
+        double rate = (double) top[i].bytes / secs;
+
+        status("  msgid %u: %.1f msg/s, %.0f B/s (%.1f%% of the line)",
+               top[i].msgid, (double) top[i].frames / secs, rate,
+               line_share(cur, rate));
+    }
+
+    for (size_t i = 0; i < cur->source_count; i++) {
+        const struct traffic_source_stats *src = &cur->sources[i];
+        const struct traffic_source_stats *old = find_prev_source(prev, src);
+        uint64_t frames = src->frames - (old ? old->frames : 0);
+        int64_t lost = (int64_t) (src->lost - (old ? old->lost : 0));
+
+        if (lost > 0)
+            status("  sysid %u compid %u: %ld of %lu frames lost", src->sysid,
+                   src->compid, (long) lost,
+                   (unsigned long) (frames + (uint64_t) lost));
+    }
+
+    status("  clients: %.0f B/s sent, %lu dropped",
+           (double) (cur->client_bytes_sent - prev->client_bytes_sent) / secs,
+           (unsigned long) (cur->client_dropped - prev->client_dropped));
+
+    struct traffic_client_stats clients[TRAFFIC_REPORT_CLIENTS];
+    size_t count = traffic_stats_clients(link, clients, ARRAY_SIZE(clients));
+
+    for (size_t i = 0; i < count; i++) {
+        status("  client %d: %lu bytes sent, %lu dropped", clients[i].id,
+               (unsigned long) clients[i].bytes_sent,
+               (unsigned long) clients[i].dropped);
+    }
+}
+
+/**
+ * Frees the client tables once every link has stopped.
+ */
+void traffic_stats_free(void)
+{
+    for (int i = 0; i < SERIAL_LINK_MAX; i++) {
+        atomic_store(&g_traffic[i].start_ns, 0);
+        free(atomic_exchange(&g_traffic[i].clients, NULL));
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef __TRAFFIC_STATS_H__
+#define __TRAFFIC_STATS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavlink_scan.h"
+
+/* Message IDs counted apart per link, the others only in the link totals */
+#define TRAFFIC_STATS_MSGIDS 256
+
+/* Components whose sequence numbers are followed per link */
+#define TRAFFIC_STATS_SOURCES 32
+
+struct traffic_msg_stats {
+    uint32_t msgid;
+    uint64_t frames;
+    uint64_t bytes; /* Whole frames, header and CRC included */
+};
+
+struct traffic_source_stats {
+    uint8_t sysid;
+    uint8_t compid;
+    uint64_t frames;
+    uint64_t lost; /* Frames missing from the sequence */
+};
+
+struct traffic_client_stats {
+    int id;              /* ID of the client holding the slot, -1 if none */
+    uint64_t bytes_sent; /* Since the client connected */
+    uint64_t dropped;    /* Frames, bytes for raw clients */
+};
+
+/* Counters of a serial link. Rates are the difference between two snapshots
+ * over the time between them. Every counter only ever grows but `lost`,
+ * which gives back the frames that come late. */
+struct traffic_stats {
+    uint64_t time_ns;  /* When the snapshot was taken */
+    uint64_t start_ns; /* When the link started, 0 if it never did */
+    unsigned baudrate;
+
+    uint64_t bytes_in;    /* Read from the serial ports of the link */
+    uint64_t bytes_out;   /* Handed to the serial port */
+    uint64_t frame_bytes; /* Read as MAVLink frames, duplicates included */
+    uint64_t frames;      /* Frames handled, duplicates excluded */
+    uint64_t crc_errors;  /* Frames of known messages with a bad CRC */
+    uint64_t lost;        /* Sequence gaps of every component */
+    uint64_t other_msgids; /* Frames of the messages not counted apart */
+
+    uint64_t client_bytes_sent;
+    uint64_t client_dropped;
+
+    size_t msg_count;
+    struct traffic_msg_stats msgs[TRAFFIC_STATS_MSGIDS];
+    size_t source_count;
+    struct traffic_source_stats sources[TRAFFIC_STATS_SOURCES];
+};
+
+/* Always-on counters of the traffic of every serial link. Each counter is
+ * written by a single thread, the link's server thread or its serial writer,
+ * so updating one is a plain load and store. Readers on any thread take
+ * snapshots without a lock. The functions below that update counters act on
+ * the link of the calling thread (see serial_link.h). */
+bool traffic_stats_link_start(unsigned baudrate, int max_clients);
+void traffic_stats_serial_in(size_t bytes);
+void traffic_stats_serial_out(size_t bytes);
+void traffic_stats_frame_read(const struct mavlink_frame_view *frame);
+void traffic_stats_frame(const struct mavlink_frame_view *frame);
+void traffic_stats_crc_error(void);
+void traffic_stats_client_open(int slot, int id);
+void traffic_stats_client_close(int slot);
+void traffic_stats_client_sent(int slot, size_t bytes);
+void traffic_stats_client_dropped(int slot, size_t count);
+
+bool traffic_stats_snapshot(int link, struct traffic_stats *snap);
+size_t traffic_stats_clients(int link,
+                             struct traffic_client_stats *clients,
+                             size_t max);
+void traffic_stats_print(int link,
+                         const struct traffic_stats *prev,
+                         const struct traffic_stats *cur);
+void traffic_stats_free(void);
+
+#endif
@@ -2,17 +2,19 @@
  *  A simple program that serves a serial port over TCP to multiple clients.
  */
 
+#define _GNU_SOURCE
 #include "uart_server.h"
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,30 +24,58 @@
 #include <sys/param.h>
 #endif /* (defined(__unix__) || defined(unix)) && !defined(USG) */
 
+#ifdef CONFIG_IO_URING
+#include <liburing.h>
+#else
+#include <sys/epoll.h>
+#endif
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "bcast_ring.h"
 #include "config.h"
+#include "fcu_sim.h"
 #include "mavlink.h"
+#include "mavlink_command.h"
+#include "mavlink_dispatch.h"
 #include "mavlink_publisher.h"
 #include "mavlink_receiver.h"
+#include "mavlink_router.h"
+#include "mavlink_worker.h"
 #include "rtsp_stream.h"
 #include "serial.h"
+#include "serial_link.h"
+#include "serial_tx.h"
 #include "system.h"
+#include "traffic_stats.h"
+#include "uplink.h"
 
 #define closesocket close
 #define INVALID_SOCKET (-1)
 
 typedef int Socket;
 typedef uint32_t socklen_t;
-typedef struct pollfd Waiter;
 
 #define DEFAULT_PORT 8278
 #define SERIAL_TIMEOUT 1000
 
+/* How long the latency probe waits for each reply */
+#define SERIAL_PROBE_TIMEOUT 500000 /* us */
+
+/* Bytes of a probe on the wire: the request, its ack and the reply */
+#define SERIAL_PROBE_BYTES                                                  \
+    (MAVLINK_MSG_ID_COMMAND_LONG_LEN + MAVLINK_MSG_ID_COMMAND_ACK_LEN +     \
+     MAVLINK_MSG_ID_AUTOPILOT_VERSION_LEN + 3 * MAVLINK_NUM_NON_PAYLOAD_BYTES)
+
+/* Round trip delay beyond the wire time worth a hint at the low latency
+ * settings, well under the 16 ms that FTDI adapters default to */
+#define SERIAL_PROBE_SLACK 4000 /* us */
+
 #define SERIAL_CFG_BAUDRATE_IDX 0
 #define SERIAL_CFG_PARITY_IDX 1
 #define SERIAL_CFG_DATA_BITS_IDX 2
@@ -56,12 +86,13 @@ typedef struct pollfd Waiter;
 #define SERIAL_CFG_DEFAULT_DATA_BITS 8
 #define SERIAL_CFG_DEFAULT_STOP_BITS e_stop_bits_one
 
-#define EVENT_CLOSE_INDEX 0
-#define EVENT_SERIAL_INDEX 1
-#define EVENT_SERVER_INDEX 2
-#define EVENT_CLIENT_INDEX 3
-#define EVENT_USER_CMD_INDEX 4
-#define EVENT_INDEX_COUNT_MAX 5
+/* Maximum number of ready events handled per epoll_wait() wakeup */
+#define EVENT_BATCH_MAX 64
+
+#ifndef CONFIG_IO_URING
+/* Events that tell us a client has gone away */
+#define EVENT_HANGUP (EPOLLHUP | EPOLLERR | EPOLLRDHUP)
+#endif
 
 /**
  * Simple utility macro to get the biggest of two integers.
@@ -71,23 +102,101 @@ typedef struct pollfd Waiter;
 /**
  * Helper type definitions to make the code a bit clearer.
  */
-typedef uint32_t Ipv4Addr;
 typedef uint16_t InetPort;
 
+/* A client ID is its slot in the client table tagged with the number of
+ * times the slot has been reused, so stale IDs never match a new client */
+#define CLIENT_SLOT_BITS 16
+#define CLIENT_SLOT_MASK ((1 << CLIENT_SLOT_BITS) - 1)
+#define CLIENT_GEN_MASK 0x7fff
+
+/* Printable address, IPv6 ones in brackets */
+#define CLIENT_ADDR_LEN (INET6_ADDRSTRLEN + 2)
+
+/* Datagrams read from a UDP endpoint per recvmmsg() */
+#define UDP_RECV_BATCH 16
+#define UDP_DATAGRAM_MAX 2048
+
+/**
+ * Every file descriptor registered with epoll carries a pointer to one of
+ * these, so the main loop can tell what woke it up without a lookup.
+ */
+enum EventType {
+    EVENT_CLOSE,     /* Shut down pipe */
+    EVENT_SERIAL,    /* Serial port */
+    EVENT_REDUNDANT, /* Redundant serial port to the same FCU */
+    EVENT_SERVER,    /* TCP listen socket, see `struct Listener` */
+    EVENT_USER_CMD,  /* Command FIFO */
+    EVENT_CLIENT,    /* Connected client */
+    EVENT_ROUTE,     /* Frames generated by the server for the clients */
+    EVENT_RATE,      /* Frames held back by the rate caps of a client due */
+};
+
+struct EventSource {
+    enum EventType type;
+};
+
+/**
+ * A TCP listen socket. Clients accepted on a raw listener are sent the serial
+ * byte stream through a pipe with splice()/tee() instead of the ring, clients
+ * of an endpoint listener only the frames matching its filter.
+ */
+struct Listener {
+    struct EventSource source; /* Must be first, see `struct EventSource` */
+    Socket fd;
+    bool raw;
+    const struct bcast_filter *filter; /* NULL for every frame */
+    int uplink_weight;                 /* See `struct uplink_source` */
+    const struct bcast_rates *rates;   /* Rate caps of its clients */
+};
+
 /**
  * A structure that holds connected client information.
  */
 struct ClientNode {
-    int id;        /* Used for quickly identifying a client */
-    Ipv4Addr addr; /* Client address for info pretty printing */
-    InetPort port; /* Client port for info pretty printing */
+    struct EventSource source; /* Must be first, see `struct EventSource` */
+    int id;                    /* Used for quickly identifying a client */
+    unsigned generation;       /* Times the slot has been reused */
+    char addr[CLIENT_ADDR_LEN]; /* Client address for info pretty printing */
+    InetPort port;              /* Client port for info pretty printing */
     Socket client; /* The client socket */
+    struct bcast_reader rx;   /* Position in the serial broadcast ring */
+    uint8_t tx_partial[BCAST_FRAME_MAX]; /* Rest of a frame cut by a send */
+    uint16_t tx_partial_len;
+    uint16_t tx_partial_off;
+    bool raw;                 /* Fed through `pipe` instead of `rx` */
+    bool udp;                 /* UDP endpoint, `client` is its socket */
+    bool udp_learn;           /* Send to whoever sent the last datagram */
+    struct sockaddr_storage peer; /* Where a UDP endpoint sends to */
+    socklen_t peer_len;           /* 0 while the peer is unknown */
+    const struct bcast_rates *udp_rates; /* Rate caps of a UDP endpoint */
+    int pipe[2];              /* Raw client send queue */
+    size_t pipe_size;         /* Capacity of `pipe` */
+    size_t pipe_pending;      /* Bytes in `pipe` not yet sent */
+    bool want_write;          /* EPOLLOUT is armed for the socket */
+#ifdef CONFIG_IO_URING
+    int uring_inflight;    /* Requests not yet completed for the client */
+    bool send_inflight;    /* A send from `rx` is in flight */
+    struct msghdr tx_msg;  /* In-flight send, must outlive its submission */
+    struct bcast_batch tx_batch;
+#endif
+    unsigned long tx_dropped; /* Frames (bytes for raw clients) discarded
+                                 because the client lagged */
+    struct mavlink_scanner scanner; /* Frames sent by the client */
+    unsigned long rx_bad_crc;       /* Frames dropped for a bad CRC */
+    struct uplink_source merge;     /* Uplink with the merge policy */
     struct ClientNode
         *next; /* Pointer to the next client node in the clients list */
+    struct ClientNode **pprev; /* Link pointing at this node, for O(1) unlink */
 };
 
-serial_t serial;
-pthread_mutex_t serial_tx_mtx;
+/* The port of the link served by the calling thread */
+__thread serial_t serial = SERIAL_INVALID_FD;
+
+/* Second port of the link to the same FCU, e.g. a second telemetry radio.
+ * Its frames are merged with the port's, clients get the earliest copy. */
+static __thread serial_t g_redundant = SERIAL_INVALID_FD;
+static __thread unsigned char g_redundant_cache[1024];
 
 mavlink_status_t mavlink_status;
 
@@ -177,20 +286,35 @@ static const char *stop_bits_to_string(enum SerialStopBits stop_bits)
 }
 
 /**
- * A utility function that converts an IPv4 address to a human readable string.
+ * A utility function that converts a socket address to a human readable
+ * string. IPv4 clients of the dual-stack listener show up as IPv4-mapped IPv6
+ * addresses and are printed in the IPv4 form.
  */
-static const char *ipaddr_to_string(Ipv4Addr addr)
+static void sockaddr_to_string(const struct sockaddr_storage *remote,
+                               char *addr,
+                               InetPort *port)
 {
-    static char ip[sizeof("255.255.255.255")];
-
-    /* Format the IP address nicely */
-    if (snprintf(ip, sizeof(ip), "%u.%u.%u.%u", (addr >> 24) & 0xff,
-                 (addr >> 16) & 0xff, (addr >> 8) & 0xff,
-                 addr & 0xff) >= (int) sizeof(ip)) {
-        return "Unknown";
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) remote;
+    const struct sockaddr_in *in = (const struct sockaddr_in *) remote;
+    char ip[INET6_ADDRSTRLEN];
+
+    if ((remote->ss_family == AF_INET6) &&
+        IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) &&
+        inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], ip, sizeof(ip))) {
+        snprintf(addr, CLIENT_ADDR_LEN, "%s", ip);
+        *port = ntohs(in6->sin6_port);
+    } else if ((remote->ss_family == AF_INET6) &&
+               inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip))) {
+        snprintf(addr, CLIENT_ADDR_LEN, "[%s]", ip);
+        *port = ntohs(in6->sin6_port);
+    } else if ((remote->ss_family == AF_INET) &&
+               inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip))) {
+        snprintf(addr, CLIENT_ADDR_LEN, "%s", ip);
+        *port = ntohs(in->sin_port);
+    } else {
+        snprintf(addr, CLIENT_ADDR_LEN, "Unknown");
+        *port = 0;
     }
-
-    return ip;
 }
 
 /**
@@ -258,378 +382,2607 @@ void help(const char *s, ...)
         va_end(args);
     }
 
-    fputs("usage: mission-server [tcp_port]\n", stderr);
+    fputs("usage: mission-server [-p tcp_port] [-f,--fcu-sim]\n", stderr);
 }
 
-/* Global state variables */
-static unsigned char g_cache[1024];
-static int g_last_id = -1, g_commanding_client = -1;
-static struct ClientNode *g_clients = NULL;
-static Waiter g_waiters[EVENT_INDEX_COUNT_MAX];
+/* Global state variables. Every serial link is served by a thread of its
+ * own, with its own event loop and clients, so the state of a server is kept
+ * per thread. */
+static __thread unsigned char g_cache[1024];
+static __thread int g_commanding_client = -1;
+static __thread struct ClientNode *g_clients = NULL, *g_clients_tail = NULL;
+static __thread struct ClientNode *g_dead_clients = NULL;
+static __thread struct ClientNode *g_client_slots = NULL; /* The table */
+static __thread struct ClientNode *g_free_slots = NULL; /* Chained by `next` */
+#ifndef CONFIG_IO_URING
+static __thread int g_epoll = -1;
+#endif
+static __thread bool g_serial_paused = false;
+static __thread struct server_config g_config;
+static __thread struct bcast_ring g_ring; /* Serial frames for all clients */
+static __thread struct Listener g_listener = {{EVENT_SERVER}, INVALID_SOCKET,
+                                              false};
+static __thread struct Listener g_raw_listener = {{EVENT_SERVER},
+                                                  INVALID_SOCKET, true};
+static __thread struct Listener g_endpoints[SERVER_ENDPOINT_MAX];
+static __thread struct ClientNode *g_udp[SERVER_UDP_MAX]; /* Clients for life */
+static __thread int g_raw_clients = 0;
+static __thread int g_raw_pipe[2] = {-1, -1}; /* Serial data for tee() */
+static __thread bool g_raw_splice = true; /* The port supports splice() */
 int cmd_fifo_w, cmd_fifo_r;
 
-/**
- * A utility function that handles client connections.
- */
-static int accept_client(Socket server)
-{
-    struct sockaddr_in remote;
-    socklen_t remlen = sizeof(remote);
-    struct ClientNode *new_client =
-        (struct ClientNode *) malloc(sizeof(struct ClientNode));
+/* Raw clients, endpoints and UDP endpoints are only served on link 0 */
+static unsigned char g_dgram_bufs[UDP_RECV_BATCH][UDP_DATAGRAM_MAX];
+
+static __thread struct EventSource g_close_source = {EVENT_CLOSE};
+static __thread struct EventSource g_serial_source = {EVENT_SERIAL};
+static __thread struct EventSource g_redundant_source = {EVENT_REDUNDANT};
+static __thread struct EventSource g_user_cmd_source = {EVENT_USER_CMD};
+static __thread struct EventSource g_route_source = {EVENT_ROUTE};
+static __thread int g_route_fd = -1; /* See `mavlink_router_open()` */
+static __thread struct EventSource g_rate_source = {EVENT_RATE};
+static __thread int g_rate_fd = -1;
+static __thread uint64_t g_rate_due_ns = 0; /* Timer deadline, 0 if unarmed */
+
+#ifdef CONFIG_IO_URING
+/* Operation tags kept in the top byte of an SQE's user data, the rest holds
+ * the pointer to the event source it completes for */
+enum UringOp {
+    URING_OP_POLL,    /* Multishot POLLIN on a fixed source */
+    URING_OP_READ,    /* Fixed buffer read of the serial port */
+    URING_OP_ACCEPT,  /* Multishot accept on a listener */
+    URING_OP_RECV,    /* Multishot recv from a client */
+    URING_OP_SEND,    /* Non-blocking sendmsg to a client */
+    URING_OP_POLLOUT, /* Wait for a client to become writable */
+    URING_OP_POLLIN,  /* Multishot POLLIN on a UDP endpoint */
+    URING_OP_CANCEL,  /* Cancellation of a client's requests */
+};
 
-    if (!new_client)
-        goto cleanup;
+#define URING_ENTRIES 256
+#define URING_RECV_BGID 0
+#define URING_RECV_BUFS 64 /* Power of two */
+#define URING_RECV_BUF_SIZE 1024
 
-    memset(new_client, 0, sizeof(*new_client));
+static __thread struct io_uring g_uring;
+static __thread struct io_uring_buf_ring *g_recv_ring;
+static __thread unsigned char (*g_recv_bufs)[URING_RECV_BUF_SIZE];
+static __thread bool g_serial_reading = false;
 
-    if (((new_client->client = accept(server, (struct sockaddr *) &remote,
-                                      &remlen)) == INVALID_SOCKET) ||
-        (remlen != sizeof(remote)) || (remote.sin_family != AF_INET)) {
-        goto cleanup;
-    }
+static inline uint64_t uring_tag(enum UringOp op, void *source)
+{
+    return ((uint64_t) op << 56) | (uint64_t) (uintptr_t) source;
+}
 
-    memcpy(&new_client->addr, &remote.sin_addr, sizeof(Ipv4Addr));
-    new_client->addr = ntohl(new_client->addr);
-    new_client->port = ntohs(remote.sin_port);
+/**
+ * A utility function that returns a free submission queue entry, submitting
+ * the pending ones first if the queue is full.
+ */
+static struct io_uring_sqe *uring_get_sqe(enum UringOp op, void *source)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&g_uring);
 
-    new_client->id = ++g_last_id;
-    status("Accepted a connection from %s:%u on client ID %d",
-           ipaddr_to_string(new_client->addr), new_client->port,
-           new_client->id);
+    if (!sqe) {
+        io_uring_submit(&g_uring);
+        sqe = io_uring_get_sqe(&g_uring);
+    }
 
-    if (!g_clients) {
-        g_clients = new_client;
-    } else {
-        struct ClientNode *current = g_clients;
+    io_uring_sqe_set_data64(sqe, uring_tag(op, source));
 
-        while (current->next)
-            current = current->next;
+    return sqe;
+}
 
-        current->next = new_client;
-    }
+/**
+ * A utility function that queues a fixed buffer read of the serial port into
+ * `g_cache`, unless one is in flight or reads are stalled.
+ */
+static void uring_read_serial(void);
+static void read_redundant_port(void);
 
-    return true;
+/**
+ * A utility function that stops or resumes reading the serial port, used to
+ * apply back pressure with the stall policy.
+ */
+static void pause_serial(bool pause)
+{
+    if (g_serial_paused == pause)
+        return;
 
-cleanup:
-    if (new_client) {
-        if (new_client->client != 0)
-            closesocket(new_client->client);
+    g_serial_paused = pause;
 
-        free(new_client);
-        new_client = NULL;
+    /* Data may have arrived meanwhile without a new readiness event */
+    if (!pause) {
+        uring_read_serial();
+        read_redundant_port();
     }
-
-    return false;
 }
 
 /**
- * A utility function that handles client termination.
+ * A utility function that starts receiving from a client into the provided
+ * buffer ring. UDP endpoints are only polled, their datagrams are read with
+ * recvmmsg() so the sender addresses come along.
  */
-static struct ClientNode *terminate_client(struct ClientNode *node,
-                                           struct ClientNode **pointer)
+static bool watch_client(struct ClientNode *node)
 {
-    struct ClientNode *next;
+    struct io_uring_sqe *sqe;
 
-    if ((!node) || (!pointer) || (*pointer != node))
-        return NULL;
+    if (node->udp) {
+        sqe = uring_get_sqe(URING_OP_POLLIN, node);
+        io_uring_prep_poll_multishot(sqe, node->client, POLLIN);
+        node->uring_inflight++;
+        return true;
+    }
 
-    status("Removing client %d...", node->id);
+    sqe = uring_get_sqe(URING_OP_RECV, node);
 
-    /* Clear commanding client event wait */
-    if (node->id == g_commanding_client)
-        g_waiters[EVENT_CLIENT_INDEX].fd = -1;
+    io_uring_prep_recv_multishot(sqe, node->client, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_BGID;
+    node->uring_inflight++;
 
-    /* Change the pointer of `pointer` before terminating the client
-     * to make sure it never points to an invalid client */
-    *pointer = next = node->next;
+    return true;
+}
 
-    /* Gracefully shut down the socket */
-    shutdown(node->client, 0);
-    closesocket(node->client);
-    node->client = INVALID_SOCKET;
+/**
+ * A utility function that cancels every request in flight for a client.
+ */
+static void unwatch_client(struct ClientNode *node)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_CANCEL, NULL);
 
-    free(node);
+    io_uring_prep_cancel_fd(sqe, node->client, IORING_ASYNC_CANCEL_ALL);
 
-    return next;
+    /* Make sure the cancellation is issued before the fd is closed */
+    io_uring_submit(&g_uring);
 }
 
 /**
- * A utility function that handles serial receive events.
+ * A utility function that waits for a client to become writable.
  */
-static void send_data_to_clients(serial_t sport)
+static void watch_client_writable(struct ClientNode *node, bool want_write)
 {
-    struct ClientNode *current = g_clients, **previous = &g_clients;
-    long rbytes = serial_read(sport, g_cache, sizeof(g_cache));
-
-    if (rbytes <= 0)
+    if (!want_write || node->want_write)
         return;
 
-    read_mavlink_msg(g_cache, rbytes);
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_POLLOUT, node);
 
-    while (current) {
-        size_t sent = 0;
+    io_uring_prep_poll_add(sqe, node->client, POLLOUT);
+    node->uring_inflight++;
+    node->want_write = true;
+}
+#else
+/**
+ * A utility function that registers a file descriptor with the event loop.
+ */
+static bool watch_fd(int fd, uint32_t events, struct EventSource *source)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = source,
+    };
 
-        for (;;) {
-            long sbytes = send(current->client, (char *) g_cache + sent,
-                               (size_t) rbytes - sent, 0);
+    if (epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        error("Failed to watch fd %d: %s", fd, strerror(errno));
+        return false;
+    }
 
-            if (sbytes < 0) {
-                current = terminate_client(current, previous);
-                break;
-            }
+    return true;
+}
 
-            sent += (size_t) sbytes;
+/**
+ * A utility function that changes the events watched for a file descriptor.
+ */
+static void rewatch_fd(int fd, uint32_t events, struct EventSource *source)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = source,
+    };
 
-            if (sent == (size_t) rbytes) {
-                previous = &(*previous)->next;
-                current = current->next;
-                break;
-            }
-        }
-    }
+    if (epoll_ctl(g_epoll, EPOLL_CTL_MOD, fd, &ev) != 0)
+        error("Failed to update watch of fd %d: %s", fd, strerror(errno));
 }
 
 /**
- * A utility function that handles commanding client data.
+ * A utility function that stops or resumes reading the serial port, used to
+ * apply back pressure with the stall policy.
  */
-static void handle_commanding_client(serial_t sport)
+static void pause_serial(bool pause)
 {
-    long rbytes;
-    static int last_commander = -1, tryout = 0;
-
-    if (!g_clients)
+    if (g_serial_paused == pause)
         return;
 
-    if (last_commander != g_commanding_client) {
-        last_commander = g_commanding_client;
-        tryout = 0;
-    }
+    rewatch_fd(serial, pause ? 0 : EPOLLIN, &g_serial_source);
+    if (g_redundant != SERIAL_INVALID_FD)
+        rewatch_fd(g_redundant, pause ? 0 : EPOLLIN, &g_redundant_source);
+    g_serial_paused = pause;
+}
 
-    rbytes = recv(g_clients->client, (char *) g_cache, sizeof(g_cache), 0);
+static bool watch_client(struct ClientNode *node)
+{
+    return watch_fd(node->client, EPOLLIN | EPOLLRDHUP, &node->source);
+}
 
-    if (rbytes <= 0) {
-        if (tryout++ == 3)
-            terminate_client(g_clients, &g_clients);
+static void unwatch_client(struct ClientNode *node)
+{
+    epoll_ctl(g_epoll, EPOLL_CTL_DEL, node->client, NULL);
+}
 
+/**
+ * A utility function that arms or disarms EPOLLOUT for a client.
+ */
+static void watch_client_writable(struct ClientNode *node, bool want_write)
+{
+    if (want_write == node->want_write)
         return;
-    }
 
-    pthread_mutex_lock(&serial_tx_mtx);
-    serial_write(sport, g_cache, (size_t) rbytes);
-    pthread_mutex_unlock(&serial_tx_mtx);
+    rewatch_fd(node->client, EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0),
+               &node->source);
+    node->want_write = want_write;
 }
+#endif
 
-/* Pipe ends used to signal that we should gracefully shut down on POSIX systems
+/**
+ * A utility function that returns the endpoint of a client for the router.
  */
-static int g_close[2] = {-1, -1};
+static int client_endpoint(const struct ClientNode *node)
+{
+    return MAVLINK_ROUTE_CLIENT((int) (node - g_client_slots));
+}
 
-static void sig_handler(int sig)
+/**
+ * A utility function that returns the priority classes a lagging client's
+ * messages are shed by, NULL unless the slow client policy is to shed.
+ */
+static const struct bcast_shed *client_shed(void)
 {
-    switch (sig) {
-    case SIGINT:
-    case SIGABRT:
-    case SIGTERM: {
-        char b = '\0';
-        write(g_close[1], &b, 1);
-        delete_pidfile();
-        exit(0);
-    } break;
-    default:
-        break;
-    }
+    if (g_config.slow_client_policy != SLOW_CLIENT_SHED)
+        return NULL;
+
+    return &g_config.shed;
 }
 
-void read_user_cmd(serial_t sport)
+/**
+ * A utility function that preallocates the client table and chains all of its
+ * slots into the free list.
+ */
+static bool init_client_slots(int count)
 {
-    /* Read user command from the FIFO */
-    static int received = 0;
-    mavlink_cmd user_cmd;
-    int rsize = read(cmd_fifo_r, (char *) &user_cmd + received,
-                     sizeof(mavlink_cmd) - received);
-    received += rsize;
+    g_client_slots = calloc(count, sizeof(struct ClientNode));
 
-    /* read complete */
-    if (received == sizeof(user_cmd)) {
-        received = 0;  // Reset
+    if (!g_client_slots)
+        return false;
 
-        /* Select an action */
-        switch (user_cmd.type) {
-        case PLAY_TUNE_CMD:
-            mavlink_send_play_tune(user_cmd.arg[0], sport);
-            break;
-        }
+    /* Hand out the lowest slots first */
+    for (int i = count - 1; i >= 0; i--) {
+        g_client_slots[i].next = g_free_slots;
+        g_free_slots = &g_client_slots[i];
     }
+
+    return true;
 }
 
-void *run_uart_server(void *args)
+/**
+ * A utility function that takes a slot from the client table.
+ */
+static struct ClientNode *alloc_client_slot(void)
 {
-    /* Load UART server arguments */
-    uart_server_args_t *uart_server_args = (uart_server_args_t *) args;
-    char *serial_path;
-    char *net_port = uart_server_args->net_port;
+    struct ClientNode *node = g_free_slots;
 
-    int ret_val = EXIT_FAILURE;
+    if (!node)
+        return NULL;
 
-    unsigned port = DEFAULT_PORT;
-    struct SerialConfig cfg;
+    g_free_slots = node->next;
 
-    get_serial_port_config(&serial_path, &cfg);
+    unsigned generation = node->generation;
+    memset(node, 0, sizeof(*node));
+    node->generation = generation;
+    node->id = (int) (((generation & CLIENT_GEN_MASK) << CLIENT_SLOT_BITS) |
+                      (unsigned) (node - g_client_slots));
+    traffic_stats_client_open(node - g_client_slots, node->id);
 
-    /* Parse the TCP port if provided */
-    if (net_port) {
-        if ((!get_unsigned(net_port, strlen(net_port), &port) || (port == 0) ||
-             (port > 0xffff))) {
-            help("port must be in the range 1-65535");
-            exit(ret_val);
-        }
-    }
+    return node;
+}
 
-    Socket server;
+/**
+ * A utility function that returns a slot to the client table, retiring the
+ * ID of the client that held it.
+ */
+static void free_client_slot(struct ClientNode *node)
+{
+    traffic_stats_client_close(node - g_client_slots);
+    node->generation++;
+    node->next = g_free_slots;
+    g_free_slots = node;
+}
 
-    if ((server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) ==
-        INVALID_SOCKET) {
-        error("Failed to open a TCP socket");
-        exit(ret_val);
-    }
+/**
+ * A utility function that appends a client to the clients list, so the oldest
+ * client stays in command.
+ */
+static void append_client(struct ClientNode *node)
+{
+    node->pprev = g_clients ? &g_clients_tail->next : &g_clients;
+    *node->pprev = node;
+    g_clients_tail = node;
+}
 
-    struct sockaddr_in bind_addr;
-    memset(&bind_addr, 0, sizeof(bind_addr));
-    bind_addr.sin_family = AF_INET;
-    bind_addr.sin_port = htons(port);
+/**
+ * A utility function that sets up a newly connected client. The socket must
+ * be non-blocking already.
+ */
+static int add_client(struct Listener *listener,
+                      Socket fd,
+                      const struct sockaddr_storage *remote)
+{
+    struct ClientNode *new_client = alloc_client_slot();
 
-    if (bind(server, (struct sockaddr *) &bind_addr, sizeof(bind_addr)) != 0) {
-        error("Failed to bind to port %u", port);
-        goto terminate;
-    }
-    if (listen(server, 10) != 0) {
-        error("Failed to start TCP listen");
-        goto terminate;
+    if (!new_client) {
+        char addr[CLIENT_ADDR_LEN];
+        InetPort port;
+
+        sockaddr_to_string(remote, addr, &port);
+        status("Refusing a connection from %s:%u, all %d client slots in use",
+               addr, port, g_config.max_clients);
+        closesocket(fd);
+        return false;
     }
 
-    pthread_mutex_init(&serial_tx_mtx, NULL);
-    serial = serial_open(serial_path, &cfg, SERIAL_TIMEOUT);
+    new_client->client = fd;
+    new_client->pipe[0] = new_client->pipe[1] = -1;
 
-    if (serial == SERIAL_INVALID_FD) {
-        error("Failed to open the requested serial port");
-        goto terminate;
-    }
+    sockaddr_to_string(remote, new_client->addr, &new_client->port);
 
-    if (pipe(g_close) < 0) {
-        error("Failed to create shut down event: %s", strerror(errno));
-        goto terminate;
-    }
+    new_client->source.type = EVENT_CLIENT;
+    uplink_source_init(&new_client->merge, listener->uplink_weight);
 
-    g_waiters[EVENT_CLOSE_INDEX].fd = g_close[0];
-    g_waiters[EVENT_SERIAL_INDEX].fd = serial;
-    g_waiters[EVENT_SERVER_INDEX].fd = server;
-    g_waiters[EVENT_USER_CMD_INDEX].fd = cmd_fifo_r;
-    g_waiters[EVENT_CLIENT_INDEX].fd = -1;
+    if (listener->raw) {
+        if (pipe2(new_client->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+            goto cleanup;
 
-    for (size_t event_idx = 0; event_idx < EVENT_INDEX_COUNT_MAX; ++event_idx)
-        g_waiters[event_idx].events = POLLIN;
+        /* Best effort, the pipe is the only backlog a raw client gets */
+        fcntl(new_client->pipe[1], F_SETPIPE_SZ, g_config.client_queue_size);
+        int pipe_size = fcntl(new_client->pipe[1], F_GETPIPE_SZ);
+        new_client->pipe_size = pipe_size > 0 ? (size_t) pipe_size : 4096;
+    }
 
-    /* Register for application termination requests to allow graceful
-     * shut down
-     */
-    signal(SIGINT, sig_handler);
-    signal(SIGABRT, sig_handler);
-    signal(SIGTERM, sig_handler);
+    if (!watch_client(new_client))
+        goto cleanup;
 
-    /* Workaround for running in mintty (doesn't really matter everywhere
-     * else because we don't print that much)
-     */
-    setbuf(stdout, NULL);
+    status("Accepted a %sconnection from %s:%u on client ID %d",
+           listener->raw ? "raw " : "", new_client->addr, new_client->port,
+           new_client->id);
 
-    status(
-        "Serving %s @ %u bps (parity %s, %d data bits, "
-        "and %s stop bits) on port %u",
-        serial_path, cfg.baudrate, parity_to_string(cfg.parity), cfg.data_bits,
-        stop_bits_to_string(cfg.stop_bits), port);
+    if (listener->raw) {
+        new_client->raw = true;
+        g_raw_clients++;
+    } else {
+        bcast_reader_attach(&g_ring, &new_client->rx, listener->filter,
+                            listener->rates, client_shed(),
+                            client_endpoint(new_client));
+    }
 
-    /* Wait until the connection is established to the flight controller */
-    while (!flight_controller_connected()) {
-        /* Send autopilot capabilities message */
-        mavlink_send_request_autopilot_capabilities(serial);
+    append_client(new_client);
 
-        /* Wait for a while */
-        usleep(500000); /* 500ms */
+    return true;
 
-        /* Attempt to receive autopilot version message from the flight
-         * controller */
-        long rbytes = serial_read(serial, g_cache, sizeof(g_cache));
-        if (rbytes <= 0)
-            continue;
-        read_mavlink_msg(g_cache, rbytes);
+cleanup:
+    closesocket(new_client->client);
+
+    if (new_client->pipe[0] >= 0) {
+        close(new_client->pipe[0]);
+        close(new_client->pipe[1]);
     }
 
-    /* Main server loop */
-    for (;;) {
-        int result = poll(g_waiters, EVENT_INDEX_COUNT_MAX, -1);
+    free_client_slot(new_client);
 
-        if ((result < 0) && (errno != EINTR)) {
-            error("Failed to wait on event: %d (%s)", errno, strerror(errno));
-            break;
-        }
+    return false;
+}
 
-        /* Break if we were requested to shut down */
-        if (g_waiters[EVENT_CLOSE_INDEX].revents &
-            (POLLIN | POLLHUP | POLLERR)) {
-            /* Exit with 0 exit code on graceful shut down */
-            ret_val = EXIT_SUCCESS;
-            break;
+#ifndef CONFIG_IO_URING
+/**
+ * A utility function that handles client connections. Every pending
+ * connection is accepted, so a burst of reconnecting clients is served in a
+ * single wakeup.
+ */
+static void accept_clients(struct Listener *listener)
+{
+    for (;;) {
+        struct sockaddr_storage remote;
+        socklen_t remlen = sizeof(remote);
+        Socket fd = accept4(listener->fd, (struct sockaddr *) &remote, &remlen,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd == INVALID_SOCKET) {
+            /* The connection was reset while queued, try the next one */
+            if ((errno == EINTR) || (errno == ECONNABORTED))
+                continue;
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                error("Failed to accept a client: %s", strerror(errno));
+            return;
         }
 
-        if (g_waiters[EVENT_CLIENT_INDEX].revents & (POLLHUP | POLLERR)) {
-            terminate_client(g_clients, &g_clients);
-        } else if (g_waiters[EVENT_CLIENT_INDEX].revents & POLLIN) {
-            handle_commanding_client(serial);
-            g_waiters[EVENT_CLIENT_INDEX].revents = 0;
-        }
+        add_client(listener, fd, &remote);
+    }
+}
+#endif
 
-        if (g_waiters[EVENT_SERVER_INDEX].revents & POLLIN) {
-            accept_client(server);
-            g_waiters[EVENT_SERVER_INDEX].revents = 0;
-        }
+/**
+ * A utility function that handles client termination.
+ *
+ * The node is only unlinked here. Other events for it may still be pending in
+ * the current epoll batch, so it is freed later by `reap_clients()`.
+ */
+static struct ClientNode *terminate_client(struct ClientNode *node)
+{
+    struct ClientNode *next;
 
-        if (g_waiters[EVENT_SERIAL_INDEX].revents & POLLIN) {
-            send_data_to_clients(serial);
-            g_waiters[EVENT_SERIAL_INDEX].revents = 0;
-        }
+    if ((!node) || (node->client == INVALID_SOCKET))
+        return NULL;
 
-        /* Event of receiving user commands */
-        if (g_waiters[EVENT_USER_CMD_INDEX].revents & POLLIN) {
-            read_user_cmd(serial);
-            g_waiters[EVENT_USER_CMD_INDEX].revents = 0;
+    if (node->tx_dropped)
+        status("Removing client %d (%lu %s dropped)...", node->id,
+               node->tx_dropped, node->raw ? "bytes" : "frames");
+    else
+        status("Removing client %d...", node->id);
+
+    if (g_config.uplink_policy == UPLINK_MERGE)
+        status("Client %d merged %lu frames (%lu dropped, %lu bad CRC)",
+               node->id, node->merge.merged, node->merge.dropped,
+               node->rx_bad_crc);
+    uplink_source_remove(&node->merge);
+    mavlink_router_forget(client_endpoint(node));
+
+    /* Unlink the node from the clients list, a UDP endpoint still waiting
+     * for its peer is not on it */
+    next = node->next;
+    if (node->pprev) {
+        *node->pprev = next;
+        if (next) {
+            next->pprev = node->pprev;
+        } else if (node->pprev == &g_clients) {
+            g_clients_tail = NULL;
+        } else {
+            /* The new tail is the node owning the `next` field we hung off */
+            g_clients_tail =
+                (struct ClientNode *) ((char *) node->pprev -
+                                       offsetof(struct ClientNode, next));
         }
+    }
 
-        /* Check if we need to listen for a new commanding client */
-        if ((g_clients) && (g_commanding_client != g_clients->id)) {
-            g_waiters[EVENT_CLIENT_INDEX].fd = g_clients->client;
-            g_waiters[EVENT_CLIENT_INDEX].revents = 0;
-
-            g_commanding_client = g_clients->id;
+    /* Gracefully shut down the socket */
+    unwatch_client(node);
+    shutdown(node->client, 0);
+    closesocket(node->client);
+    node->client = INVALID_SOCKET;
 
-            status("Client %d @ %s:%u is now in command of the serial port",
-                   g_clients->id, ipaddr_to_string(g_clients->addr),
-                   g_clients->port);
-        }
+    if (node->raw) {
+        close(node->pipe[0]);
+        close(node->pipe[1]);
+        g_raw_clients--;
+    } else if (node->pprev) {
+        bcast_reader_detach(&g_ring, &node->rx);
     }
 
-    /* Gracefully shut down all clients */
-    while (g_clients)
-        terminate_client(g_clients, &g_clients);
+    node->next = g_dead_clients;
+    g_dead_clients = node;
 
-    /* Close both ends of shut down pipe */
-    close(g_close[0]);
-    close(g_close[1]);
-    close(cmd_fifo_w);
-    close(cmd_fifo_r);
+    return next;
+}
+
+/**
+ * A utility function that frees the clients terminated during the last batch
+ * of events. With io_uring a client is kept until all its requests have
+ * completed, as their completions still point at it.
+ */
+static void reap_clients(void)
+{
+    struct ClientNode **link = &g_dead_clients;
+
+    while (*link) {
+        struct ClientNode *node = *link;
+
+#ifdef CONFIG_IO_URING
+        if (node->uring_inflight) {
+            link = &node->next;
+            continue;
+        }
+#endif
+
+        *link = node->next;
+        free_client_slot(node);
+    }
+}
+
+/**
+ * A utility function that moves a raw client's pipe into its socket without
+ * copying through user space.
+ *
+ * @return false if the client was terminated.
+ */
+static bool flush_raw_client(struct ClientNode *node)
+{
+    while (node->pipe_pending) {
+        long sbytes = splice(node->pipe[0], NULL, node->client, NULL,
+                             node->pipe_pending,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (sbytes < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if (errno == EINTR)
+                continue;
+
+            terminate_client(node);
+            return false;
+        }
+
+        node->pipe_pending -= (size_t) sbytes;
+        traffic_stats_client_sent(node - g_client_slots, (size_t) sbytes);
+    }
+
+    watch_client_writable(node, node->pipe_pending != 0);
+
+    return true;
+}
+
+/**
+ * A utility function that accounts for what a client lost as it lagged:
+ * frames, or bytes for raw clients.
+ */
+static void count_dropped(struct ClientNode *node, size_t count)
+{
+    node->tx_dropped += count;
+    traffic_stats_client_dropped(node - g_client_slots, count);
+}
+
+/**
+ * A utility function that queues the latest serial chunk for a raw client,
+ * duplicating it from the staging pipe with tee() or, if the serial port
+ * cannot be spliced, copying it from `g_cache`.
+ *
+ * @return false if the client was terminated.
+ */
+static bool queue_raw_client(struct ClientNode *node, size_t len)
+{
+    long qbytes;
+
+    if (g_raw_splice)
+        qbytes = tee(g_raw_pipe[0], node->pipe[1], len, SPLICE_F_NONBLOCK);
+    else
+        qbytes = write(node->pipe[1], g_cache, len);
+
+    if (qbytes < 0)
+        qbytes = 0;
+
+    if ((size_t) qbytes < len) {
+        if (g_config.slow_client_policy == SLOW_CLIENT_DROP_CLIENT) {
+            status("Client %d cannot keep up", node->id);
+            terminate_client(node);
+            return false;
+        }
+
+        /* A pipe cannot drop its oldest bytes, lose the newest instead */
+        count_dropped(node, len - (size_t) qbytes);
+    }
+
+    node->pipe_pending += (size_t) qbytes;
+
+    return flush_raw_client(node);
+}
+
+/**
+ * A utility function that describes the next send to a client: the rest of a
+ * frame cut short by the previous send, or else the next frames it wants.
+ *
+ * @return false if there is nothing to send.
+ */
+static bool prepare_send(struct ClientNode *node,
+                         struct bcast_batch *batch,
+                         struct msghdr *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+
+    if (node->tx_partial_len) {
+        batch->count = 0;
+        batch->bytes = 0;
+        batch->next = node->rx.cursor;
+        batch->deferred = false;
+        batch->held = false;
+        batch->iov[0].iov_base = node->tx_partial + node->tx_partial_off;
+        batch->iov[0].iov_len = node->tx_partial_len - node->tx_partial_off;
+        batch->iovcnt = 1;
+    } else {
+        bcast_reader_peek(&g_ring, &node->rx, batch);
+
+        /* Skip the frames the client did not subscribe to */
+        if (batch->count == 0) {
+            node->rx.cursor = batch->next;
+            return false;
+        }
+    }
+
+    msg->msg_iov = batch->iov;
+    msg->msg_iovlen = batch->iovcnt;
+
+    return true;
+}
+
+/**
+ * A utility function that accounts for the bytes sent from a batch. A frame
+ * cut short is copied aside, so the client always receives whole frames even
+ * if the ring moves on before the rest is sent.
+ */
+static void complete_send(struct ClientNode *node,
+                          const struct bcast_batch *batch,
+                          size_t sent)
+{
+    uint64_t offset;
+
+    traffic_stats_client_sent(node - g_client_slots, sent);
+
+    if (batch->count == 0) {
+        node->tx_partial_off += sent;
+        if (node->tx_partial_off == node->tx_partial_len)
+            node->tx_partial_len = node->tx_partial_off = 0;
+        return;
+    }
+
+    size_t rest = bcast_reader_consume(&node->rx, batch, sent, &offset);
+
+    if (rest == 0)
+        return;
+
+    if (offset >= bcast_ring_tail(&g_ring)) {
+        bcast_ring_copy(&g_ring, offset, node->tx_partial, rest);
+        node->tx_partial_len = (uint16_t) rest;
+        node->tx_partial_off = 0;
+    } else {
+        /* Overwritten while the send was in flight */
+        count_dropped(node, 1);
+    }
+}
+
+static bool client_pending(const struct ClientNode *node)
+{
+    return node->tx_partial_len || bcast_reader_pending(&g_ring, &node->rx);
+}
+
+/**
+ * A utility function that sends a UDP endpoint its pending frames, one
+ * datagram per frame and a whole batch per sendmmsg(). A peer that cannot be
+ * reached loses the frames, but the endpoint keeps serving.
+ */
+static bool transmit_datagrams(struct ClientNode *node)
+{
+    struct bcast_batch batch;
+    struct mmsghdr msgs[BCAST_BATCH_FRAMES];
+    struct iovec iov[BCAST_BATCH_FRAMES][2];
+
+    for (;;) {
+        bcast_reader_peek(&g_ring, &node->rx, &batch);
+
+        if (batch.count == 0) {
+            node->rx.cursor = batch.next;
+            break;
+        }
+
+        memset(msgs, 0, sizeof(msgs[0]) * batch.count);
+        for (int i = 0; i < batch.count; i++) {
+            msgs[i].msg_hdr.msg_name = &node->peer;
+            msgs[i].msg_hdr.msg_namelen = node->peer_len;
+            msgs[i].msg_hdr.msg_iov = iov[i];
+            msgs[i].msg_hdr.msg_iovlen =
+                bcast_ring_iov(&g_ring, batch.frame[i].offset,
+                               batch.frame[i].len, iov[i]);
+        }
+
+        int count = sendmmsg(node->client, msgs, batch.count, MSG_DONTWAIT);
+
+        if (count < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if (errno == EINTR)
+                continue;
+
+            count_dropped(node, batch.count);
+            bcast_reader_consume(&node->rx, &batch, batch.bytes, NULL);
+            continue;
+        }
+
+        size_t sent = 0;
+        for (int i = 0; i < count; i++)
+            sent += batch.frame[i].len;
+
+        complete_send(node, &batch, sent);
+    }
+
+    watch_client_writable(node, client_pending(node));
+
+    return true;
+}
+
+#ifdef CONFIG_IO_URING
+/**
+ * A utility function that queues a send of a client's pending frames.
+ *
+ * MSG_DONTWAIT makes the send complete inline when it is submitted instead of
+ * being retried later, so the ring bytes are copied before the serial reader
+ * can overwrite them. A send that would block completes with -EAGAIN and the
+ * client is then polled for writability.
+ */
+static bool transmit_client(struct ClientNode *node)
+{
+    if (node->send_inflight || node->want_write ||
+        !prepare_send(node, &node->tx_batch, &node->tx_msg))
+        return true;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_SEND, node);
+    io_uring_prep_sendmsg(sqe, node->client, &node->tx_msg,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+    node->uring_inflight++;
+    node->send_inflight = true;
+
+    return true;
+}
+#else
+/**
+ * A utility function that sends as many pending frames as a client's socket
+ * accepts without blocking, and arms EPOLLOUT while anything is left.
+ */
+static bool transmit_client(struct ClientNode *node)
+{
+    struct bcast_batch batch;
+    struct msghdr msg;
+
+    while (prepare_send(node, &batch, &msg)) {
+        long sbytes = sendmsg(node->client, &msg, MSG_NOSIGNAL);
+
+        if (sbytes < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if (errno == EINTR)
+                continue;
+
+            terminate_client(node);
+            return false;
+        }
+
+        complete_send(node, &batch, (size_t) sbytes);
+    }
+
+    watch_client_writable(node, client_pending(node));
+
+    return true;
+}
+#endif
+
+/**
+ * A utility function that wakes up the event loop at a monotonic time in
+ * nanoseconds, unless it is already woken up earlier.
+ */
+static void arm_rate_timer(uint64_t due_ns)
+{
+    if (g_rate_due_ns && (g_rate_due_ns <= due_ns))
+        return;
+
+    struct itimerspec its = {
+        .it_value = {.tv_sec = (time_t) (due_ns / 1000000000ull),
+                     .tv_nsec = (long) (due_ns % 1000000000ull)},
+    };
+
+    if (timerfd_settime(g_rate_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+        g_rate_due_ns = due_ns;
+}
+
+/**
+ * A utility function that sends a client the data it has not received yet.
+ *
+ * A client that fell behind the oldest data held by the ring is handled
+ * according to the slow client policy.
+ *
+ * @return false if the client was terminated.
+ */
+static bool flush_client(struct ClientNode *node)
+{
+    if (node->raw)
+        return flush_raw_client(node);
+
+    if (bcast_reader_overrun(&g_ring, &node->rx)) {
+        /* A UDP endpoint has no connection to drop */
+        if ((g_config.slow_client_policy == SLOW_CLIENT_DROP_CLIENT) &&
+            !node->udp) {
+            status("Client %d cannot keep up", node->id);
+            terminate_client(node);
+            return false;
+        }
+
+        count_dropped(node, bcast_reader_skip_to_tail(&g_ring, &node->rx));
+    }
+
+    bool alive = node->udp ? transmit_datagrams(node) : transmit_client(node);
+
+    /* Frames held back by the rates are due even if nothing else comes */
+    if (alive && node->rx.held_due_ns && !client_pending(node))
+        arm_rate_timer(node->rx.held_due_ns);
+
+    return alive;
+}
+
+/**
+ * A utility function that issues the sends still queued before the ring is
+ * written to, as they reference its bytes.
+ */
+static void prepare_ring_write(void)
+{
+#ifdef CONFIG_IO_URING
+    if (io_uring_sq_ready(&g_uring))
+        io_uring_submit(&g_uring);
+#endif
+}
+
+/**
+ * A utility function that sends the ring-based clients the frames just added
+ * to the ring.
+ */
+static void flush_clients(void)
+{
+    struct ClientNode *current = g_clients;
+
+    while (current) {
+        struct ClientNode *next = current->next;
+        if (!current->raw)
+            flush_client(current);
+        current = next;
+    }
+}
+
+/**
+ * A utility function that sends the clients the frames held back by their
+ * rates once the timer set by `arm_rate_timer()` expires.
+ */
+static void send_held_frames(void)
+{
+    uint64_t expirations;
+
+    if (read(g_rate_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    g_rate_due_ns = 0;
+    flush_clients();
+}
+
+/**
+ * A utility function that returns how many bytes may be read from the serial
+ * port. With the stall policy this is never more than the slowest client can
+ * take without being overrun.
+ */
+static size_t serial_read_budget(void)
+{
+    size_t budget = sizeof(g_cache);
+
+    if (g_config.slow_client_policy != SLOW_CLIENT_STALL)
+        return budget;
+
+    for (struct ClientNode *node = g_clients; node; node = node->next) {
+        size_t space;
+
+        if (node->raw) {
+            space = node->pipe_size - node->pipe_pending;
+        } else {
+            /* The read may complete a frame started by an earlier one */
+            space = bcast_reader_space(&g_ring, &node->rx);
+            space = space > BCAST_FRAME_MAX ? space - BCAST_FRAME_MAX : 0;
+        }
+
+        if (space < budget)
+            budget = space;
+    }
+
+    return budget;
+}
+
+/**
+ * A utility function that feeds the latest serial chunk to the raw clients.
+ */
+static void feed_raw_clients(size_t len)
+{
+    struct ClientNode *current, *next;
+
+    for (current = g_clients; current; current = next) {
+        next = current->next;
+        if (current->raw)
+            queue_raw_client(current, len);
+    }
+}
+
+/**
+ * A utility function that reads the serial port into `g_cache` and feeds the
+ * raw clients.
+ *
+ * While raw clients are connected, the data is spliced into a staging pipe
+ * and duplicated into every raw client's pipe with tee(), so it reaches their
+ * sockets without passing through user space. A single copy is still read
+ * out of the staging pipe for the MAVLink parser and the other clients.
+ */
+static long read_serial(serial_t sport, size_t rsize)
+{
+    long rbytes;
+
+    if (g_raw_clients && g_raw_splice) {
+        rbytes = splice(sport, NULL, g_raw_pipe[1], NULL, rsize,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if ((rbytes < 0) && (errno == EINVAL)) {
+            status("Serial port cannot be spliced, copying for raw clients");
+            g_raw_splice = false;
+        } else if (rbytes <= 0) {
+            return rbytes;
+        } else {
+            feed_raw_clients((size_t) rbytes);
+            return read(g_raw_pipe[0], g_cache, (size_t) rbytes);
+        }
+    }
+
+    rbytes = serial_read(sport, g_cache, rsize);
+
+    if ((rbytes > 0) && g_raw_clients)
+        feed_raw_clients((size_t) rbytes);
+
+    return rbytes;
+}
+
+/**
+ * A utility function that adds a frame read from the serial port to the
+ * ring, for the client behind its target or for all of them. Written once,
+ * every client sends it from its own cursor.
+ */
+static void broadcast_frame(const struct mavlink_frame_view *frame)
+{
+    if (frame->status == MAVLINK_FRAME_OK)
+        mavlink_router_learn(frame->sysid, frame->compid,
+                             MAVLINK_ROUTE_SERIAL);
+
+    int dest = mavlink_router_dest(frame->msgid, frame->payload,
+                                   frame->payload_len, MAVLINK_ROUTE_SERIAL);
+
+    /* Frames for the server itself are queued for its handlers already */
+    if ((dest == MAVLINK_ROUTE_NONE) || (dest == MAVLINK_ROUTE_LOCAL))
+        return;
+
+    bcast_ring_write(&g_ring, frame->data, frame->len, frame->msgid,
+                     frame->sysid, frame->compid, MAVLINK_ROUTE_SERIAL, dest);
+}
+
+/**
+ * A utility function that adds a frame generated by the server to the ring.
+ */
+static void broadcast_local_frame(const struct mavlink_routed_frame *frame)
+{
+    bcast_ring_write(&g_ring, frame->data, frame->len, frame->msgid,
+                     frame->sysid, frame->compid, MAVLINK_ROUTE_LOCAL,
+                     frame->dest);
+}
+
+/**
+ * A utility function that sends the clients the frames generated by the
+ * server on other threads, see `mavlink_send_msg()`.
+ */
+static void route_local_frames(void)
+{
+    prepare_ring_write();
+    mavlink_router_drain(broadcast_local_frame);
+    flush_clients();
+}
+
+/**
+ * A utility function that hands a chunk of serial data to the MAVLink parser
+ * and the ring-based clients. Only whole frames reach the clients, anything
+ * else read from the serial port is dropped.
+ */
+static void process_serial_data(unsigned char *data,
+                                size_t len,
+                                bool redundant)
+{
+    prepare_ring_write();
+
+    if (redundant)
+        read_redundant_mavlink_msg(data, len, broadcast_frame);
+    else
+        read_mavlink_msg(data, len, broadcast_frame);
+
+    flush_clients();
+}
+
+/**
+ * A utility function that routes a frame received from a client. Frames for
+ * the serial port go through the uplink policy, frames for other clients
+ * through the ring with the client as their source, and frames for the
+ * components of the server, broadcasts included, straight to its handlers.
+ */
+static void route_client_frame(const struct mavlink_frame_view *frame,
+                               void *ctx)
+{
+    struct ClientNode *node = (struct ClientNode *) ctx;
+    int endpoint = client_endpoint(node);
+
+    if (frame->status == MAVLINK_FRAME_BAD_CRC) {
+        node->rx_bad_crc++;
+        return;
+    }
+
+    /* A raw client is fed the serial port as it is, nothing can be routed to
+     * it */
+    if ((frame->status == MAVLINK_FRAME_OK) && !node->raw)
+        mavlink_router_learn(frame->sysid, frame->compid, endpoint);
+
+    int dest = mavlink_router_dest(frame->msgid, frame->payload,
+                                   frame->payload_len, endpoint);
+
+    if (dest == MAVLINK_ROUTE_NONE)
+        return;
+
+    /* Everywhere but where it came from includes the server itself */
+    if (((dest == MAVLINK_ROUTE_LOCAL) || (dest == MAVLINK_ROUTE_ALL)) &&
+        (frame->status == MAVLINK_FRAME_OK) &&
+        mavlink_has_handler(frame->msgid))
+        mavlink_worker_push(frame);
+
+    if (dest == MAVLINK_ROUTE_LOCAL)
+        return;
+
+    if ((dest == MAVLINK_ROUTE_SERIAL) || (dest == MAVLINK_ROUTE_ALL)) {
+        if (g_config.uplink_policy == UPLINK_MERGE)
+            uplink_feed(&node->merge, frame);
+        else
+            serial_tx_send(SERIAL_TX_BULK, frame->data, frame->len);
+    }
+
+    if (dest != MAVLINK_ROUTE_SERIAL)
+        bcast_ring_write(&g_ring, frame->data, frame->len, frame->msgid,
+                         frame->sysid, frame->compid, endpoint, dest);
+}
+
+/**
+ * A utility function that handles data received from a client. Only whole
+ * MAVLink frames are routed, anything else is dropped.
+ *
+ * With the commander policy, only the commanding client (the head of the
+ * clients list) may send, anything sent by the others is discarded. Its
+ * frames for the serial port are queued behind the server's own acks and
+ * heartbeats.
+ *
+ * With the merge policy, every client's frames for the serial port are
+ * merged in turn, see `uplink_flush()`.
+ */
+static void handle_client_data(struct ClientNode *node,
+                               const unsigned char *data,
+                               size_t len)
+{
+    uint64_t frames = g_ring.frame_head;
+
+    if ((g_config.uplink_policy == UPLINK_COMMANDER) && (node != g_clients))
+        return;
+
+    prepare_ring_write();
+    mavlink_scan(&node->scanner, data, len, route_client_frame, node);
+
+    if (g_config.uplink_policy == UPLINK_MERGE)
+        uplink_flush();
+
+    if (g_ring.frame_head != frames)
+        flush_clients();
+}
+
+/**
+ * A utility function that puts a UDP endpoint on the clients list once its
+ * peer is known. From then on it is served like any connected client.
+ */
+static void activate_udp_client(struct ClientNode *node)
+{
+    status("Serving UDP peer %s:%u on client ID %d", node->addr, node->port,
+           node->id);
+
+    bcast_reader_attach(&g_ring, &node->rx, NULL, node->udp_rates,
+                        client_shed(), client_endpoint(node));
+    append_client(node);
+}
+
+/**
+ * A utility function that makes the sender of a datagram the peer of a UDP
+ * endpoint in server mode. The first datagram connects the peer, a later one
+ * from another address takes its place, e.g. when a GCS is restarted.
+ */
+static void learn_udp_peer(struct ClientNode *node,
+                           const struct sockaddr_storage *from,
+                           socklen_t len)
+{
+    if ((len == node->peer_len) && (memcmp(from, &node->peer, len) == 0))
+        return;
+
+    memcpy(&node->peer, from, len);
+    node->peer_len = len;
+    sockaddr_to_string(&node->peer, node->addr, &node->port);
+
+    if (node->pprev)
+        status("Client %d moved to %s:%u", node->id, node->addr, node->port);
+    else
+        activate_udp_client(node);
+}
+
+/**
+ * A utility function that drains the datagrams received by a UDP endpoint,
+ * reading a batch per recvmmsg().
+ */
+static void recv_datagrams(struct ClientNode *node)
+{
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iov[UDP_RECV_BATCH];
+    struct sockaddr_storage from[UDP_RECV_BATCH];
+
+    for (;;) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_RECV_BATCH; i++) {
+            iov[i].iov_base = g_dgram_bufs[i];
+            iov[i].iov_len = UDP_DATAGRAM_MAX;
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg(node->client, msgs, UDP_RECV_BATCH, MSG_DONTWAIT,
+                             NULL);
+
+        if (count < 0) {
+            /* An ICMP error for an earlier send, the peer may come back */
+            if ((errno == EINTR) || (errno == ECONNREFUSED))
+                continue;
+
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (node->udp_learn)
+                learn_udp_peer(node, &from[i], msgs[i].msg_hdr.msg_namelen);
+
+            if (node->pprev)
+                handle_client_data(node, g_dgram_bufs[i], msgs[i].msg_len);
+        }
+
+        if (count < UDP_RECV_BATCH)
+            return;
+    }
+}
+
+/**
+ * A utility function that reads the redundant serial port until it runs dry.
+ * Like the port's, its reads never overrun a stalled client.
+ */
+static void read_redundant_port(void)
+{
+    if ((g_redundant == SERIAL_INVALID_FD) || g_serial_paused)
+        return;
+
+    for (;;) {
+        size_t rsize = serial_read_budget();
+
+        /* Stop reading until the stalled clients drain or leave */
+        if (rsize == 0) {
+            pause_serial(true);
+            return;
+        }
+
+        if (rsize > sizeof(g_redundant_cache))
+            rsize = sizeof(g_redundant_cache);
+
+        long rbytes = serial_read(g_redundant, g_redundant_cache, rsize);
+
+        if (rbytes <= 0)
+            return;
+
+        process_serial_data(g_redundant_cache, (size_t) rbytes, true);
+
+        if ((size_t) rbytes < rsize)
+            return;
+    }
+}
+
+/**
+ * A utility function that gives up on the redundant serial port after an
+ * error. The link goes on with its other port.
+ */
+static void close_redundant_port(void)
+{
+    error("Lost the redundant serial port of link %d", serial_link_id());
+
+#ifdef CONFIG_IO_URING
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_CANCEL, NULL);
+
+    io_uring_prep_cancel_fd(sqe, g_redundant, IORING_ASYNC_CANCEL_ALL);
+
+    /* Make sure the cancellation is issued before the fd is closed */
+    io_uring_submit(&g_uring);
+#else
+    epoll_ctl(g_epoll, EPOLL_CTL_DEL, g_redundant, NULL);
+#endif
+
+    serial_close(g_redundant);
+    g_redundant = SERIAL_INVALID_FD;
+}
+
+#ifndef CONFIG_IO_URING
+/**
+ * A utility function that handles serial receive events.
+ */
+static void send_data_to_clients(serial_t sport)
+{
+    size_t rsize = serial_read_budget();
+
+    /* Stop reading until the stalled clients drain or leave */
+    if (rsize == 0) {
+        pause_serial(true);
+        return;
+    }
+
+    long rbytes = read_serial(sport, rsize);
+
+    if (rbytes <= 0)
+        return;
+
+    process_serial_data(g_cache, (size_t) rbytes, false);
+}
+
+/**
+ * A utility function that reads from a client. Anything read is drained so
+ * that the socket does not keep reporting readiness.
+ */
+static void recv_client_data(struct ClientNode *node)
+{
+    long rbytes = recv(node->client, (char *) g_cache, sizeof(g_cache), 0);
+
+    if (rbytes == 0) {
+        terminate_client(node);
+        return;
+    }
+
+    if (rbytes < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            terminate_client(node);
+
+        return;
+    }
+
+    handle_client_data(node, g_cache, (size_t) rbytes);
+}
+
+/**
+ * A utility function that dispatches an event reported for a client socket.
+ */
+static void handle_client_event(struct ClientNode *node, uint32_t events)
+{
+    /* Already terminated earlier in this batch of events */
+    if (node->client == INVALID_SOCKET)
+        return;
+
+    if ((events & EPOLLOUT) && !flush_client(node))
+        return;
+
+    /* Errors of a UDP socket are ICMP reports for earlier sends, reading
+     * clears them */
+    if (node->udp) {
+        if (events & (EPOLLIN | EPOLLERR))
+            recv_datagrams(node);
+        return;
+    }
+
+    /* Drain whatever is still readable before honoring a hang up, the peer
+     * may have sent its last commands right before closing */
+    if (events & EPOLLIN)
+        recv_client_data(node);
+
+    if ((events & EVENT_HANGUP) && (node->client != INVALID_SOCKET))
+        terminate_client(node);
+}
+#endif
+
+/* Pipe ends used to signal that we should gracefully shut down on POSIX systems
+ */
+static int g_close[2] = {-1, -1};
+
+/* Only wakes up the event loops, `run_uart_server()` then shuts down every
+ * link and prints their statistics before it exits */
+static void sig_handler(int sig)
+{
+    switch (sig) {
+    case SIGINT:
+    case SIGABRT:
+    case SIGTERM: {
+        char b = '\0';
+        write(g_close[1], &b, 1);
+    } break;
+    default:
+        break;
+    }
+}
+
+/**
+ * A utility function that opens a socket bound to the given port. IPv4 and
+ * IPv6 peers are served by a single dual-stack socket, unless the host has no
+ * IPv6 support.
+ */
+static Socket open_socket(int type, unsigned port)
+{
+    const char *proto = type == SOCK_STREAM ? "TCP" : "UDP";
+    Socket server = socket(AF_INET6, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_storage bind_addr;
+    socklen_t bind_len;
+
+    memset(&bind_addr, 0, sizeof(bind_addr));
+
+    if (server != INVALID_SOCKET) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &bind_addr;
+        int v6only = 0;
+
+        if (setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+                       sizeof(v6only)) != 0) {
+            error("Failed to accept IPv4 %s peers on port %u", proto, port);
+        }
+
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons(port);
+        bind_len = sizeof(*in6);
+    } else if ((server = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                0)) != INVALID_SOCKET) {
+        struct sockaddr_in *in = (struct sockaddr_in *) &bind_addr;
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        bind_len = sizeof(*in);
+    } else {
+        error("Failed to open a %s socket", proto);
+        return INVALID_SOCKET;
+    }
+
+    if (bind(server, (struct sockaddr *) &bind_addr, bind_len) != 0) {
+        error("Failed to bind to %s port %u", proto, port);
+        closesocket(server);
+        return INVALID_SOCKET;
+    }
+
+    return server;
+}
+
+/**
+ * A utility function that opens a TCP socket listening on the given port.
+ */
+static Socket open_listener(unsigned port)
+{
+    Socket server = open_socket(SOCK_STREAM, port);
+
+    if (server == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    if (listen(server, g_config.listen_backlog) != 0) {
+        error("Failed to start TCP listen");
+        closesocket(server);
+        return INVALID_SOCKET;
+    }
+
+    return server;
+}
+
+/**
+ * A utility function that resolves the "host:port" peer of a UDP endpoint to
+ * an address of the socket's family. IPv6 hosts may be put in brackets.
+ */
+static bool resolve_udp_peer(Socket fd,
+                             const char *peer,
+                             struct sockaddr_storage *addr,
+                             socklen_t *addr_len)
+{
+    const char *sep = strrchr(peer, ':');
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    struct addrinfo hints, *res;
+    char host[256];
+
+    if (!sep || (sep == peer) || ((size_t) (sep - peer) >= sizeof(host))) {
+        error("UDP peer %s must be given as host:port", peer);
+        return false;
+    }
+
+    if ((peer[0] == '[') && (sep[-1] == ']')) {
+        memcpy(host, peer + 1, sep - peer - 2);
+        host[sep - peer - 2] = '\0';
+    } else {
+        memcpy(host, peer, sep - peer);
+        host[sep - peer] = '\0';
+    }
+
+    if (getsockname(fd, (struct sockaddr *) &local, &local_len) != 0)
+        return false;
+
+    /* IPv4 peers of a dual-stack socket are IPv4-mapped */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = local.ss_family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = local.ss_family == AF_INET6 ? AI_V4MAPPED : 0;
+
+    int ret = getaddrinfo(host, sep + 1, &hints, &res);
+    if (ret != 0) {
+        error("Failed to resolve UDP peer %s: %s", peer, gai_strerror(ret));
+        return false;
+    }
+
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return true;
+}
+
+/**
+ * A utility function that opens a UDP endpoint. Its client is set up right
+ * away and stays until the server shuts down, only its peer may change.
+ */
+static struct ClientNode *open_udp_endpoint(
+    const struct server_udp_endpoint *cfg)
+{
+    Socket fd = open_socket(SOCK_DGRAM, cfg->port);
+
+    if (fd == INVALID_SOCKET)
+        return NULL;
+
+    struct ClientNode *node = alloc_client_slot();
+
+    if (!node) {
+        error("No client slot left for UDP port %d", cfg->port);
+        closesocket(fd);
+        return NULL;
+    }
+
+    node->source.type = EVENT_CLIENT;
+    node->client = fd;
+    node->pipe[0] = node->pipe[1] = -1;
+    node->udp = true;
+    node->udp_learn = cfg->peer[0] == '\0';
+    node->udp_rates = &cfg->rates;
+    uplink_source_init(&node->merge, cfg->uplink_weight);
+
+    if (node->udp_learn)
+        return node;
+
+    /* The peer may be a broadcast address */
+    int broadcast = 1;
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
+
+    if (!resolve_udp_peer(fd, cfg->peer, &node->peer, &node->peer_len)) {
+        closesocket(fd);
+        free_client_slot(node);
+        return NULL;
+    }
+
+    sockaddr_to_string(&node->peer, node->addr, &node->port);
+
+    return node;
+}
+
+/**
+ * A utility function that starts serving the UDP endpoints once the event
+ * loop is set up. Endpoints with a set peer join the clients list right
+ * away, the others when their first datagram arrives.
+ */
+static bool start_udp_endpoints(void)
+{
+    for (int i = 0; i < SERVER_UDP_MAX; i++) {
+        if (!g_udp[i])
+            continue;
+
+        if (!watch_client(g_udp[i]))
+            return false;
+
+        if (g_udp[i]->peer_len)
+            activate_udp_client(g_udp[i]);
+    }
+
+    return true;
+}
+
+void read_user_cmd(serial_t sport)
+{
+    /* Read user command from the FIFO */
+    static int received = 0;
+    mavlink_cmd user_cmd;
+    int rsize = read(cmd_fifo_r, (char *) &user_cmd + received,
+                     sizeof(mavlink_cmd) - received);
+    received += rsize;
+
+    /* read complete */
+    if (received == sizeof(user_cmd)) {
+        received = 0;  // Reset
+
+        /* Select an action */
+        switch (user_cmd.type) {
+        case PLAY_TUNE_CMD:
+            mavlink_send_play_tune(user_cmd.arg[0], sport);
+            break;
+        }
+    }
+}
+
+/**
+ * A utility function that prints how the redundant ports of the link did.
+ * Lag is how long after the other port's copy a dropped copy came in.
+ */
+static void print_redundancy_stats(void)
+{
+    struct link_dedup stats;
+
+    if (!get_redundancy_stats(&stats))
+        return;
+
+    for (int port = 0; port < LINK_DEDUP_PORTS; port++) {
+        struct link_dedup_port_stats *ps = &stats.ports[port];
+
+        status(
+            "Link %d %s port: %lu frames, %lu first, %lu lost, lag avg %lu "
+            "us, max %lu us",
+            serial_link_id(), port ? "redundant" : "main", ps->frames,
+            ps->first, stats.ports_seq[port].lost,
+            ps->duplicates ? (unsigned long) (ps->lag_sum_us / ps->duplicates)
+                           : 0UL,
+            (unsigned long) ps->lag_max_us);
+    }
+
+    status("Link %d merged: %lu frames forwarded, %lu lost on both ports",
+           serial_link_id(), stats.forwarded, stats.merged_seq.lost);
+}
+
+/**
+ * A utility function that prints the traffic of the link since it started.
+ */
+static void print_traffic_stats(void)
+{
+    struct traffic_stats *stats = malloc(sizeof(*stats));
+
+    if (stats && traffic_stats_snapshot(serial_link_id(), stats))
+        traffic_stats_print(serial_link_id(), NULL, stats);
+    free(stats);
+}
+
+/**
+ * A utility function that prints how often the message handlers ran and how
+ * long they took, on every link together.
+ */
+static void print_handler_stats(void)
+{
+    struct mavlink_handler_stats stats[64];
+    size_t count = mavlink_get_handler_stats(
+        stats, sizeof(stats) / sizeof(struct mavlink_handler_stats));
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t avg = stats[i].calls ? stats[i].time_ns / stats[i].calls : 0;
+
+        status("Handler %zu of message #%u: %lu calls, avg %lu ns", i,
+               stats[i].msgid, (unsigned long) stats[i].calls,
+               (unsigned long) avg);
+    }
+}
+
+/**
+ * A utility function that prints the serial writer queue statistics.
+ */
+static void print_serial_tx_stats(void)
+{
+    struct serial_tx_stats stats[SERIAL_TX_LANES];
+
+    serial_tx_get_stats(stats);
+
+    for (int lane = 0; lane < SERIAL_TX_LANES; lane++) {
+        status(
+            "Serial TX %s lane of link %d: %lu frames sent, %lu dropped, %zu "
+            "queued, latency avg %lu us, max %lu us",
+            serial_tx_lane_name(lane), serial_link_id(),
+            (unsigned long) stats[lane].sent,
+            (unsigned long) stats[lane].dropped, stats[lane].depth,
+            (unsigned long) stats[lane].latency_avg_us,
+            (unsigned long) stats[lane].latency_max_us);
+    }
+
+    struct serial_write_stats wstats;
+    serial_tx_get_write_stats(&wstats);
+
+    status(
+        "Serial writes of link %d: %lu stalls, %lu partial writes, %lu bytes "
+        "dropped",
+        serial_link_id(), wstats.stalls, wstats.partial_writes,
+        wstats.dropped_bytes);
+}
+
+/**
+ * A utility function that prints how the handler thread of the link kept up
+ * with the messages queued for it.
+ */
+static void print_worker_stats(void)
+{
+    struct mavlink_worker_stats stats;
+
+    mavlink_worker_get_stats(&stats);
+
+    status(
+        "Message handlers of link %d: %lu frames handled, %lu dropped, %zu "
+        "queued (%zu at most), latency avg %lu us, max %lu us",
+        serial_link_id(), (unsigned long) stats.handled,
+        (unsigned long) stats.overflows, stats.depth, stats.depth_max,
+        (unsigned long) stats.latency_avg_us,
+        (unsigned long) stats.latency_max_us);
+}
+
+/**
+ * A utility function that runs the housekeeping due after every batch of
+ * events.
+ */
+static void finish_event_batch(void)
+{
+    reap_clients();
+
+    /* Resume serial reads once the stalled clients drained or left */
+    if (g_serial_paused && serial_read_budget())
+        pause_serial(false);
+
+    /* The serial writer may have made room for the frames left queued, the
+     * serial port keeps the event loop busy enough to pick them up here */
+    if (g_config.uplink_policy == UPLINK_MERGE) {
+        uplink_flush();
+        return;
+    }
+
+    /* Check if there is a new commanding client */
+    if ((g_clients) && (g_commanding_client != g_clients->id)) {
+        g_commanding_client = g_clients->id;
+
+        status("Client %d @ %s:%u is now in command of the serial port",
+               g_clients->id, g_clients->addr, g_clients->port);
+    }
+}
+
+#ifdef CONFIG_IO_URING
+/**
+ * A utility function that watches a fixed source for POLLIN.
+ */
+static void uring_poll_source(struct EventSource *source)
+{
+    int fd = source == &g_close_source       ? g_close[0]
+             : source == &g_serial_source    ? serial
+             : source == &g_redundant_source ? g_redundant
+             : source == &g_route_source     ? g_route_fd
+             : source == &g_rate_source      ? g_rate_fd
+                                             : cmd_fifo_r;
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_POLL, source);
+
+    io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+}
+
+/**
+ * A utility function that accepts connections on a listener.
+ */
+static void uring_accept(struct Listener *listener)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_ACCEPT, listener);
+
+    io_uring_prep_multishot_accept(sqe, listener->fd, NULL, NULL,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+static void uring_read_serial(void)
+{
+    if (g_serial_reading || g_serial_paused)
+        return;
+
+    size_t rsize = serial_read_budget();
+
+    /* Stop reading until the stalled clients drain or leave */
+    if (rsize == 0) {
+        pause_serial(true);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(URING_OP_READ, &g_serial_source);
+
+    io_uring_prep_read_fixed(sqe, serial, g_cache, rsize, (uint64_t) -1, 0);
+    g_serial_reading = true;
+}
+
+/**
+ * A utility function that hands a provided receive buffer back to the
+ * kernel.
+ */
+static void uring_recycle_recv_buf(unsigned short bid)
+{
+    io_uring_buf_ring_add(g_recv_ring, g_recv_bufs[bid], URING_RECV_BUF_SIZE,
+                          bid, io_uring_buf_ring_mask(URING_RECV_BUFS), 0);
+    io_uring_buf_ring_advance(g_recv_ring, 1);
+}
+
+static bool setup_event_loop(void)
+{
+    struct iovec cache = {.iov_base = g_cache, .iov_len = sizeof(g_cache)};
+    int ret;
+
+    if ((ret = io_uring_queue_init(URING_ENTRIES, &g_uring, 0)) < 0) {
+        error("Failed to create io_uring: %s", strerror(-ret));
+        return false;
+    }
+
+    /* Serial reads land in a registered buffer, saving the page pinning on
+     * every read */
+    if ((ret = io_uring_register_buffers(&g_uring, &cache, 1)) < 0) {
+        error("Failed to register the serial buffer: %s", strerror(-ret));
+        return false;
+    }
+
+    g_recv_bufs = calloc(URING_RECV_BUFS, URING_RECV_BUF_SIZE);
+    if (!g_recv_bufs) {
+        error("Failed to allocate client receive buffers");
+        return false;
+    }
+
+    g_recv_ring = io_uring_setup_buf_ring(&g_uring, URING_RECV_BUFS,
+                                          URING_RECV_BGID, 0, &ret);
+    if (!g_recv_ring) {
+        error("Failed to set up client receive buffers: %s", strerror(-ret));
+        return false;
+    }
+
+    for (unsigned short bid = 0; bid < URING_RECV_BUFS; bid++) {
+        io_uring_buf_ring_add(g_recv_ring, g_recv_bufs[bid],
+                              URING_RECV_BUF_SIZE, bid,
+                              io_uring_buf_ring_mask(URING_RECV_BUFS), bid);
+    }
+    io_uring_buf_ring_advance(g_recv_ring, URING_RECV_BUFS);
+
+    /* Serial data lands in `g_cache`, raw clients are fed from there */
+    g_raw_splice = false;
+
+    uring_poll_source(&g_close_source);
+    uring_poll_source(&g_serial_source);
+    if (g_redundant != SERIAL_INVALID_FD)
+        uring_poll_source(&g_redundant_source);
+    if (serial_link_id() == 0)
+        uring_poll_source(&g_user_cmd_source);
+    uring_poll_source(&g_route_source);
+    uring_poll_source(&g_rate_source);
+
+    uring_accept(&g_listener);
+    if (g_raw_listener.fd != INVALID_SOCKET)
+        uring_accept(&g_raw_listener);
+
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        if (g_endpoints[i].fd != INVALID_SOCKET)
+            uring_accept(&g_endpoints[i]);
+    }
+
+    return start_udp_endpoints();
+}
+
+static void teardown_event_loop(void)
+{
+    io_uring_free_buf_ring(&g_uring, g_recv_ring, URING_RECV_BUFS,
+                           URING_RECV_BGID);
+    io_uring_queue_exit(&g_uring);
+    free(g_recv_bufs);
+    g_recv_bufs = NULL;
+}
+
+/**
+ * A utility function that handles one completion.
+ *
+ * @return -1 to keep serving, an exit code otherwise.
+ */
+static int handle_completion(const struct io_uring_cqe *cqe,
+                             const char *serial_path)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    enum UringOp op = (enum UringOp) (data >> 56);
+    void *source = (void *) (uintptr_t) (data & ((1ULL << 56) - 1));
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    int res = cqe->res;
+
+    switch (op) {
+    case URING_OP_POLL: {
+        struct EventSource *fixed = source;
+
+        if (fixed->type == EVENT_CLOSE)
+            return EXIT_SUCCESS;
+
+        if (fixed->type == EVENT_SERIAL) {
+            if ((res > 0) && (res & POLLIN)) {
+                uring_read_serial();
+            } else if ((res < 0) || (res & (POLLHUP | POLLERR))) {
+                error("Lost the serial port %s", serial_path);
+                return EXIT_FAILURE;
+            }
+        } else if (fixed->type == EVENT_REDUNDANT) {
+            if (g_redundant == SERIAL_INVALID_FD)
+                break;
+
+            if ((res > 0) && (res & POLLIN)) {
+                read_redundant_port();
+            } else if ((res < 0) || (res & (POLLHUP | POLLERR))) {
+                close_redundant_port();
+                break;
+            }
+        } else if (fixed->type == EVENT_USER_CMD) {
+            /* Event of receiving user commands */
+            read_user_cmd(serial);
+        } else if (fixed->type == EVENT_ROUTE) {
+            route_local_frames();
+        } else if (fixed->type == EVENT_RATE) {
+            send_held_frames();
+        }
+
+        if (!more)
+            uring_poll_source(fixed);
+        break;
+    }
+    case URING_OP_READ:
+        g_serial_reading = false;
+
+        if (res > 0) {
+            if (g_raw_clients)
+                feed_raw_clients((size_t) res);
+            process_serial_data(g_cache, (size_t) res, false);
+
+            /* Keep reading until the port runs dry, the poll only reports
+             * new arrivals */
+            uring_read_serial();
+        } else if ((res < 0) && (res != -EAGAIN) && (res != -EINTR)) {
+            error("Failed to read the serial port %s: %s", serial_path,
+                  strerror(-res));
+            return EXIT_FAILURE;
+        }
+        break;
+    case URING_OP_ACCEPT: {
+        struct Listener *listener = source;
+
+        if (res >= 0) {
+            struct sockaddr_storage remote;
+            socklen_t remlen = sizeof(remote);
+
+            if (getpeername(res, (struct sockaddr *) &remote, &remlen) == 0)
+                add_client(listener, res, &remote);
+            else
+                closesocket(res);
+        }
+
+        if (!more)
+            uring_accept(listener);
+        break;
+    }
+    case URING_OP_RECV: {
+        struct ClientNode *node = source;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if ((res > 0) && (node->client != INVALID_SOCKET))
+                handle_client_data(node, g_recv_bufs[bid], (size_t) res);
+            uring_recycle_recv_buf(bid);
+        }
+
+        if (!more)
+            node->uring_inflight--;
+
+        /* Already terminated */
+        if (node->client == INVALID_SOCKET)
+            break;
+
+        if ((res == 0) || ((res < 0) && (res != -ENOBUFS)))
+            terminate_client(node);
+        else if (!more)
+            watch_client(node);
+        break;
+    }
+    case URING_OP_SEND: {
+        struct ClientNode *node = source;
+
+        node->uring_inflight--;
+        node->send_inflight = false;
+
+        if (node->client == INVALID_SOCKET)
+            break;
+
+        if (res >= 0) {
+            complete_send(node, &node->tx_batch, (size_t) res);
+            flush_client(node);
+        } else if (res == -EAGAIN) {
+            watch_client_writable(node, true);
+        } else {
+            terminate_client(node);
+        }
+        break;
+    }
+    case URING_OP_POLLOUT: {
+        struct ClientNode *node = source;
+
+        node->uring_inflight--;
+        node->want_write = false;
+
+        if (node->client != INVALID_SOCKET)
+            flush_client(node);
+        break;
+    }
+    case URING_OP_POLLIN: {
+        struct ClientNode *node = source;
+
+        if (!more)
+            node->uring_inflight--;
+
+        if (node->client == INVALID_SOCKET)
+            break;
+
+        recv_datagrams(node);
+        if (!more)
+            watch_client(node);
+        break;
+    }
+    case URING_OP_CANCEL:
+    default:
+        break;
+    }
+
+    return -1;
+}
+
+/**
+ * The io_uring event loop. Everything queued while handling a batch of
+ * completions is submitted together with the wait for the next one.
+ */
+static int run_event_loop(const char *serial_path)
+{
+    for (;;) {
+        struct io_uring_cqe *cqe;
+        unsigned head, count = 0;
+        int result = io_uring_submit_and_wait(&g_uring, 1);
+
+        if (result < 0) {
+            if (result == -EINTR)
+                continue;
+
+            error("Failed to wait on event: %d (%s)", -result,
+                  strerror(-result));
+            return EXIT_FAILURE;
+        }
+
+        io_uring_for_each_cqe(&g_uring, head, cqe)
+        {
+            count++;
+
+            int ret_val = handle_completion(cqe, serial_path);
+            if (ret_val >= 0) {
+                io_uring_cq_advance(&g_uring, count);
+                return ret_val;
+            }
+        }
+
+        io_uring_cq_advance(&g_uring, count);
+        finish_event_batch();
+    }
+}
+#else
+static bool setup_event_loop(void)
+{
+    if ((g_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        error("Failed to create event loop: %s", strerror(errno));
+        return false;
+    }
+
+    if (!watch_fd(g_close[0], EPOLLIN, &g_close_source) ||
+        !watch_fd(serial, EPOLLIN, &g_serial_source) ||
+        !watch_fd(g_route_fd, EPOLLIN, &g_route_source) ||
+        !watch_fd(g_rate_fd, EPOLLIN, &g_rate_source) ||
+        !watch_fd(g_listener.fd, EPOLLIN, &g_listener.source))
+        return false;
+
+    if ((g_redundant != SERIAL_INVALID_FD) &&
+        !watch_fd(g_redundant, EPOLLIN, &g_redundant_source))
+        return false;
+
+    /* User commands are for the flight controller of link 0 */
+    if ((serial_link_id() == 0) &&
+        !watch_fd(cmd_fifo_r, EPOLLIN, &g_user_cmd_source))
+        return false;
+
+    if ((g_raw_listener.fd != INVALID_SOCKET) &&
+        !watch_fd(g_raw_listener.fd, EPOLLIN, &g_raw_listener.source))
+        return false;
+
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        if ((g_endpoints[i].fd != INVALID_SOCKET) &&
+            !watch_fd(g_endpoints[i].fd, EPOLLIN, &g_endpoints[i].source))
+            return false;
+    }
+
+    return start_udp_endpoints();
+}
+
+static void teardown_event_loop(void)
+{
+    close(g_epoll);
+    g_epoll = -1;
+}
+
+/**
+ * The epoll event loop.
+ */
+static int run_event_loop(const char *serial_path)
+{
+    for (;;) {
+        struct epoll_event events[EVENT_BATCH_MAX];
+        int result = epoll_wait(g_epoll, events, EVENT_BATCH_MAX, -1);
+
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+
+            error("Failed to wait on event: %d (%s)", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < result; i++) {
+            struct EventSource *source = events[i].data.ptr;
+            uint32_t revents = events[i].events;
+
+            switch (source->type) {
+            case EVENT_CLOSE:
+                /* Exit with 0 exit code on graceful shut down */
+                return EXIT_SUCCESS;
+            case EVENT_SERIAL:
+                if (revents & EPOLLIN) {
+                    send_data_to_clients(serial);
+                } else if (revents & (EPOLLHUP | EPOLLERR)) {
+                    error("Lost the serial port %s", serial_path);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case EVENT_REDUNDANT:
+                if (revents & EPOLLIN)
+                    read_redundant_port();
+                else if (revents & (EPOLLHUP | EPOLLERR))
+                    close_redundant_port();
+                break;
+            case EVENT_SERVER:
+                accept_clients((struct Listener *) source);
+                break;
+            case EVENT_USER_CMD:
+                /* Event of receiving user commands */
+                read_user_cmd(serial);
+                break;
+            case EVENT_CLIENT:
+                handle_client_event((struct ClientNode *) source, revents);
+                break;
+            case EVENT_ROUTE:
+                route_local_frames();
+                break;
+            case EVENT_RATE:
+                send_held_frames();
+                break;
+            }
+        }
+
+        finish_event_batch();
+    }
+}
+#endif
+
+/* Set once the reply to the current latency probe is read */
+static __thread bool g_probe_replied;
+
+static void probe_reply(const struct mavlink_frame_view *frame)
+{
+    if (frame->msgid == MAVLINK_MSG_ID_AUTOPILOT_VERSION)
+        g_probe_replied = true;
+}
+
+static long elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/**
+ * A utility function that times a few autopilot capabilities requests to
+ * tell how much the serial link delays the bytes on top of their time on the
+ * wire. A USB adapter holds received bytes back for up to its latency timer
+ * (16 ms by default on FTDI), which dwarfs the wire time at high baud rates.
+ */
+static void measure_serial_latency(const struct SerialConfig *cfg, int probes)
+{
+    long best = LONG_MAX;
+    long total = 0;
+    int replies = 0;
+
+    for (int i = 0; i < probes; i++) {
+        struct timespec start;
+        long waited;
+
+        g_probe_replied = false;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mavlink_send_request_autopilot_capabilities(serial);
+
+        while (!g_probe_replied &&
+               (waited = elapsed_us(&start)) < SERIAL_PROBE_TIMEOUT) {
+            struct pollfd pfd = {.fd = serial, .events = POLLIN};
+
+            if (poll(&pfd, 1, (SERIAL_PROBE_TIMEOUT - waited + 999) / 1000) <=
+                0)
+                continue;
+
+            long rbytes = serial_read(serial, g_cache, sizeof(g_cache));
+            if (rbytes > 0)
+                read_mavlink_msg(g_cache, rbytes, probe_reply);
+        }
+
+        if (!g_probe_replied)
+            continue;
+
+        long rtt = elapsed_us(&start);
+        best = rtt < best ? rtt : best;
+        total += rtt;
+        replies++;
+    }
+
+    if (!replies) {
+        status("Serial latency probe got no reply");
+        return;
+    }
+
+    /* 10 bits a byte with the start and stop bits */
+    long byte_time = 10000000L / cfg->baudrate;
+    long wire = SERIAL_PROBE_BYTES * byte_time;
+    long delay = best > wire ? best - wire : 0;
+
+    status(
+        "Serial round trip %ld us at best, %ld us on average over %d probes "
+        "(%ld us on the wire, %ld us a byte)",
+        best, total / replies, replies, wire, byte_time);
+
+    if ((delay > SERIAL_PROBE_SLACK) && !cfg->low_latency &&
+        !cfg->latency_timer)
+        status(
+            "The serial link adds %ld us of delay, consider setting "
+            "low-latency or latency-timer in serial.yaml",
+            delay);
+}
+
+/**
+ * A utility function that sleeps for up to `ms` milliseconds, or less if the
+ * server is shutting down.
+ *
+ * @return true if the server is shutting down.
+ */
+static bool wait_for_shutdown(int ms)
+{
+    struct pollfd pfd = {.fd = g_close[0], .events = POLLIN};
+
+    return poll(&pfd, 1, ms) > 0;
+}
+
+/**
+ * A utility function that serves the serial link of the calling thread: it
+ * opens the port, waits for the flight controller to answer and runs the
+ * event loop of the link's clients until the server shuts down.
+ *
+ * @return The exit code of the link.
+ */
+static int serve_link(const char *serial_path,
+                      const struct SerialConfig *cfg,
+                      unsigned port)
+{
+    const char *redundant_path = get_serial_redundant_port(serial_link_id());
+    int ret_val = EXIT_FAILURE;
+
+    get_server_config(&g_config);
+
+    /* Raw clients, endpoints and UDP endpoints are only served on link 0 */
+    if (serial_link_id() != 0) {
+        g_config.raw_port = 0;
+        for (int i = 0; i < SERVER_ENDPOINT_MAX; i++)
+            g_config.endpoints[i].port = 0;
+        for (int i = 0; i < SERVER_UDP_MAX; i++) {
+            g_config.udp[i].port = 0;
+            g_config.udp[i].peer = "";
+        }
+    }
+
+    g_listener.uplink_weight = g_config.uplink_weight;
+    g_listener.rates = &g_config.client_rates;
+    g_raw_listener.uplink_weight = g_config.uplink_weight;
+
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        g_endpoints[i] = (struct Listener){
+            {EVENT_SERVER},
+            INVALID_SOCKET,
+            false,
+            &g_config.endpoints[i].filter,
+            g_config.endpoints[i].uplink_weight,
+            &g_config.endpoints[i].rates};
+    }
+
+    if (!bcast_ring_init(&g_ring, g_config.client_queue_size)) {
+        error("Failed to allocate the client broadcast ring");
+        return ret_val;
+    }
+
+    if (!init_client_slots(g_config.max_clients) ||
+        !traffic_stats_link_start(cfg->baudrate, g_config.max_clients)) {
+        error("Failed to allocate the client table");
+        goto terminate;
+    }
+
+    if ((g_listener.fd = open_listener(port)) == INVALID_SOCKET)
+        goto terminate;
+
+    if (g_config.raw_port &&
+        ((g_raw_listener.fd = open_listener(g_config.raw_port)) ==
+         INVALID_SOCKET))
+        goto terminate;
+
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        if (g_config.endpoints[i].port &&
+            ((g_endpoints[i].fd = open_listener(g_config.endpoints[i].port)) ==
+             INVALID_SOCKET))
+            goto terminate;
+    }
+
+    for (int i = 0; i < SERVER_UDP_MAX; i++) {
+        if ((g_config.udp[i].port || g_config.udp[i].peer[0]) &&
+            !(g_udp[i] = open_udp_endpoint(&g_config.udp[i])))
+            goto terminate;
+    }
+
+    serial = serial_open(serial_path, cfg, SERIAL_TIMEOUT);
+
+    if (serial == SERIAL_INVALID_FD) {
+        error("Failed to open the requested serial port %s", serial_path);
+        goto terminate;
+    }
+
+    if (redundant_path[0]) {
+        g_redundant = serial_open(redundant_path, cfg, SERIAL_TIMEOUT);
+
+        if (g_redundant == SERIAL_INVALID_FD) {
+            error("Failed to open the redundant serial port %s",
+                  redundant_path);
+            goto close_serial;
+        }
+        mavlink_enable_redundancy();
+    }
+
+    if (!serial_tx_start(serial)) {
+        error("Failed to start the serial writer thread");
+        goto close_serial;
+    }
+
+    if (!mavlink_worker_start()) {
+        error("Failed to start the message handler thread");
+        goto stop_writer;
+    }
+
+    if ((g_raw_listener.fd != INVALID_SOCKET) &&
+        (pipe2(g_raw_pipe, O_NONBLOCK | O_CLOEXEC) < 0)) {
+        error("Failed to create raw client pipe: %s", strerror(errno));
+        goto stop_writer;
+    }
+
+    status(
+        "Serving %s @ %u bps (parity %s, %d data bits, "
+        "and %s stop bits) on port %u as link %d",
+        serial_path, cfg->baudrate, parity_to_string(cfg->parity),
+        cfg->data_bits, stop_bits_to_string(cfg->stop_bits), port,
+        serial_link_id());
+
+    if (g_redundant != SERIAL_INVALID_FD)
+        status("Merging the redundant serial port %s", redundant_path);
+
+    if (g_raw_listener.fd != INVALID_SOCKET)
+        status("Serving raw passthrough clients on port %u", g_config.raw_port);
+
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        if (g_endpoints[i].fd != INVALID_SOCKET)
+            status("Serving filtered clients on port %u",
+                   g_config.endpoints[i].port);
+    }
+
+    for (int i = 0; i < SERVER_UDP_MAX; i++) {
+        if (g_udp[i] && g_udp[i]->udp_learn)
+            status("Serving UDP clients on port %d", g_config.udp[i].port);
+        else if (g_udp[i])
+            status("Sending UDP to %s:%u", g_udp[i]->addr, g_udp[i]->port);
+    }
+
+    /* Wait until the connection is established to the flight controller */
+    while (!flight_controller_connected()) {
+        /* Send autopilot capabilities message */
+        mavlink_send_request_autopilot_capabilities(serial);
 
+        /* Wait for a while */
+        if (wait_for_shutdown(500)) {
+            ret_val = EXIT_SUCCESS;
+            goto stop_writer;
+        }
+
+        /* Attempt to receive autopilot version message from the flight
+         * controller */
+        long rbytes = serial_read(serial, g_cache, sizeof(g_cache));
+        if (rbytes > 0)
+            read_mavlink_msg(g_cache, rbytes, NULL);
+
+        if (g_redundant == SERIAL_INVALID_FD)
+            continue;
+
+        rbytes = serial_read(g_redundant, g_redundant_cache,
+                             sizeof(g_redundant_cache));
+        if (rbytes > 0)
+            read_redundant_mavlink_msg(g_redundant_cache, rbytes, NULL);
+    }
+
+    measure_serial_latency(cfg, get_serial_latency_probes());
+
+    if ((g_route_fd = mavlink_router_open()) < 0) {
+        error("Failed to create the client route queue: %s", strerror(errno));
+        goto stop_writer;
+    }
+
+    g_rate_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_rate_fd < 0) {
+        error("Failed to create the client rate timer: %s", strerror(errno));
+        goto stop_writer;
+    }
+
+    if (!setup_event_loop())
+        goto stop_writer;
+
+    /* Main server loop */
+    ret_val = run_event_loop(serial_path);
+
+    /* Gracefully shut down all clients */
+    while (g_clients)
+        terminate_client(g_clients);
+    for (int i = 0; i < SERVER_UDP_MAX; i++)
+        terminate_client(g_udp[i]);
+    reap_clients();
+    teardown_event_loop();
+
+stop_writer:
+    mavlink_router_close();
+    g_route_fd = -1;
+    if (g_rate_fd >= 0)
+        close(g_rate_fd);
+    g_rate_fd = -1;
+    g_rate_due_ns = 0;
+
+    /* Handlers may still queue replies */
+    mavlink_worker_stop();
+    serial_tx_stop();
+    print_worker_stats();
+    print_serial_tx_stats();
+    print_redundancy_stats();
+    print_traffic_stats();
+
+close_serial:
+    if (g_redundant != SERIAL_INVALID_FD)
+        serial_close(g_redundant);
     serial_close(serial);
 
 terminate:
-    closesocket(server);
+    for (int i = 0; i < SERVER_UDP_MAX; i++) {
+        if (g_udp[i] && (g_udp[i]->client != INVALID_SOCKET))
+            closesocket(g_udp[i]->client);
+    }
+    if (g_raw_pipe[0] >= 0) {
+        close(g_raw_pipe[0]);
+        close(g_raw_pipe[1]);
+    }
+    for (int i = 0; i < SERVER_ENDPOINT_MAX; i++) {
+        if (g_endpoints[i].fd != INVALID_SOCKET)
+            closesocket(g_endpoints[i].fd);
+    }
+    if (g_raw_listener.fd != INVALID_SOCKET)
+        closesocket(g_raw_listener.fd);
+    if (g_listener.fd != INVALID_SOCKET)
+        closesocket(g_listener.fd);
+    bcast_ring_free(&g_ring);
+    free(g_client_slots);
+    return ret_val;
+}
+
+/* An additional serial link, served by a thread of its own */
+struct SerialLink {
+    char *serial_path;
+    struct SerialConfig cfg;
+    unsigned port;
+    pthread_t thread;
+    bool started;
+};
+
+static struct SerialLink g_links[SERIAL_LINK_MAX];
+
+static void *serial_link_thread(void *args)
+{
+    struct SerialLink *link = (struct SerialLink *) args;
+
+    serial_link_bind(link - g_links);
+
+    if (serve_link(link->serial_path, &link->cfg, link->port) != EXIT_SUCCESS)
+        error("Serial link %d is down", serial_link_id());
+
+    return NULL;
+}
+
+/**
+ * A utility function that starts the threads of the additional serial links.
+ * A link that fails is reported and left down, the other links keep serving.
+ */
+static void start_serial_links(void)
+{
+    for (int i = 1; i < SERIAL_LINK_MAX; i++) {
+        struct SerialLink *link = &g_links[i];
+
+        if (!get_serial_link_config(i, &link->serial_path, &link->cfg,
+                                    &link->port))
+            continue;
+
+        if (pthread_create(&link->thread, NULL, serial_link_thread, link) !=
+            0) {
+            error("Failed to start serial link %d", i);
+            continue;
+        }
+        link->started = true;
+    }
+}
+
+/**
+ * A utility function that waits for the additional serial links to shut
+ * down, telling them to first if link 0 stopped on its own.
+ */
+static void stop_serial_links(void)
+{
+    char b = '\0';
+
+    write(g_close[1], &b, 1);
+
+    for (int i = 1; i < SERIAL_LINK_MAX; i++) {
+        if (g_links[i].started)
+            pthread_join(g_links[i].thread, NULL);
+    }
+}
+
+static pthread_t g_stats_thread;
+static bool g_stats_started;
+static int g_stats_interval; /* Seconds between traffic reports */
+
+/**
+ * A utility function that prints the traffic of every link each
+ * `stats-interval` seconds, until the server shuts down.
+ */
+static void *stats_report_thread(void *args)
+{
+    static struct traffic_stats prev[SERIAL_LINK_MAX], cur;
+    bool have_prev[SERIAL_LINK_MAX] = {false};
+    while (!wait_for_shutdown(g_stats_interval * 1000)) {
+        for (int link = 0; link < SERIAL_LINK_MAX; link++) {
+            if (!traffic_stats_snapshot(link, &cur))
+                continue;
+
+            traffic_stats_print(link, have_prev[link] ? &prev[link] : NULL,
+                                &cur);
+            prev[link] = cur;
+            have_prev[link] = true;
+        }
+    }
+
+    return NULL;
+}
+
+void *run_uart_server(void *args)
+{
+    /* Load UART server arguments */
+    uart_server_args_t *uart_server_args = (uart_server_args_t *) args;
+    char *serial_path;
+    char sim_path[64];
+    char *net_port = uart_server_args->net_port;
+
+    int ret_val = EXIT_FAILURE;
+
+    unsigned port = DEFAULT_PORT;
+    struct SerialConfig cfg;
+
+    get_serial_port_config(&serial_path, &cfg);
+
+    /* Serve the simulated flight controller instead of the serial port */
+    if (uart_server_args->fcu_sim) {
+        struct fcu_sim_config sim_cfg;
+
+        get_fcu_sim_config(&sim_cfg);
+        if (!fcu_sim_start(&sim_cfg, sim_path, sizeof(sim_path))) {
+            error("Failed to start the simulated flight controller");
+            exit(ret_val);
+        }
+        serial_path = sim_path;
+    }
+
+    /* Parse the TCP port if provided */
+    if (net_port) {
+        if ((!get_unsigned(net_port, strlen(net_port), &port) || (port == 0) ||
+             (port > 0xffff))) {
+            help("port must be in the range 1-65535");
+            exit(ret_val);
+        }
+    }
+
+    if (pipe(g_close) < 0) {
+        error("Failed to create shut down event: %s", strerror(errno));
+        exit(ret_val);
+    }
+
+    /* Register for application termination requests to allow graceful
+     * shut down
+     */
+    signal(SIGINT, sig_handler);
+    signal(SIGABRT, sig_handler);
+    signal(SIGTERM, sig_handler);
+
+    /* Dead clients are reported by send() and splice() errors instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Workaround for running in mintty (doesn't really matter everywhere
+     * else because we don't print that much)
+     */
+    setbuf(stdout, NULL);
+
+    mavlink_receiver_init();
+
+    if (!mavlink_command_start()) {
+        error("Failed to start the command worker threads");
+        exit(ret_val);
+    }
+
+    start_serial_links();
+
+    struct server_config server_cfg;
+    get_server_config(&server_cfg);
+    g_stats_interval = server_cfg.stats_interval;
+
+    if (g_stats_interval &&
+        (pthread_create(&g_stats_thread, NULL, stats_report_thread, NULL) ==
+         0))
+        g_stats_started = true;
+
+    /* Link 0 is served by this thread */
+    ret_val = serve_link(serial_path, &cfg, port);
+
+    stop_serial_links();
+    mavlink_command_stop();
+
+    if (g_stats_started)
+        pthread_join(g_stats_thread, NULL);
+    traffic_stats_free();
+    print_handler_stats();
+
+    /* Close both ends of shut down pipe */
+    close(g_close[0]);
+    close(g_close[1]);
+    close(cmd_fifo_w);
+    close(cmd_fifo_r);
+
+    fcu_sim_stop();
+    delete_pidfile();
     exit(ret_val);
 }
 
@@ -1,10 +1,66 @@
 #ifndef __UART_SERVER_H__
 #define __UART_SERVER_H__
 
+#include <stdbool.h>
+
+#include "bcast_ring.h"
+
+#define SERVER_ENDPOINT_MAX 4
+#define SERVER_UDP_MAX 4
+#define UPLINK_WEIGHT_MAX 100
+
 typedef struct {
     char *net_port;
+    bool fcu_sim; /* Serve a simulated flight controller, see fcu_sim.h */
 } uart_server_args_t;
 
+/* What to do with a client whose send queue cannot take more data */
+enum slow_client_policy {
+    SLOW_CLIENT_DROP_OLDEST, /* Discard the oldest queued bytes */
+    SLOW_CLIENT_DROP_CLIENT, /* Disconnect the client */
+    SLOW_CLIENT_STALL,       /* Stop reading the serial port until it drains */
+    SLOW_CLIENT_SHED,        /* Shed its messages by priority, then drop */
+};
+
+/* Which clients may write to the serial port */
+enum uplink_policy {
+    UPLINK_COMMANDER, /* Only the oldest client, frame by frame */
+    UPLINK_MERGE,     /* Every client, merged frame by frame */
+};
+
+/* An extra TCP port whose clients only receive the frames matching `filter` */
+struct server_endpoint {
+    int port; /* 0 if unused */
+    struct bcast_filter filter;
+    int uplink_weight; /* Share of the serial port with the merge policy */
+    struct bcast_rates rates; /* Rate caps of its clients */
+};
+
+/* A UDP endpoint. With a peer ("host:port") the serial stream is sent to it
+ * from the start, otherwise it is sent to whoever last sent a datagram to
+ * `port`. */
+struct server_udp_endpoint {
+    int port;   /* Local port, 0 for any in client mode */
+    char *peer; /* Empty in server mode */
+    int uplink_weight;
+    struct bcast_rates rates;
+};
+
+struct server_config {
+    int client_queue_size; /* Per-client send queue size in bytes */
+    enum slow_client_policy slow_client_policy;
+    int raw_port; /* TCP port for raw passthrough clients, 0 to disable */
+    int max_clients;    /* Size of the preallocated client table */
+    int listen_backlog; /* Pending connections queued by the kernel */
+    struct server_endpoint endpoints[SERVER_ENDPOINT_MAX];
+    struct server_udp_endpoint udp[SERVER_UDP_MAX];
+    enum uplink_policy uplink_policy;
+    int uplink_weight; /* Of the clients on the main and raw ports */
+    struct bcast_rates client_rates; /* Of the clients on the main port */
+    struct bcast_shed shed; /* Priority classes of the shed policy */
+    int stats_interval; /* Seconds between traffic reports, 0 to disable */
+};
+
 typedef struct {
     int type;    // Command type
     int arg[4];  // In case the action require some parameters
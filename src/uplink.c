@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "mavlink_receiver.h"
+#include "uplink.h"
+
+/* Sources with queued frames, in the order they get their turns. Every link
+ * merges its own clients in the thread that serves it. */
+static __thread struct uplink_source *g_active_head = NULL,
+                                     *g_active_tail = NULL;
+
+static void activate(struct uplink_source *src)
+{
+    src->active = true;
+    src->next = NULL;
+    src->prev = g_active_tail;
+
+    if (g_active_tail)
+        g_active_tail->next = src;
+    else
+        g_active_head = src;
+
+    g_active_tail = src;
+}
+
+static void unlink_source(struct uplink_source *src)
+{
+    if (src->prev)
+        src->prev->next = src->next;
+    else
+        g_active_head = src->next;
+
+    if (src->next)
+        src->next->prev = src->prev;
+    else
+        g_active_tail = src->prev;
+}
+
+static void deactivate(struct uplink_source *src)
+{
+    unlink_source(src);
+
+    src->active = false;
+    src->in_turn = false;
+    src->deficit = 0;
+    src->next = src->prev = NULL;
+}
+
+/**
+ * Sets up the uplink of a new client. A source with twice the weight of
+ * another gets twice its share of the serial port while both have frames
+ * queued.
+ */
+void uplink_source_init(struct uplink_source *src, int weight)
+{
+    memset(src, 0, sizeof(*src));
+    src->weight = weight > 0 ? weight : 1;
+}
+
+/**
+ * Forgets a source and the frames it still had queued.
+ */
+void uplink_source_remove(struct uplink_source *src)
+{
+    if (src->active)
+        deactivate(src);
+
+    src->head = src->tail = 0;
+}
+
+/**
+ * Queues a frame received from a client for merging. The caller drops the
+ * frames with a bad CRC, frames of messages missing from the compiled
+ * dialect cannot have their CRC checked and are queued as they are, like on
+ * the downlink.
+ */
+void uplink_feed(struct uplink_source *src,
+                 const struct mavlink_frame_view *frame)
+{
+    if ((src->tail - src->head == UPLINK_QUEUE_FRAMES) ||
+        (frame->len > SERIAL_TX_FRAME_MAX)) {
+        src->dropped++;
+        return;
+    }
+
+    struct uplink_frame *queued = &src->queue[src->tail % UPLINK_QUEUE_FRAMES];
+    memcpy(queued->data, frame->data, frame->len);
+    queued->len = frame->len;
+    src->tail++;
+
+    if (!src->active)
+        activate(src);
+}
+
+/**
+ * Merges the queued frames into the bulk lane of the serial writer, for as
+ * long as it has room, with deficit round robin: on its turn a source may
+ * send up to its weight times `UPLINK_QUANTUM` bytes, then goes to the back
+ * of the line. A turn cut short by a full lane is resumed on the next call.
+ */
+void uplink_flush(void)
+{
+    size_t space = serial_tx_space(SERIAL_TX_BULK);
+
+    while (space && g_active_head) {
+        struct uplink_source *src = g_active_head;
+
+        if (!src->in_turn) {
+            src->deficit += (size_t) src->weight * UPLINK_QUANTUM;
+            src->in_turn = true;
+        }
+
+        while (space && (src->head != src->tail)) {
+            struct uplink_frame *frame =
+                &src->queue[src->head % UPLINK_QUEUE_FRAMES];
+
+            if (frame->len > src->deficit)
+                break;
+
+            if (serial_tx_send(SERIAL_TX_BULK, frame->data, frame->len))
+                src->merged++;
+            else
+                src->dropped++;
+
+            src->deficit -= frame->len;
+            src->head++;
+            space--;
+        }
+
+        if (src->head == src->tail) {
+            deactivate(src);
+        } else if (space) {
+            /* Turn used up, go to the back of the line keeping the deficit
+             * left, so a frame too large for it gets through next time */
+            src->in_turn = false;
+            unlink_source(src);
+            activate(src);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef __UPLINK_H__
+#define __UPLINK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavlink_scan.h"
+#include "serial_tx.h"
+
+/* Frames a client may have waiting for the serial port */
+#define UPLINK_QUEUE_FRAMES 16
+
+/* Bytes a source may send per turn for every unit of weight, so even the
+ * lowest weight gets a whole frame through on every turn */
+#define UPLINK_QUANTUM SERIAL_TX_FRAME_MAX
+
+struct uplink_frame {
+    uint16_t len;
+    uint8_t data[SERIAL_TX_FRAME_MAX];
+};
+
+/* The uplink of one client. Its frames are queued whole, as its own scanner
+ * found them, so frames of different clients never mix. */
+struct uplink_source {
+    struct uplink_frame queue[UPLINK_QUEUE_FRAMES];
+    unsigned head; /* Next frame to merge */
+    unsigned tail; /* Next free slot */
+    int weight;
+    size_t deficit; /* Bytes left to send in the current turn */
+    bool in_turn;   /* The deficit of the current turn was granted */
+    bool active;    /* On the list of sources with queued frames */
+    struct uplink_source *next, *prev;
+
+    unsigned long merged;  /* Frames handed to the serial writer */
+    unsigned long dropped; /* Frames lost as the queue was full */
+};
+
+void uplink_source_init(struct uplink_source *src, int weight);
+void uplink_source_remove(struct uplink_source *src);
+void uplink_feed(struct uplink_source *src,
+                 const struct mavlink_frame_view *frame);
+void uplink_flush(void);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <sys/time.h>
 
+#include "crc16.h"
+
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
 
 static inline void bound_float(float *val, float max, float min)
@@ -21,8 +23,6 @@ static inline double get_time_sec(void)
     return (double) tv.tv_sec + (double) tv.tv_usec * 1e-6;
 }
 
-uint16_t crc16_calculate(uint8_t *ptr, uint32_t len);
-
 void status(const char *fmt, ...);
 
 #endif